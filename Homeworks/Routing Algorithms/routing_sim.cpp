@@ -5,11 +5,55 @@
 #include <fstream>
 #include <sstream>
 #include <iomanip>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <string>
 
 using namespace std;
 
 const int INF = 9999;
 
+// A network topology in compressed sparse row (CSR) form. The links leaving
+// node u are neighbor[offset[u]] .. neighbor[offset[u + 1] - 1], sorted by
+// neighbor, with their costs alongside, so memory grows with the number of
+// links instead of the square of the number of nodes.
+struct Graph {
+    int n = 0;
+    vector<int> offset;   // n + 1 entries
+    vector<int> neighbor; // the node each link leads to
+    vector<int> cost;     // the cost of each link
+};
+
+struct Link {
+    int from, to, cost;
+};
+
+// Builds the CSR form of a list of directed links. Self-links are dropped and,
+// of several links between the same two nodes, the cheapest is kept.
+Graph buildGraph(int n, vector<Link>& links) {
+    sort(links.begin(), links.end(), [](const Link& a, const Link& b) {
+        if (a.from != b.from) return a.from < b.from;
+        if (a.to != b.to) return a.to < b.to;
+        return a.cost < b.cost;
+    });
+    Graph graph;
+    graph.n = n;
+    graph.offset.assign(n + 1, 0);
+    for (size_t i = 0; i < links.size(); ++i) {
+        const Link& link = links[i];
+        if (link.from == link.to || (i > 0 && link.from == links[i - 1].from && link.to == links[i - 1].to)) continue;
+        graph.neighbor.push_back(link.to);
+        graph.cost.push_back(link.cost);
+        graph.offset[link.from + 1]++;
+    }
+    for (int u = 0; u < n; ++u) graph.offset[u + 1] += graph.offset[u];
+    return graph;
+}
+
 void printDVRTable(int node, const vector<vector<int>>& table, const vector<vector<int>>& nextHop) {
     cout << "Node " << node << " Routing Table:\n";
     cout << "Dest\tCost\tNext Hop\n";
@@ -17,26 +61,23 @@ void printDVRTable(int node, const vector<vector<int>>& table, const vector<vect
         cout << i << "\t" << table[node][i] << "\t";
         if (nextHop[node][i] == -1) cout << "-";
         else cout << nextHop[node][i];
-        cout << endl;
+        cout << '\n';
     }
-    cout << endl;
+    cout << '\n';
 }
 
-void simulateDVR(const vector<vector<int>>& graph) {
-    int n = graph.size();
-    vector<vector<int>> dist = graph;
-    vector<vector<int>> nextHop(n, vector<int>(n));
+void simulateDVR(const Graph& graph) {
+    int n = graph.n;
+    // Routing tables are inherently n x n; only the topology is sparse.
+    vector<vector<int>> dist(n, vector<int>(n, INF));
+    vector<vector<int>> nextHop(n, vector<int>(n, -1)); // -1: no path known yet
     
-    // Initialize the next hop table
+    // Initialize the tables from the direct links
     for (int i = 0; i < n; ++i) {
-        for (int j = 0; j < n; ++j) {
-            if (i == j) {
-                nextHop[i][j] = -1; // No hop needed for self
-            } else if (graph[i][j] != INF && graph[i][j] != 0) {
-                nextHop[i][j] = j; // Direct neighbor
-            } else {
-                nextHop[i][j] = -1; // No path known yet
-            }
+        dist[i][i] = 0; // No hop needed for self
+        for (int e = graph.offset[i]; e < graph.offset[i + 1]; ++e) {
+            dist[i][graph.neighbor[e]] = graph.cost[e];
+            nextHop[i][graph.neighbor[e]] = graph.neighbor[e]; // Direct neighbor
         }
     }
     
@@ -44,126 +85,324 @@ void simulateDVR(const vector<vector<int>>& graph) {
     cout << "--- DVR Initial Tables ---\n";
     for (int i = 0; i < n; ++i) printDVRTable(i, dist, nextHop);
     
+    // Nodes i with a link i -> j, by j: those that read j's vector
+    vector<int> inOffset(n + 1, 0), inNeighbor(graph.neighbor.size());
+    for (int e = 0; e < (int)graph.neighbor.size(); ++e) inOffset[graph.neighbor[e] + 1]++;
+    for (int j = 0; j < n; ++j) inOffset[j + 1] += inOffset[j];
+    vector<int> inFill(inOffset.begin(), inOffset.end() - 1);
+    for (int i = 0; i < n; ++i)
+        for (int e = graph.offset[i]; e < graph.offset[i + 1]; ++e)
+            inNeighbor[inFill[graph.neighbor[e]]++] = i;
+
+    // Rounds visit the nodes in order, as full sweeps over every node,
+    // neighbor and destination would, and update the tables in place. So a
+    // node sees the changes its lower-numbered neighbors made this round and
+    // the rest of its neighbors made last round. A node's entry can only
+    // improve through a neighbor whose entry for that destination changed
+    // since the node last looked at it, so each node records which of its
+    // destinations changed in a round, and its neighbors look only at those.
+    // This does the same updates in the same order as the full sweeps, down
+    // to which neighbor wins a tie, with work proportional to the updates.
+    vector<vector<int>> dirty[2];     // destinations changed, by node, for the last two rounds
+    vector<int> dirtyRound[2];        // the round each dirty list belongs to
+    vector<int> queuedRound[2];       // the round each node is queued for
+    priority_queue<int, vector<int>, greater<int>> worklist[2]; // nodes to visit, lowest first
+    vector<int> markedTurn(n, -1);    // last turn each destination was added to a dirty list
+    for (int p = 0; p < 2; ++p) {
+        dirty[p].assign(n, vector<int>());
+        dirtyRound[p].assign(n, -1);
+        queuedRound[p].assign(n, -1);
+    }
+
+    // Round 0 is the initial tables: every known route is news
+    for (int j = 0; j < n; ++j) {
+        dirtyRound[0][j] = 0;
+        for (int k = 0; k < n; ++k)
+            if (dist[j][k] != INF) dirty[0][j].push_back(k);
+        for (int e = inOffset[j]; e < inOffset[j + 1]; ++e) {
+            int i = inNeighbor[e];
+            if (queuedRound[1][i] != 1) {
+                queuedRound[1][i] = 1;
+                worklist[1].push(i);
+            }
+        }
+    }
+
     bool changed;
+    int round = 1;
     int iteration = 1;
-    
+    int turn = 0;
+
     do {
         changed = false;
-        
-        // Each node shares its distance vector with neighbors
-        for (int i = 0; i < n; ++i) {
-            for (int j = 0; j < n; ++j) {
-                if (i != j && graph[i][j] != INF && graph[i][j] != 0) { // For each neighbor
-                    for (int k = 0; k < n; ++k) { // For each destination
+        priority_queue<int, vector<int>, greater<int>>& current = worklist[round % 2];
+
+        while (!current.empty()) {
+            int i = current.top();
+            current.pop();
+            turn++;
+
+            // Each node reads what its neighbors changed since it last did
+            for (int e = graph.offset[i]; e < graph.offset[i + 1]; ++e) { // For each neighbor
+                int j = graph.neighbor[e], cost = graph.cost[e];
+                // Lower-numbered neighbors have had their turn this round;
+                // in the first round nothing has been read yet
+                int reads[2], count = 0;
+                if (j < i) {
+                    reads[count++] = round;
+                    if (round == 1) reads[count++] = 0;
+                } else {
+                    reads[count++] = round - 1;
+                }
+                for (int c = 0; c < count; ++c) {
+                    int r = reads[c];
+                    if (dirtyRound[r % 2][j] != r) continue;
+                    const vector<int>& news = dirty[r % 2][j];
+                    for (size_t d = 0; d < news.size(); ++d) { // For each changed destination
+                        int k = news[d];
                         // If there's a better path through neighbor j
-                        if (dist[i][k] > graph[i][j] + dist[j][k] && dist[j][k] != INF) {
-                            dist[i][k] = graph[i][j] + dist[j][k];
+                        if (dist[i][k] > cost + dist[j][k] && dist[j][k] != INF) {
+                            dist[i][k] = cost + dist[j][k];
                             nextHop[i][k] = j;
                             changed = true;
+                            if (dirtyRound[round % 2][i] != round) {
+                                dirtyRound[round % 2][i] = round;
+                                dirty[round % 2][i].clear();
+                            }
+                            if (markedTurn[k] == turn) continue;
+                            markedTurn[k] = turn;
+                            dirty[round % 2][i].push_back(k);
                         }
                     }
                 }
             }
+
+            // Neighbors after this node read the change this round, the
+            // ones before it next round
+            if (dirtyRound[round % 2][i] != round) continue;
+            for (int e = inOffset[i]; e < inOffset[i + 1]; ++e) {
+                int p = inNeighbor[e];
+                int r = p > i ? round : round + 1;
+                if (queuedRound[r % 2][p] != r) {
+                    queuedRound[r % 2][p] = r;
+                    worklist[r % 2].push(p);
+                }
+            }
         }
-        
+        round++;
+
         if (changed) {
             cout << "--- DVR Iteration " << iteration++ << " ---\n";
             for (int i = 0; i < n; ++i) printDVRTable(i, dist, nextHop);
         }
-        
+
     } while (changed);
-    
+
     cout << "--- DVR Final Tables ---\n";
     for (int i = 0; i < n; ++i) printDVRTable(i, dist, nextHop);
 }
 
-void printLSRTable(int src, const vector<int>& dist, const vector<int>& prev) {
-    cout << "Node " << src << " Routing Table:\n";
-    cout << "Dest\tCost\tNext Hop\n";
-    for (int i = 0; i < dist.size(); ++i) {
+// Per-thread working memory for Dijkstra's algorithm, reused from one source
+// to the next so a run allocates nothing once it has grown.
+struct DijkstraScratch {
+    vector<int> dist;
+    vector<int> prev;
+    vector<int> firstHop; // the neighbor of the source each path leaves by, -1 if none
+    vector<char> visited;
+    vector<pair<int, int>> heap; // (distance, node), a binary min-heap
+};
+
+// Dijkstra's algorithm from src, with a binary heap. Nodes at equal distance
+// are settled lowest-numbered first, exactly as a linear scan for the minimum
+// would, so ties between equal-cost paths resolve the same way.
+void dijkstra(const Graph& graph, int src, DijkstraScratch& s) {
+    int n = graph.n;
+    s.dist.assign(n, INF);
+    s.prev.assign(n, -1);
+    s.firstHop.assign(n, -1);
+    s.visited.assign(n, 0);
+    s.heap.clear();
+    greater<pair<int, int>> later;
+    s.dist[src] = 0;
+    s.heap.push_back(make_pair(0, src));
+    while (!s.heap.empty()) {
+        // Take the closest unvisited vertex, skipping entries for vertices
+        // that were reached more cheaply since they were pushed
+        pop_heap(s.heap.begin(), s.heap.end(), later);
+        int u = s.heap.back().second;
+        s.heap.pop_back();
+        if (s.visited[u]) continue;
+        s.visited[u] = true;
+        // Its predecessor was settled first, so its first hop is known
+        if (u != src) s.firstHop[u] = s.prev[u] == src ? u : s.firstHop[s.prev[u]];
+
+        // Update distances of adjacent vertices
+        for (int e = graph.offset[u]; e < graph.offset[u + 1]; ++e) {
+            int v = graph.neighbor[e];
+            if (!s.visited[v] && s.dist[u] + graph.cost[e] < s.dist[v]) {
+                s.dist[v] = s.dist[u] + graph.cost[e];
+                s.prev[v] = u;
+                s.heap.push_back(make_pair(s.dist[v], v));
+                push_heap(s.heap.begin(), s.heap.end(), later);
+            }
+        }
+    }
+}
+
+// Appends the routing table of src, from dijkstra()'s results, to out.
+void formatLSRTable(int src, const DijkstraScratch& s, string& out) {
+    out += "Node " + to_string(src) + " Routing Table:\n";
+    out += "Dest\tCost\tNext Hop\n";
+    for (int i = 0; i < (int)s.dist.size(); ++i) {
         if (i == src) continue;
-        cout << i << "\t" << dist[i] << "\t";
-        int hop = i;
-        while (prev[hop] != src && prev[hop] != -1)
-            hop = prev[hop];
-        cout << (prev[hop] == -1 ? -1 : hop) << endl;
+        out += to_string(i);
+        out += '\t';
+        out += to_string(s.dist[i]);
+        out += '\t';
+        out += to_string(s.firstHop[i]);
+        out += '\n';
     }
-    cout << endl;
+    out += '\n';
 }
 
-void simulateLSR(const vector<vector<int>>& graph) {
-    int n = graph.size();
+// Runs Dijkstra's algorithm from every source on a pool of threads, each with
+// its own scratch memory. Sources are handed out in order and their tables
+// printed in order; a thread waits rather than run more than window sources
+// ahead of the printer, so finished tables do not pile up.
+void simulateLSR(const Graph& graph, int threads) {
+    int n = graph.n;
+    int window = 4 * threads;
+    vector<string> tables(window); // by source, modulo window
+    vector<char> ready(window, 0);
+    int printed = 0;
+    atomic<int> nextSource(0);
+    mutex tablesMutex;
+    condition_variable tableReady, slotFree;
+
+    auto worker = [&]() {
+        DijkstraScratch scratch;
+        string out;
+        while (true) {
+            int src = nextSource.fetch_add(1);
+            if (src >= n) return;
+            dijkstra(graph, src, scratch);
+            out.clear();
+            formatLSRTable(src, scratch, out);
+            unique_lock<mutex> lock(tablesMutex);
+            slotFree.wait(lock, [&] { return src < printed + window; });
+            tables[src % window].swap(out);
+            ready[src % window] = 1;
+            tableReady.notify_one();
+        }
+    };
+    vector<thread> pool;
+    for (int t = 0; t < threads; ++t) pool.push_back(thread(worker));
+
+    string table;
     for (int src = 0; src < n; ++src) {
-        vector<int> dist(n, INF);
-        vector<int> prev(n, -1);
-        vector<bool> visited(n, false);
-        dist[src] = 0;
-        
-        // Dijkstra's algorithm for LSR
-        for (int count = 0; count < n; ++count) {
-            // Find vertex with minimum distance
-            int u = -1;
-            int minDist = INF;
-            for (int v = 0; v < n; ++v) {
-                if (!visited[v] && dist[v] < minDist) {
-                    minDist = dist[v];
-                    u = v;
-                }
-            }
-            
-            // If we can't find a vertex, break
-            if (u == -1) break;
-            
-            // Mark the vertex as visited
-            visited[u] = true;
-            
-            // Update distances of adjacent vertices
-            for (int v = 0; v < n; ++v) {
-                if (!visited[v] && graph[u][v] != 0 && graph[u][v] != INF && 
-                    dist[u] + graph[u][v] < dist[v]) {
-                    dist[v] = dist[u] + graph[u][v];
-                    prev[v] = u;
-                }
-            }
+        {
+            unique_lock<mutex> lock(tablesMutex);
+            tableReady.wait(lock, [&] { return ready[src % window] != 0; });
+            table.swap(tables[src % window]);
+            ready[src % window] = 0;
+            printed++;
         }
-        
-        printLSRTable(src, dist, prev);
+        slotFree.notify_all();
+        cout << table;
     }
+    for (size_t t = 0; t < pool.size(); ++t) pool[t].join();
 }
 
-vector<vector<int>> readGraphFromFile(const string& filename) {
+// Reads a topology in either input format, told apart by the first line:
+//   "n"    an n x n adjacency matrix follows, where 0 and INF mean no link
+//   "n m"  m lines "u v cost" follow, each a link both ways between nodes
+//          u and v, numbered from 0; as in the matrix, a cost of 0 or INF
+//          means no link
+Graph readGraphFromFile(const string& filename) {
     ifstream file(filename);
     if (!file.is_open()) {
         cerr << "Error: Could not open file " << filename << endl;
         exit(1);
     }
     
+    string header;
+    getline(file, header);
+    istringstream fields(header);
     int n;
-    file >> n;
-    vector<vector<int>> graph(n, vector<int>(n));
+    long long m;
+    bool edgeList;
+    bool haveNodes = (fields >> n) && n >= 0;
+    edgeList = haveNodes && static_cast<bool>(fields >> m);
+    if (!haveNodes || (edgeList && m < 0)) {
+        cerr << "Error: " << filename << " does not start with the number of nodes" << endl;
+        exit(1);
+    }
 
-    for (int i = 0; i < n; ++i)
-        for (int j = 0; j < n; ++j)
-            file >> graph[i][j];
+    vector<Link> links;
+    if (edgeList) {
+        // The header is only a claim until the links are read, so memory is
+        // reserved up front for at most a million of them.
+        links.reserve(2 * min(m, 1LL << 20));
+        for (long long i = 0; i < m; ++i) {
+            int u, v, cost;
+            if (!(file >> u >> v >> cost) || u < 0 || u >= n || v < 0 || v >= n) {
+                cerr << "Error: " << filename << ": link " << i + 1 << " is not \"u v cost\" with nodes below " << n << endl;
+                exit(1);
+            }
+            if (cost == 0 || cost == INF) continue;
+            links.push_back({u, v, cost});
+            links.push_back({v, u, cost});
+        }
+    } else {
+        for (int i = 0; i < n; ++i) {
+            for (int j = 0; j < n; ++j) {
+                int cost;
+                file >> cost;
+                if (cost != 0 && cost != INF) links.push_back({i, j, cost});
+            }
+        }
+    }
 
     file.close();
-    return graph;
+    return buildGraph(n, links);
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        cerr << "Usage: " << argv[0] << " <input_file>\n";
+    // --threads sets how many sources LSR works on at once (default: one per
+    // CPU); --algorithm runs only one simulation, since DVR's tables need
+    // n x n memory that large topologies do not have.
+    int threads = max(1u, thread::hardware_concurrency());
+    string algorithm = "both";
+    string filename;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            threads = atoi(argv[++i]);
+        } else if (arg == "--algorithm" && i + 1 < argc) {
+            algorithm = argv[++i];
+        } else if (filename.empty() && arg.compare(0, 2, "--") != 0) {
+            filename = arg;
+        } else {
+            filename.clear();
+            break;
+        }
+    }
+    if (filename.empty() || (algorithm != "both" && algorithm != "dvr" && algorithm != "lsr")) {
+        cerr << "Usage: " << argv[0] << " [--threads N] [--algorithm dvr|lsr|both] <input_file>\n";
         return 1;
     }
 
-    string filename = argv[1];
-    vector<vector<int>> graph = readGraphFromFile(filename);
+    Graph graph = readGraphFromFile(filename);
 
-    cout << "\n--- Distance Vector Routing Simulation ---\n";
-    simulateDVR(graph);
+    if (algorithm != "lsr") {
+        cout << "\n--- Distance Vector Routing Simulation ---\n";
+        simulateDVR(graph);
+    }
 
-    cout << "\n--- Link State Routing Simulation ---\n";
-    simulateLSR(graph);
+    if (algorithm != "dvr") {
+        cout << "\n--- Link State Routing Simulation ---\n";
+        simulateLSR(graph, threads);
+    }
 
     return 0;
 }
\ No newline at end of file
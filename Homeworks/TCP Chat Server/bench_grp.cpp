@@ -0,0 +1,817 @@
+// Load generator and latency benchmark for server_grp.
+//
+// Simulates thousands of clients spread over a few epoll worker threads. Every
+// client logs in with generated credentials (benchN:pwN, the users.txt format),
+// the clients are split into groups, and then the workers send a configurable
+// mix of /msg, /broadcast and /group_msg at a fixed aggregate rate. Each
+// message carries the time it was scheduled to be sent, so the delivery
+// latency recorded by the receivers includes any time the sender spent
+// falling behind schedule instead of hiding it.
+//
+// The benchmark speaks the framed protocol: text-protocol messages have no
+// delimiters, so deliveries could not be told apart under load.
+//
+// With --server the benchmark starts its own server in a scratch directory
+// holding a generated users.txt; otherwise it connects to a running server,
+// whose users.txt can be produced with --write-users.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <memory>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cstdint>
+#include <cerrno>
+#include <climits>
+#include <ctime>
+#include <csignal>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "frame_codec.h"
+
+#define BENCH_PORT 12345
+#define BENCH_MAX_EVENTS 256
+#define BENCH_READ_SIZE 65536
+#define BENCH_PENDING_LOGINS 128 // logins in flight per worker
+#define BENCH_SETUP_TIMEOUT_MS 30000
+#define HIST_SUB_BITS 7 // 128 linear steps per power of two, under 1% error
+
+const char *userPrompt = "Enter username: ";
+const char *passPrompt = "Enter password: ";
+const char *welcomeText = "Welcome to the server";
+
+// Nanoseconds on the monotonic clock, which the server host and every client
+// share when the benchmark runs locally.
+int64_t now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Latency histogram in the style of HdrHistogram: values are bucketed by
+// power of two, and each power of two is split into 2^HIST_SUB_BITS linear
+// steps, so every value is kept to within 1% across the whole range at a
+// fixed size.
+class Histogram
+{
+public:
+    Histogram() : counts(64 << HIST_SUB_BITS) {}
+
+    void record(uint64_t value)
+    {
+        counts[index(value)]++;
+        total++;
+        largest = std::max(largest, value);
+    }
+
+    void merge(const Histogram &other)
+    {
+        for (size_t i = 0; i < counts.size(); i++)
+            counts[i] += other.counts[i];
+        total += other.total;
+        largest = std::max(largest, other.largest);
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t max() const { return largest; }
+
+    // The value below which the given percentage of recorded values fall.
+    uint64_t percentile(double percent) const
+    {
+        if (total == 0)
+            return 0;
+        uint64_t rank = std::max<uint64_t>(1, (uint64_t)(percent / 100.0 * total + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); i++)
+        {
+            seen += counts[i];
+            if (seen >= rank)
+                return std::min(highest_in(i), largest);
+        }
+        return largest;
+    }
+
+private:
+    static const uint64_t sub = 1 << HIST_SUB_BITS;
+
+    static size_t index(uint64_t value)
+    {
+        if (value < sub)
+            return value;
+        int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+        return (size_t)(shift + 1) * sub + ((value >> shift) - sub);
+    }
+
+    // Largest value that maps to bucket i.
+    static uint64_t highest_in(size_t i)
+    {
+        if (i < sub)
+            return i;
+        int shift = (int)(i / sub) - 1;
+        return ((sub + i % sub + 1) << shift) - 1;
+    }
+
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t largest = 0;
+};
+
+// Benchmark parameters, fixed before the workers start.
+struct Config
+{
+    std::string host = "127.0.0.1";
+    int port = BENCH_PORT;
+    int clients = 1000;
+    int threads = 4;
+    int groups = 10;
+    double duration = 10;  // seconds of load
+    double rate = 10000;   // commands per second, all clients together
+    double connectRate = 0; // logins started per second, 0 for as fast as possible
+    int payload = 64;      // message body bytes, including the timestamp
+    int weightMsg = 80, weightGroup = 19, weightBroadcast = 1;
+    std::string serverPath;
+    std::string serverArgs;
+    unsigned seed = 1;
+};
+
+enum Stage
+{
+    STAGE_CONNECT,
+    STAGE_CREATE_GROUPS,
+    STAGE_JOIN_GROUPS,
+    STAGE_LOAD,
+    STAGE_DRAIN,
+    STAGE_STOP
+};
+
+enum CommandKind
+{
+    KIND_MSG,
+    KIND_GROUP,
+    KIND_BROADCAST
+};
+
+Config config;
+std::atomic<int> stage{STAGE_CONNECT};
+std::atomic<int> loggedIn{0};
+std::atomic<int> loginFailures{0};
+std::atomic<int> setupAcks{0};     // "created" and "joined" replies
+std::atomic<int> disconnects{0};   // clients dropped after logging in
+
+std::string user_name(int i) { return "bench" + std::to_string(i); }
+std::string password(int i) { return "pw" + std::to_string(i); }
+std::string group_name(int g) { return "bg" + std::to_string(g); }
+
+// Members of group g, given that client i joins group i % groups.
+int group_size(int g)
+{
+    return config.clients / config.groups + (g < config.clients % config.groups);
+}
+
+// Where a simulated client is in its lifetime.
+enum class Phase
+{
+    Idle,       // not connected yet
+    Connecting, // non-blocking connect in progress
+    AwaitUser,  // waiting for the username prompt
+    AwaitPass,  // waiting for the password prompt
+    AwaitWelcome,
+    Ready,
+    Dead
+};
+
+struct BenchClient
+{
+    int fd = -1;
+    int index;
+    Phase phase = Phase::Idle;
+    std::string prompt;  // text received during login
+    FrameParser frames;
+    std::string outbuf;  // bytes the socket has not taken yet
+    int64_t loginStart = 0;
+};
+
+// One epoll loop driving a share of the clients.
+class Worker
+{
+public:
+    Histogram latency; // microseconds from scheduled send to delivery
+    Histogram login;   // microseconds from connect() to the welcome message
+    uint64_t sent[3] = {0, 0, 0};
+    uint64_t expected = 0;  // deliveries the sent commands should cause
+    uint64_t delivered = 0;
+    uint64_t lateSends = 0; // sends more than a millisecond behind schedule
+
+    Worker(int id, std::vector<int> members) : id(id), rng(config.seed * 7919 + id)
+    {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        for (int index : members)
+        {
+            clients.emplace_back();
+            clients.back().index = index;
+        }
+    }
+
+    void run()
+    {
+        epoll_event events[BENCH_MAX_EVENTS];
+        int seen = -1;
+        while (true)
+        {
+            int current = stage.load();
+            if (current == STAGE_STOP)
+                break;
+            if (current != seen)
+            {
+                enter(current);
+                seen = current;
+            }
+            if (current == STAGE_CONNECT)
+                start_logins();
+            if (current == STAGE_LOAD)
+                send_due();
+
+            int n = epoll_wait(epfd, events, BENCH_MAX_EVENTS, 1);
+            for (int i = 0; i < n; i++)
+            {
+                BenchClient &client = clients[events[i].data.u32];
+                if (events[i].events & EPOLLOUT)
+                    writable(client);
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    readable(client);
+            }
+        }
+        for (BenchClient &client : clients)
+        {
+            if (client.fd >= 0)
+                close(client.fd);
+        }
+        close(epfd);
+    }
+
+private:
+    void enter(int next)
+    {
+        for (BenchClient &client : clients)
+        {
+            if (client.phase != Phase::Ready)
+                continue;
+            std::string out;
+            if (next == STAGE_CREATE_GROUPS && client.index < config.groups)
+                encode_frame(out, OP_CREATE_GROUP, group_name(client.index));
+            else if (next == STAGE_JOIN_GROUPS && client.index >= config.groups)
+                encode_frame(out, OP_JOIN_GROUP, group_name(client.index % config.groups));
+            if (!out.empty())
+                send_bytes(client, out);
+        }
+        if (next == STAGE_LOAD)
+        {
+            for (BenchClient &client : clients)
+            {
+                if (client.phase == Phase::Ready)
+                    ready.push_back(&client - clients.data());
+            }
+            loadStart = now_ns();
+            scheduled = 0;
+        }
+    }
+
+    // Starts connecting idle clients, subject to the connect rate and the cap
+    // on logins in flight.
+    void start_logins()
+    {
+        int64_t now = now_ns();
+        if (connectStart == 0)
+            connectStart = now;
+        double perWorker = config.connectRate / config.threads;
+        while (nextIdle < clients.size() && pending < BENCH_PENDING_LOGINS)
+        {
+            if (perWorker > 0 && started >= (now - connectStart) / 1e9 * perWorker)
+                return;
+            connect_client(clients[nextIdle++]);
+            started++;
+        }
+    }
+
+    void connect_client(BenchClient &client)
+    {
+        client.loginStart = now_ns();
+        client.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int one = 1;
+        setsockopt(client.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(config.port);
+        inet_pton(AF_INET, config.host.c_str(), &addr.sin_addr);
+        pending++;
+        if (connect(client.fd, (sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)
+        {
+            fail(client);
+            return;
+        }
+        client.phase = Phase::Connecting;
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.u32 = &client - clients.data();
+        epoll_ctl(epfd, EPOLL_CTL_ADD, client.fd, &ev);
+    }
+
+    void fail(BenchClient &client)
+    {
+        if (client.phase == Phase::Ready)
+            disconnects++;
+        else
+        {
+            loginFailures++;
+            pending--;
+        }
+        client.phase = Phase::Dead;
+        if (client.fd >= 0)
+            close(client.fd);
+        client.fd = -1;
+    }
+
+    void writable(BenchClient &client)
+    {
+        if (client.phase == Phase::Connecting)
+        {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(client.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err != 0)
+            {
+                fail(client);
+                return;
+            }
+            client.phase = Phase::AwaitUser;
+        }
+        flush(client);
+    }
+
+    void readable(BenchClient &client)
+    {
+        char buffer[BENCH_READ_SIZE];
+        while (client.phase != Phase::Dead)
+        {
+            ssize_t n = read(client.fd, buffer, sizeof(buffer));
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                fail(client);
+                return;
+            }
+            received(client, buffer, n);
+        }
+    }
+
+    void received(BenchClient &client, const char *data, size_t len)
+    {
+        if (client.phase == Phase::AwaitUser || client.phase == Phase::AwaitPass)
+        {
+            // The prompts are plain text, sent before the client opts into framing.
+            client.prompt.append(data, len);
+            if (client.phase == Phase::AwaitUser && client.prompt.find(userPrompt) != std::string::npos)
+            {
+                client.prompt.clear();
+                client.phase = Phase::AwaitPass;
+                send_bytes(client, (char)FRAME_MAGIC + user_name(client.index));
+            }
+            else if (client.phase == Phase::AwaitPass && client.prompt.find(passPrompt) != std::string::npos)
+            {
+                client.prompt.clear();
+                client.phase = Phase::AwaitWelcome;
+                send_bytes(client, password(client.index));
+            }
+            return;
+        }
+        bool ok = client.frames.feed(data, len, [&](uint8_t op, std::string_view text)
+        {
+            if (op == OP_TEXT)
+                on_text(client, text);
+        });
+        if (!ok)
+            fail(client);
+    }
+
+    void on_text(BenchClient &client, std::string_view text)
+    {
+        if (client.phase == Phase::AwaitWelcome)
+        {
+            if (text == welcomeText)
+            {
+                client.phase = Phase::Ready;
+                pending--;
+                loggedIn++;
+                login.record((now_ns() - client.loginStart) / 1000);
+            }
+            else if (text.find("Authentication Failed") != std::string_view::npos)
+                fail(client);
+            return;
+        }
+        // Chat messages arrive as "[sender]: body", with the body starting
+        // with its scheduled send time.
+        size_t body = text.find("]: ");
+        if (!text.empty() && text[0] == '[' && body != std::string_view::npos)
+        {
+            int64_t sentAt = 0;
+            for (size_t i = body + 3; i < text.size() && text[i] >= '0' && text[i] <= '9'; i++)
+                sentAt = sentAt * 10 + (text[i] - '0');
+            delivered++;
+            latency.record(std::max<int64_t>(0, now_ns() - sentAt) / 1000);
+        }
+        else if (text.substr(0, 6) == "Group " || text.substr(0, 20) == "You joined the group")
+            setupAcks++;
+    }
+
+    // Sends every command whose scheduled time has come.
+    void send_due()
+    {
+        if (ready.empty())
+            return;
+        int64_t now = now_ns();
+        double interval = 1e9 * config.threads / config.rate;
+        int totalWeight = config.weightMsg + config.weightGroup + config.weightBroadcast;
+        while (true)
+        {
+            int64_t due = loadStart + (int64_t)(scheduled * interval);
+            if (due > now)
+                return;
+            scheduled++;
+            if (now - due > 1000000)
+                lateSends++;
+
+            BenchClient &client = clients[ready[rng() % ready.size()]];
+            if (client.phase != Phase::Ready)
+                continue;
+            std::string body = std::to_string(due) + ' ';
+            if ((int)body.size() < config.payload)
+                body.append(config.payload - body.size(), 'x');
+
+            std::string out;
+            int pick = rng() % totalWeight;
+            if (pick < config.weightMsg && config.clients > 1)
+            {
+                int target = rng() % (config.clients - 1);
+                if (target >= client.index)
+                    target++;
+                encode_named_frame(out, OP_MSG, user_name(target), body);
+                sent[KIND_MSG]++;
+                expected++;
+            }
+            else if (pick < config.weightMsg + config.weightGroup)
+            {
+                int g = client.index % config.groups;
+                encode_named_frame(out, OP_GROUP_MSG, group_name(g), body);
+                sent[KIND_GROUP]++;
+                expected += group_size(g) - 1;
+            }
+            else
+            {
+                encode_frame(out, OP_BROADCAST, body);
+                sent[KIND_BROADCAST]++;
+                expected += loggedIn.load() - 1;
+            }
+            send_bytes(client, out);
+        }
+    }
+
+    void send_bytes(BenchClient &client, const std::string &bytes)
+    {
+        client.outbuf += bytes;
+        flush(client);
+    }
+
+    void flush(BenchClient &client)
+    {
+        while (!client.outbuf.empty() && client.phase != Phase::Dead && client.phase != Phase::Connecting)
+        {
+            ssize_t n = send(client.fd, client.outbuf.data(), client.outbuf.size(), MSG_NOSIGNAL);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    fail(client);
+                return; // EPOLLOUT resumes
+            }
+            client.outbuf.erase(0, n);
+        }
+    }
+
+    int id;
+    int epfd;
+    std::mt19937_64 rng;
+    std::vector<BenchClient> clients;
+    std::vector<int> ready; // clients that finished logging in, as indices
+    size_t nextIdle = 0;
+    int pending = 0;        // logins in flight
+    int64_t started = 0;
+    int64_t connectStart = 0;
+    int64_t loadStart = 0;
+    int64_t scheduled = 0;  // commands scheduled since loadStart
+};
+
+// Writes credentials for every simulated client in the users.txt format.
+void write_users(const std::string &path)
+{
+    std::ofstream file(path);
+    for (int i = 0; i < config.clients; i++)
+        file << user_name(i) << ':' << password(i) << '\n';
+    if (!file)
+    {
+        std::cerr << "Cannot write " << path << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Starts the server in a scratch directory holding generated credentials and
+// waits until it accepts connections. Returns its pid.
+pid_t start_server(std::string &dir)
+{
+    char resolved[PATH_MAX];
+    if (!realpath(config.serverPath.c_str(), resolved))
+    {
+        perror(config.serverPath.c_str());
+        exit(EXIT_FAILURE);
+    }
+    char scratch[] = "/tmp/chatbench.XXXXXX";
+    if (!mkdtemp(scratch))
+    {
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+    dir = scratch;
+    write_users(dir + "/users.txt");
+
+    std::vector<std::string> args = {resolved};
+    std::istringstream split(config.serverArgs);
+    for (std::string arg; split >> arg;)
+        args.push_back(arg);
+    // After --server-args so the port the benchmark connects to is the one
+    // the server listens on.
+    args.push_back("--port");
+    args.push_back(std::to_string(config.port));
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        if (chdir(dir.c_str()) < 0)
+            _exit(127);
+        int log = open((dir + "/server.log").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        dup2(log, STDOUT_FILENO);
+        dup2(log, STDERR_FILENO);
+        std::vector<char *> argv;
+        for (std::string &arg : args)
+            argv.push_back(arg.data());
+        argv.push_back(nullptr);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+
+    for (int attempt = 0; attempt < 100; attempt++)
+    {
+        usleep(50000);
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(config.port);
+        inet_pton(AF_INET, config.host.c_str(), &addr.sin_addr);
+        bool up = connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0;
+        close(fd);
+        if (up)
+            return pid;
+        if (waitpid(pid, nullptr, WNOHANG) == pid)
+            break;
+    }
+    std::cerr << "Server did not start, see " << dir << "/server.log" << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+void stop_server(pid_t pid, const std::string &dir)
+{
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+    unlink((dir + "/users.txt").c_str());
+    unlink((dir + "/server.log").c_str());
+    rmdir(dir.c_str());
+}
+
+// Waits until done() holds, giving up once it has made no progress for
+// BENCH_SETUP_TIMEOUT_MS. progress() reports a counter that moves forward.
+template <typename Done, typename Progress>
+bool wait_for(Done done, Progress progress)
+{
+    long last = -1;
+    int64_t lastChange = now_ns();
+    while (!done())
+    {
+        long current = progress();
+        if (current != last)
+        {
+            last = current;
+            lastChange = now_ns();
+        }
+        else if (now_ns() - lastChange > (int64_t)BENCH_SETUP_TIMEOUT_MS * 1000000)
+            return false;
+        usleep(1000);
+    }
+    return true;
+}
+
+void print_latency(const char *label, const Histogram &hist)
+{
+    auto ms = [](uint64_t us) { return us / 1000.0; };
+    printf("%-16s p50 %8.3f  p90 %8.3f  p99 %8.3f  p99.9 %8.3f  max %8.3f ms  (%llu samples)\n", label,
+           ms(hist.percentile(50)), ms(hist.percentile(90)), ms(hist.percentile(99)),
+           ms(hist.percentile(99.9)), ms(hist.max()), (unsigned long long)hist.count());
+}
+
+bool parse_mix(const std::string &mix)
+{
+    // msg:W,group:W,broadcast:W, any subset, others default to 0.
+    config.weightMsg = config.weightGroup = config.weightBroadcast = 0;
+    std::istringstream items(mix);
+    for (std::string item; std::getline(items, item, ',');)
+    {
+        size_t colon = item.find(':');
+        if (colon == std::string::npos)
+            return false;
+        std::string kind = item.substr(0, colon);
+        int weight = atoi(item.c_str() + colon + 1);
+        if (weight < 0)
+            return false;
+        if (kind == "msg")
+            config.weightMsg = weight;
+        else if (kind == "group")
+            config.weightGroup = weight;
+        else if (kind == "broadcast")
+            config.weightBroadcast = weight;
+        else
+            return false;
+    }
+    return config.weightMsg + config.weightGroup + config.weightBroadcast > 0;
+}
+
+void usage(const char *prog)
+{
+    std::cerr << "Usage: " << prog << " [options]\n"
+              << "  --server PATH          start this server binary with generated credentials\n"
+              << "  --server-args \"ARGS\"   arguments for the started server\n"
+              << "  --host ADDR            server address (default 127.0.0.1)\n"
+              << "  --port PORT            server port, also given to a started server (default " << BENCH_PORT << ")\n"
+              << "  --clients N            simulated clients (default 1000)\n"
+              << "  --threads N            load generator threads (default 4)\n"
+              << "  --groups N             groups the clients are split into (default 10)\n"
+              << "  --duration SECONDS     length of the load phase (default 10)\n"
+              << "  --rate N               commands per second across all clients (default 10000)\n"
+              << "  --connect-rate N       logins started per second (default: unlimited)\n"
+              << "  --mix msg:W,group:W,broadcast:W   command weights (default msg:80,group:19,broadcast:1)\n"
+              << "  --payload BYTES        message body size (default 64)\n"
+              << "  --seed N               random seed\n"
+              << "  --write-users FILE     write the generated users.txt and exit\n";
+}
+
+int main(int argc, char *argv[])
+{
+    std::string usersOut;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--server" && hasValue)
+            config.serverPath = argv[++i];
+        else if (arg == "--server-args" && hasValue)
+            config.serverArgs = argv[++i];
+        else if (arg == "--host" && hasValue)
+            config.host = argv[++i];
+        else if (arg == "--port" && hasValue)
+            config.port = atoi(argv[++i]);
+        else if (arg == "--clients" && hasValue)
+            config.clients = atoi(argv[++i]);
+        else if (arg == "--threads" && hasValue)
+            config.threads = atoi(argv[++i]);
+        else if (arg == "--groups" && hasValue)
+            config.groups = atoi(argv[++i]);
+        else if (arg == "--duration" && hasValue)
+            config.duration = atof(argv[++i]);
+        else if (arg == "--rate" && hasValue)
+            config.rate = atof(argv[++i]);
+        else if (arg == "--connect-rate" && hasValue)
+            config.connectRate = atof(argv[++i]);
+        else if (arg == "--payload" && hasValue)
+            config.payload = atoi(argv[++i]);
+        else if (arg == "--seed" && hasValue)
+            config.seed = atoi(argv[++i]);
+        else if (arg == "--write-users" && hasValue)
+            usersOut = argv[++i];
+        else if (arg == "--mix" && hasValue && parse_mix(argv[i + 1]))
+            i++;
+        else
+        {
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (config.port < 1 || config.port > 65535 || config.clients < 1 || config.threads < 1 || config.groups < 1 || config.groups > config.clients ||
+        config.rate <= 0 || config.duration <= 0 || config.payload < 0)
+    {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (!usersOut.empty())
+    {
+        write_users(usersOut);
+        return 0;
+    }
+
+    struct rlimit lim;
+    getrlimit(RLIMIT_NOFILE, &lim);
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &lim);
+
+    std::string serverDir;
+    pid_t serverPid = -1;
+    if (!config.serverPath.empty())
+        serverPid = start_server(serverDir);
+
+    // Client i belongs to worker i % threads.
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (int w = 0; w < config.threads; w++)
+    {
+        std::vector<int> members;
+        for (int i = w; i < config.clients; i += config.threads)
+            members.push_back(i);
+        workers.push_back(std::make_unique<Worker>(w, members));
+    }
+    std::vector<std::thread> threads;
+    for (auto &worker : workers)
+        threads.emplace_back([&worker] { worker->run(); });
+
+    int64_t connectStart = now_ns();
+    wait_for([] { return loggedIn + loginFailures == config.clients; }, [] { return (long)loggedIn + loginFailures; });
+    double connectSecs = (now_ns() - connectStart) / 1e9;
+
+    // Group creators first, then everyone else joins.
+    stage = STAGE_CREATE_GROUPS;
+    wait_for([] { return setupAcks >= config.groups; }, [] { return (long)setupAcks; });
+    stage = STAGE_JOIN_GROUPS;
+    int clientsReady = loggedIn;
+    wait_for([&] { return setupAcks >= clientsReady; }, [] { return (long)setupAcks; });
+
+    stage = STAGE_LOAD;
+    int64_t loadStart = now_ns();
+    usleep((useconds_t)(config.duration * 1e6));
+    stage = STAGE_DRAIN;
+    double loadSecs = (now_ns() - loadStart) / 1e9;
+    usleep(2000000); // let deliveries in flight arrive
+    stage = STAGE_STOP;
+    for (auto &thread : threads)
+        thread.join();
+    if (serverPid > 0)
+        stop_server(serverPid, serverDir);
+
+    Histogram latency, login;
+    uint64_t sent[3] = {0, 0, 0}, expected = 0, delivered = 0, late = 0;
+    for (auto &worker : workers)
+    {
+        latency.merge(worker->latency);
+        login.merge(worker->login);
+        for (int k = 0; k < 3; k++)
+            sent[k] += worker->sent[k];
+        expected += worker->expected;
+        delivered += worker->delivered;
+        late += worker->lateSends;
+    }
+    uint64_t totalSent = sent[KIND_MSG] + sent[KIND_GROUP] + sent[KIND_BROADCAST];
+
+    printf("clients          %d logged in, %d failed, %d disconnected during load\n", loggedIn.load(),
+           loginFailures.load(), disconnects.load());
+    printf("connect          %.2f s, %.0f logins/s\n", connectSecs, loggedIn / connectSecs);
+    print_latency("login latency", login);
+    printf("sent             %llu commands in %.2f s, %.0f/s (msg %llu, group %llu, broadcast %llu), %llu behind schedule\n",
+           (unsigned long long)totalSent, loadSecs, totalSent / loadSecs, (unsigned long long)sent[KIND_MSG],
+           (unsigned long long)sent[KIND_GROUP], (unsigned long long)sent[KIND_BROADCAST], (unsigned long long)late);
+    printf("delivered        %llu of %llu expected, %.0f/s\n", (unsigned long long)delivered,
+           (unsigned long long)expected, delivered / loadSecs);
+    print_latency("delivery latency", latency);
+    return 0;
+}
@@ -8,14 +8,122 @@
 #include <unordered_set>
 #include <vector>
 #include <sstream>
+#include <fstream>
+#include <chrono>
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <cstdio>
 #include <cstring>
 #include <cstdlib>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include "frame_codec.h"
+#include "tls.h"
+#include "compress.h"
 
 #define BUFFER_SIZE 1024
+#define BATCH_IO_SIZE 65536 // bytes per send(), recv() and stdout write in batch mode
+#define BATCH_WINDOW 1024   // default commands in flight in batch mode
 
 std::mutex cout_mutex;
+std::string tls_session_file; // where to keep the TLS session for the next run, if anywhere
+std::unique_ptr<Inflater> inflater; // --compress: ready before the server is asked
+
+// Turns an OP_ZTEXT frame into the OP_TEXT frame it stands for, inflating it
+// into text. Returns false if it cannot be inflated.
+bool expand_frame(uint8_t &op, std::string_view &payload, std::string &text) {
+    if (op != OP_ZTEXT) return true;
+    if (!inflater || !inflater->decompress(payload, text)) return false;
+    op = OP_TEXT;
+    payload = text;
+    return true;
+}
+
+// The server's answer to OP_COMPRESS, which is empty if it will not compress.
+const char *compress_refused(std::string_view answer) {
+    return answer.empty() ? "The server does not compress messages, or not with this dictionary." : nullptr;
+}
+
+// Saves each session ticket the server sends, so the next run can resume.
+int save_tls_session(SSL *, SSL_SESSION *session) {
+    FILE *file = fopen(tls_session_file.c_str(), "w");
+    if (file) {
+        PEM_write_SSL_SESSION(file, session);
+        fclose(file);
+    }
+    return 0; // the session is not kept in memory
+}
+
+// Runs the TLS handshake on a connected socket, checking that the server's
+// certificate is signed by ca_file (or a system CA if empty) and names
+// 127.0.0.1, and resuming the session in tls_session_file if there is one.
+// Returns a descriptor that carries the session in plain text, or -1.
+int start_tls(int server_socket, const std::string &ca_file) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (!ctx) {
+        std::cerr << "TLS: " << tls_error() << std::endl;
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+    if ((ca_file.empty() ? SSL_CTX_set_default_verify_paths(ctx)
+                         : SSL_CTX_load_verify_locations(ctx, ca_file.c_str(), nullptr)) != 1) {
+        std::cerr << "TLS: " << (ca_file.empty() ? "" : ca_file + ": ") << tls_error() << std::endl;
+        return -1;
+    }
+    X509_VERIFY_PARAM_set1_ip_asc(SSL_CTX_get0_param(ctx), "127.0.0.1");
+    if (!tls_session_file.empty()) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(ctx, save_tls_session);
+    }
+
+    SSL *ssl = SSL_new(ctx);
+    SSL_set_fd(ssl, server_socket);
+    if (FILE *file = tls_session_file.empty() ? nullptr : fopen(tls_session_file.c_str(), "r")) {
+        if (SSL_SESSION *session = PEM_read_SSL_SESSION(file, nullptr, nullptr, nullptr)) {
+            SSL_set_session(ssl, session);
+            SSL_SESSION_free(session);
+        }
+        fclose(file);
+    }
+    if (SSL_connect(ssl) != 1) {
+        std::cerr << "TLS handshake failed: " << tls_error() << std::endl;
+        return -1;
+    }
+    if (SSL_session_reused(ssl)) std::cout << "TLS session resumed." << std::endl;
+
+    // A worker thread encrypts and decrypts from here on, so the rest of the
+    // client reads and writes plain text as it would without TLS.
+    TlsWorker *worker = new TlsWorker([](int) {});
+    std::thread([worker] { worker->run(); }).detach();
+    return worker->relay(ssl, server_socket);
+}
+
+// Framed mode: prints every complete frame received from the server and
+// answers its heartbeats.
+void handle_server_frames(int server_socket, FrameParser frames) {
+    char buffer[BUFFER_SIZE];
+    std::string pong, expanded;
+    encode_frame(pong, OP_PONG, "");
+    while (true) {
+        int bytes_received = recv(server_socket, buffer, BUFFER_SIZE, 0);
+        std::lock_guard<std::mutex> lock(cout_mutex);
+        if (bytes_received <= 0 || !frames.feed(buffer, bytes_received, [&](uint8_t op, std::string_view text) {
+                if (!expand_frame(op, text, expanded)) std::cout << "Could not decompress a message." << std::endl;
+                else if (op == OP_PING) send(server_socket, pong.data(), pong.size(), MSG_NOSIGNAL);
+                else if (op == OP_COMPRESS) {
+                    if (const char *refused = compress_refused(text)) std::cout << refused << std::endl;
+                } else std::cout << text << std::endl;
+            })) {
+            std::cout << "Disconnected from server." << std::endl;
+            close(server_socket);
+            exit(0);
+        }
+    }
+}
 
 void handle_server_messages(int server_socket) {
     char buffer[BUFFER_SIZE];
@@ -33,7 +141,242 @@ void handle_server_messages(int server_socket) {
     }
 }
 
-int main() {
+// Batch mode: what the sender and the receiver share. Every command is
+// followed by an OP_PING carrying its sequence number; the server answers it
+// once the command has been handled, which gives the command's round trip.
+struct Batch {
+    std::mutex mutex;
+    std::condition_variable acked;
+    std::vector<std::chrono::steady_clock::time_point> sent; // by sequence number, once written
+    std::vector<uint8_t> kind;            // by sequence number, index into kinds
+    std::vector<std::string> kinds;       // command names, such as "/msg"
+    std::vector<std::vector<double>> rtt; // by kind, microseconds
+    uint64_t in_flight = 0;               // written but not answered
+    bool disconnected = false;
+    uint64_t compressed = 0;              // OP_ZTEXT frames received
+    uint64_t compressed_bytes = 0;        // their payloads
+    uint64_t expanded_bytes = 0;          // the text they held
+};
+
+bool send_all(int socket, const std::string &data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = send(socket, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+// Batch mode: times the answers to the sender's pings and prints everything
+// else the server sends, collected into large writes instead of a flush per
+// message.
+void handle_batch_frames(int server_socket, FrameParser frames, Batch &batch) {
+    std::vector<char> buffer(BATCH_IO_SIZE);
+    std::string out, pong, expanded;
+    while (true) {
+        int bytes_received = recv(server_socket, buffer.data(), buffer.size(), 0);
+        auto now = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(batch.mutex);
+        bool ok = bytes_received > 0 && frames.feed(buffer.data(), bytes_received, [&](uint8_t op, std::string_view payload) {
+            uint64_t seq;
+            if (op == OP_ZTEXT) {
+                batch.compressed++;
+                batch.compressed_bytes += payload.size();
+                if (!expand_frame(op, payload, expanded)) {
+                    fprintf(stderr, "Could not decompress a message.\n");
+                    return;
+                }
+                batch.expanded_bytes += payload.size();
+            }
+            if (op == OP_PONG && payload.size() == sizeof(seq)) {
+                memcpy(&seq, payload.data(), sizeof(seq));
+                if (seq < batch.sent.size()) {
+                    batch.rtt[batch.kind[seq]].push_back(std::chrono::duration<double, std::micro>(now - batch.sent[seq]).count());
+                    batch.in_flight--;
+                }
+            } else if (op == OP_PING) {
+                pong.clear();
+                encode_frame(pong, OP_PONG, payload);
+                send(server_socket, pong.data(), pong.size(), MSG_NOSIGNAL);
+            } else if (op == OP_COMPRESS) {
+                if (const char *refused = compress_refused(payload)) fprintf(stderr, "%s\n", refused);
+            } else if (op == OP_TEXT) {
+                out.append(payload);
+                out.push_back('\n');
+            }
+        });
+        if (!ok) batch.disconnected = true;
+        lock.unlock();
+        batch.acked.notify_one();
+        if (out.size() >= BATCH_IO_SIZE || (!ok && !out.empty())) {
+            fwrite(out.data(), 1, out.size(), stdout);
+            out.clear();
+        }
+        if (!ok) return;
+    }
+}
+
+double percentile(std::vector<double> &sorted, double p) {
+    return sorted.empty() ? 0 : sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+}
+
+// Batch mode: sends every command read from in without waiting for answers,
+// up to window at a time, then reports how long each kind of command took.
+// Returns the exit status.
+int run_batch(int server_socket, std::istream &in, FrameParser frames, uint64_t window) {
+    // Writes are already batched here; Nagle would only hold back the last one.
+    int opt = 1;
+    setsockopt(server_socket, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    Batch batch;
+    std::thread receiver(handle_batch_frames, server_socket, std::move(frames), std::ref(batch));
+
+    std::string pending; // encoded, not yet written
+    uint64_t seq = 0, flushed = 0, skipped = 0;
+    bool ok = true;
+    auto flush = [&] {
+        if (pending.empty()) return;
+        {
+            // Stamped before writing, so an answer can never beat its stamp.
+            std::lock_guard<std::mutex> lock(batch.mutex);
+            auto now = std::chrono::steady_clock::now();
+            std::fill(batch.sent.begin() + flushed, batch.sent.end(), now);
+            batch.in_flight += seq - flushed;
+        }
+        flushed = seq;
+        ok = ok && send_all(server_socket, pending);
+        pending.clear();
+    };
+    auto start = std::chrono::steady_clock::now();
+    std::string line;
+    // Lines 1 and 2 were the username and password.
+    for (long line_no = 3; ok && std::getline(in, line); line_no++) {
+        if (line.empty()) continue;
+        if (line == "/exit") break;
+        if (!encode_text_command(line, pending)) {
+            std::cerr << "line " << line_no << ": unknown command, skipped" << std::endl;
+            skipped++;
+            continue;
+        }
+        std::string name = line.substr(0, line.find(' '));
+        size_t kind = std::find(batch.kinds.begin(), batch.kinds.end(), name) - batch.kinds.begin();
+        {
+            std::lock_guard<std::mutex> lock(batch.mutex);
+            if (kind == batch.kinds.size()) {
+                batch.kinds.push_back(name);
+                batch.rtt.emplace_back();
+            }
+            batch.kind.push_back(kind);
+            batch.sent.emplace_back();
+        }
+        encode_frame(pending, OP_PING, std::string_view((const char *)&seq, sizeof(seq)));
+        seq++;
+
+        bool full = pending.size() >= BATCH_IO_SIZE;
+        {
+            std::lock_guard<std::mutex> lock(batch.mutex);
+            full = full || batch.in_flight + (seq - flushed) >= window;
+        }
+        // Write as soon as there is nothing more to read without blocking,
+        // so commands piped in slowly are not held back.
+        if (full || in.rdbuf()->in_avail() <= 0) flush();
+        std::unique_lock<std::mutex> lock(batch.mutex);
+        batch.acked.wait(lock, [&] { return batch.in_flight < window || batch.disconnected; });
+        ok = ok && !batch.disconnected;
+    }
+    flush();
+    std::unique_lock<std::mutex> lock(batch.mutex);
+    batch.acked.wait(lock, [&] { return batch.in_flight == 0 || batch.disconnected; });
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    bool disconnected = batch.disconnected;
+    lock.unlock();
+    // Everything up to the last answer has arrived; stop the receiver, which
+    // writes out what it holds.
+    shutdown(server_socket, SHUT_RDWR);
+    receiver.join();
+    fflush(stdout);
+
+    lock.lock();
+    uint64_t answered = seq - batch.in_flight;
+    fprintf(stderr, "%llu commands in %.3f s (%.0f/s), %llu unknown skipped%s\n", (unsigned long long)answered, secs,
+            answered / secs, (unsigned long long)skipped, disconnected ? ", disconnected early" : "");
+    fprintf(stderr, "%-14s %9s %10s %10s %10s %10s\n", "command", "count", "p50 us", "p90 us", "p99 us", "max us");
+    std::vector<double> all;
+    for (size_t k = 0; k < batch.kinds.size(); k++) {
+        std::vector<double> &rtt = batch.rtt[k];
+        std::sort(rtt.begin(), rtt.end());
+        all.insert(all.end(), rtt.begin(), rtt.end());
+        fprintf(stderr, "%-14s %9zu %10.1f %10.1f %10.1f %10.1f\n", batch.kinds[k].c_str(), rtt.size(),
+                percentile(rtt, 0.5), percentile(rtt, 0.9), percentile(rtt, 0.99), rtt.empty() ? 0 : rtt.back());
+    }
+    std::sort(all.begin(), all.end());
+    fprintf(stderr, "%-14s %9zu %10.1f %10.1f %10.1f %10.1f\n", "all", all.size(), percentile(all, 0.5),
+            percentile(all, 0.9), percentile(all, 0.99), all.empty() ? 0 : all.back());
+    if (batch.compressed > 0)
+        fprintf(stderr, "%llu messages arrived compressed: %llu bytes for %llu (%.1f%%)\n",
+                (unsigned long long)batch.compressed, (unsigned long long)batch.compressed_bytes,
+                (unsigned long long)batch.expanded_bytes, 100.0 * batch.compressed_bytes / std::max<uint64_t>(1, batch.expanded_bytes));
+    return disconnected ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    // --framed switches to the length-prefixed protocol (see frame_codec.h);
+    // --port picks the server, e.g. one node of a cluster; --tls connects
+    // with TLS, trusting --tls-ca and resuming the session kept in --tls-session.
+    // --batch reads the username, password and commands from a file ("-" for
+    // standard input) and pipelines them, up to --window in flight.
+    // --compress asks the server to deflate messages, primed with the
+    // dictionary in --compress-dict, which must be the server's.
+    bool framed = false, tls = false, compress = false;
+    int port = 12345;
+    std::string ca_file, batch_file, dict;
+    uint64_t window = BATCH_WINDOW;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--framed") {
+            framed = true;
+        } else if (arg == "--port" && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (arg == "--tls") {
+            tls = true;
+        } else if (arg == "--tls-ca" && i + 1 < argc) {
+            ca_file = argv[++i];
+        } else if (arg == "--tls-session" && i + 1 < argc) {
+            tls_session_file = argv[++i];
+        } else if (arg == "--batch" && i + 1 < argc) {
+            batch_file = argv[++i];
+        } else if (arg == "--window" && i + 1 < argc && atol(argv[i + 1]) > 0) {
+            window = atol(argv[++i]);
+        } else if (arg == "--compress") {
+            compress = framed = true;
+        } else if (arg == "--compress-dict" && i + 1 < argc) {
+            compress = framed = true;
+            std::string error;
+            if (!load_dictionary(argv[++i], dict, error)) {
+                std::cerr << error << std::endl;
+                return 1;
+            }
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--framed] [--port PORT] [--tls [--tls-ca FILE] [--tls-session FILE]]\n"
+                      << "       [--batch FILE|- [--window N]] [--compress [--compress-dict FILE]]" << std::endl;
+            return 1;
+        }
+    }
+    // Pipelined commands need frames: the text protocol cannot tell them apart.
+    std::ifstream batch_in;
+    if (!batch_file.empty()) {
+        framed = true;
+        std::ios::sync_with_stdio(false);
+        if (batch_file != "-") {
+            batch_in.open(batch_file);
+            if (!batch_in) {
+                std::cerr << batch_file << ": cannot open" << std::endl;
+                return 1;
+            }
+        }
+    }
+    std::istream &input = batch_in.is_open() ? batch_in : std::cin;
     int client_socket;
     sockaddr_in server_address{};
 
@@ -44,13 +387,14 @@ int main() {
     }
 
     server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(12345);
+    server_address.sin_port = htons(port);
     server_address.sin_addr.s_addr = inet_addr("127.0.0.1");
 
     if (connect(client_socket, (sockaddr*)&server_address, sizeof(server_address)) < 0) {
         std::cerr << "Error connecting to server." << std::endl;
         return 1;
     }
+    if (tls && (client_socket = start_tls(client_socket, ca_file)) < 0) return 1;
 
     std::cout << "Connected to the server." << std::endl;
 
@@ -62,28 +406,53 @@ int main() {
     recv(client_socket, buffer, BUFFER_SIZE, 0); // Receive the message "Enter the user name" for the server
     // You should have a line like this in the server.cpp code: send_message(client_socket, "Enter username: ");
  
-    std::cout << buffer;
-    std::getline(std::cin, username);
+    if (batch_file.empty()) std::cout << buffer;
+    std::getline(input, username);
+    if (framed) username.insert(username.begin(), (char)FRAME_MAGIC);
     send(client_socket, username.c_str(), username.size(), 0);
 
     memset(buffer, 0, BUFFER_SIZE);
     recv(client_socket, buffer, BUFFER_SIZE, 0); // Receive the message "Enter the password" for the server
-    std::cout << buffer;
-    std::getline(std::cin, password);
+    if (batch_file.empty()) std::cout << buffer;
+    std::getline(input, password);
     send(client_socket, password.c_str(), password.size(), 0);
 
-    memset(buffer, 0, BUFFER_SIZE);
     // Depending on whether the authentication passes or not, receive the message "Authentication Failed" or "Welcome to the server"
-    recv(client_socket, buffer, BUFFER_SIZE, 0); 
-    std::cout << buffer << std::endl;
+    std::string result;
+    FrameParser frames;
+    if (framed) {
+        // The login result is the first frame; anything after it stays in the parser.
+        bool ok = true;
+        while (ok && result.empty()) {
+            int bytes_received = recv(client_socket, buffer, BUFFER_SIZE, 0);
+            ok = bytes_received > 0 && frames.feed(buffer, bytes_received, [&](uint8_t, std::string_view text) {
+                     if (result.empty()) result = text;
+                     else std::cout << text << std::endl;
+                 });
+        }
+    } else {
+        memset(buffer, 0, BUFFER_SIZE);
+        recv(client_socket, buffer, BUFFER_SIZE, 0);
+        result = buffer;
+    }
+    std::cout << result << std::endl;
 
-    if (std::string(buffer).find("Authentication failed") != std::string::npos) {
+    if (result.find("Authentication Failed") != std::string::npos || result.find("Login timed out") != std::string::npos) {
         close(client_socket);
         return 1;
     }
+    if (compress) {
+        // Compressed messages may come as soon as the server has the request.
+        inflater = std::make_unique<Inflater>(dict);
+        std::string request;
+        encode_frame(request, OP_COMPRESS, encode_dictionary_id(dictionary_id(dict)));
+        send(client_socket, request.data(), request.size(), 0);
+    }
+    if (!batch_file.empty()) return run_batch(client_socket, input, std::move(frames), window);
 
     // Start thread for receiving messages from server
-    std::thread receive_thread(handle_server_messages, client_socket);
+    std::thread receive_thread = framed ? std::thread(handle_server_frames, client_socket, std::move(frames))
+                                        : std::thread(handle_server_messages, client_socket);
     // We use detach because we want this thread to run in the background while the main thread continues running
     receive_thread.detach();
 
@@ -94,12 +463,24 @@ int main() {
 
         if (message.empty()) continue;
 
-        send(client_socket, message.c_str(), message.size(), 0);
-
         if (message == "/exit") {
+            if (!framed) send(client_socket, message.c_str(), message.size(), 0);
             close(client_socket);
             break;
         }
+
+        if (framed) {
+            std::string frame;
+            if (!encode_text_command(message, frame)) {
+                std::lock_guard<std::mutex> lock(cout_mutex);
+                std::cout << "Unknown command." << std::endl;
+                continue;
+            }
+            send(client_socket, frame.data(), frame.size(), 0);
+            continue;
+        }
+
+        send(client_socket, message.c_str(), message.size(), 0);
     }
 
     return 0;
@@ -0,0 +1,355 @@
+// Links between the servers of a cluster.
+//
+// Every node listens for its peers on its cluster address and keeps one
+// outgoing connection to each of them. A node sends only over its own outgoing
+// links, so each link carries traffic one way and two nodes never race to set
+// up the same connection. Links use the framing of frame_codec.h with the
+// ClusterOp opcodes.
+//
+// After connecting, a node sends CLUSTER_HELLO with its address, then a
+// snapshot of everything its peers track about it (the users logged in on it,
+// the groups with members online on it, the group registry), then every change
+// as it happens. A node forgets what it knew about a peer whenever a link from
+// that peer starts or ends, so after a reconnect its view is rebuilt from the
+// snapshot. Links are ordered, so each node's view of a peer is the peer's own
+// state, slightly delayed.
+//
+// Sends are queued per link and written by the link's thread, which takes
+// everything queued since its last write and sends it in one write(), so under
+// load many forwarded messages share a system call. While a link is down,
+// whatever is sent over it is dropped; a link whose queue outgrows
+// CLUSTER_MAX_PENDING is cut and resynchronised.
+
+#pragma once
+
+#include <iostream>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "frame_codec.h"
+
+#define CLUSTER_MAX_NODES 64            // peers fit in a 64-bit mask
+#define CLUSTER_RETRY_MS 500            // wait between attempts to reach a peer
+#define CLUSTER_READ_SIZE 65536
+#define CLUSTER_MAX_PENDING (64 << 20)  // bytes queued for a peer before the link is cut
+#define CLUSTER_ALL_PEERS UINT64_MAX    // mask that sends to every peer
+
+enum ClusterOp : uint8_t
+{
+    CLUSTER_HELLO = 64,    // payload = the sender's cluster address
+    CLUSTER_USER_ON = 65,  // payload = user now logged in on the sender
+    CLUSTER_USER_OFF = 66, // payload = user no longer logged in on the sender
+    CLUSTER_GROUP_ON = 67, // payload = group that now has members online on the sender
+    CLUSTER_GROUP_OFF = 68,// payload = group that no longer has any
+    CLUSTER_CREATE = 69,   // payload = group created
+    CLUSTER_JOIN = 70,     // name = group, body = user who joined it
+    CLUSTER_LEAVE = 71,    // name = group, body = user who left it
+    CLUSTER_PRIVATE = 72,  // name = receiver, body = text to deliver
+    CLUSTER_BROADCAST = 73,// payload = text to deliver to everyone
+    CLUSTER_GROUP_MSG = 74 // name = group, body = message, without the "[Group g]: " prefix
+};
+
+struct ClusterHandlers
+{
+    // Appends the frames that describe this node to a new link.
+    std::function<void(std::string &out)> snapshot;
+    // Forgets everything a peer has said.
+    std::function<void(int peer)> peer_reset;
+    // Applies one frame from a peer.
+    std::function<void(int peer, uint8_t op, std::string_view payload)> on_frame;
+};
+
+class Cluster
+{
+public:
+    // Listens on self and starts linking to peers, all "host:port" addresses.
+    // Returns nullptr with the reason in error if an address is unusable.
+    static std::unique_ptr<Cluster> start(const std::string &self, const std::vector<std::string> &peers,
+                                          ClusterHandlers handlers, std::string &error)
+    {
+        if (peers.size() > CLUSTER_MAX_NODES)
+        {
+            error = "at most " + std::to_string(CLUSTER_MAX_NODES) + " peers";
+            return nullptr;
+        }
+        std::unique_ptr<Cluster> cluster(new Cluster(self, std::move(handlers)));
+        sockaddr_storage addr;
+        socklen_t addrLen;
+        if (!resolve(self, addr, addrLen, error))
+            return nullptr;
+        for (const std::string &peer : peers)
+        {
+            auto link = std::make_unique<Link>();
+            link->address = peer;
+            if (!resolve(peer, link->addr, link->addrLen, error))
+                return nullptr;
+            cluster->links.push_back(std::move(link));
+        }
+
+        int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int opt = 1;
+        if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+            bind(fd, (sockaddr *)&addr, addrLen) < 0 || listen(fd, SOMAXCONN) < 0)
+        {
+            error = self + ": " + strerror(errno);
+            if (fd >= 0)
+                close(fd);
+            return nullptr;
+        }
+        Cluster *raw = cluster.get();
+        std::thread([raw, fd] { raw->accept_loop(fd); }).detach();
+        for (auto &link : cluster->links)
+            std::thread([raw, l = link.get()] { raw->run_link(*l); }).detach();
+        return cluster;
+    }
+
+    int peers() const { return links.size(); }
+
+    // Queues a frame for one peer.
+    void send(int peer, std::string_view frame)
+    {
+        Link &link = *links[peer];
+        bool wake;
+        {
+            std::lock_guard<std::mutex> lock(link.mutex);
+            if (!link.up)
+                return;
+            if (link.pending.size() + frame.size() > CLUSTER_MAX_PENDING)
+            {
+                // The peer is not keeping up; start over from a snapshot.
+                shutdown(link.fd, SHUT_RDWR);
+                link.up = false;
+                link.pending.clear();
+                wake = true;
+            }
+            else
+            {
+                wake = link.pending.empty();
+                link.pending.append(frame);
+            }
+        }
+        if (wake)
+            link.wake.notify_one();
+    }
+
+    // Queues a frame for every peer whose bit is set in mask.
+    void send(uint64_t mask, std::string_view frame)
+    {
+        for (size_t peer = 0; peer < links.size(); peer++)
+        {
+            if (mask >> peer & 1)
+                send((int)peer, frame);
+        }
+    }
+
+private:
+    struct Link
+    {
+        std::string address;
+        sockaddr_storage addr;
+        socklen_t addrLen;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::string pending;              // frames not written yet
+        bool up = false;                  // connected, so sends are queued
+        int fd = -1;
+        std::atomic<uint64_t> incoming{0}; // counts links from the peer, see read_link
+    };
+
+    Cluster(const std::string &self, ClusterHandlers handlers) : selfAddress(self), handlers(std::move(handlers)) {}
+
+    static bool resolve(const std::string &address, sockaddr_storage &addr, socklen_t &addrLen, std::string &error)
+    {
+        size_t colon = address.rfind(':');
+        if (colon == std::string::npos)
+        {
+            error = address + ": expected host:port";
+            return false;
+        }
+        addrinfo hints{}, *found;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        int rc = getaddrinfo(address.substr(0, colon).c_str(), address.substr(colon + 1).c_str(), &hints, &found);
+        if (rc != 0)
+        {
+            error = address + ": " + gai_strerror(rc);
+            return false;
+        }
+        memcpy(&addr, found->ai_addr, found->ai_addrlen);
+        addrLen = found->ai_addrlen;
+        freeaddrinfo(found);
+        return true;
+    }
+
+    static bool write_all(int fd, const std::string &data)
+    {
+        size_t done = 0;
+        while (done < data.size())
+        {
+            ssize_t n = ::send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            done += n;
+        }
+        return true;
+    }
+
+    // Keeps the link to one peer connected and writes what is queued for it.
+    void run_link(Link &link)
+    {
+        std::string batch;
+        while (true)
+        {
+            int fd = socket(link.addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (fd < 0 || connect(fd, (sockaddr *)&link.addr, link.addrLen) < 0)
+            {
+                if (fd >= 0)
+                    close(fd);
+                std::this_thread::sleep_for(std::chrono::milliseconds(CLUSTER_RETRY_MS));
+                continue;
+            }
+            int opt = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+            // Changes made from here on are queued, and the snapshot taken
+            // after this point includes every change made before it, so
+            // nothing falls between the two.
+            {
+                std::lock_guard<std::mutex> lock(link.mutex);
+                link.up = true;
+                link.fd = fd;
+                link.pending.clear();
+            }
+            // The peer never writes on this link, so a read returns only when
+            // the connection ends. Watching for that notices a restarted peer
+            // at once rather than at the next write, which would be lost.
+            std::thread watcher([&link, fd]
+            {
+                char byte;
+                while (recv(fd, &byte, 1, 0) > 0 || errno == EINTR)
+                    ;
+                std::lock_guard<std::mutex> lock(link.mutex);
+                link.up = false;
+                link.wake.notify_one();
+            });
+            batch.clear();
+            encode_frame(batch, CLUSTER_HELLO, selfAddress);
+            handlers.snapshot(batch);
+            bool ok = write_all(fd, batch);
+            while (ok)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(link.mutex);
+                    link.wake.wait(lock, [&] { return !link.pending.empty() || !link.up; });
+                    if (!link.up)
+                        break;
+                    batch.clear();
+                    batch.swap(link.pending);
+                }
+                ok = write_all(fd, batch);
+            }
+            {
+                std::lock_guard<std::mutex> lock(link.mutex);
+                link.up = false;
+                link.fd = -1;
+                link.pending.clear();
+            }
+            shutdown(fd, SHUT_RDWR);
+            watcher.join();
+            close(fd);
+            std::cerr << "Cluster: lost the link to " << link.address << std::endl;
+            std::this_thread::sleep_for(std::chrono::milliseconds(CLUSTER_RETRY_MS));
+        }
+    }
+
+    void accept_loop(int listener)
+    {
+        while (true)
+        {
+            int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0)
+            {
+                if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE)
+                    continue;
+                perror("Cluster accept");
+                return;
+            }
+            std::thread([this, fd] { read_link(fd); }).detach();
+        }
+    }
+
+    // Applies what a peer sends over one of its links. A peer that reconnects
+    // may do so before its old link is noticed to be dead; only the newest
+    // link from a peer resets what is known about it when it ends.
+    void read_link(int fd)
+    {
+        std::vector<char> buffer(CLUSTER_READ_SIZE);
+        FrameParser frames;
+        int peer = -1;
+        uint64_t generation = 0;
+        bool ok = true;
+        while (ok)
+        {
+            ssize_t n = read(fd, buffer.data(), buffer.size());
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            ok = frames.feed(buffer.data(), n, [&](uint8_t op, std::string_view payload)
+            {
+                if (!ok)
+                    return;
+                if (peer >= 0)
+                {
+                    handlers.on_frame(peer, op, payload);
+                    return;
+                }
+                if (op == CLUSTER_HELLO)
+                    peer = peer_index(payload);
+                if (peer < 0)
+                {
+                    std::cerr << "Cluster: rejected a link from unknown node " << payload << std::endl;
+                    ok = false;
+                    return;
+                }
+                generation = ++links[peer]->incoming;
+                handlers.peer_reset(peer);
+                std::cout << "Cluster: linked with " << links[peer]->address << std::endl;
+            }) && ok;
+        }
+        if (peer >= 0 && links[peer]->incoming.load() == generation)
+            handlers.peer_reset(peer);
+        close(fd);
+    }
+
+    int peer_index(std::string_view address) const
+    {
+        for (size_t i = 0; i < links.size(); i++)
+        {
+            if (links[i]->address == address)
+                return i;
+        }
+        return -1;
+    }
+
+    std::string selfAddress;
+    ClusterHandlers handlers;
+    std::vector<std::unique_ptr<Link>> links; // by peer index
+};
@@ -0,0 +1,169 @@
+// Compressed server messages for framed clients.
+//
+// A framed client may ask, once logged in, for the messages it is sent to be
+// compressed. It names the dictionary it has by its ID; if that is the
+// server's, the server answers with the same ID and from then on sends
+// messages of at least its threshold as OP_ZTEXT frames whenever that makes
+// them smaller.
+//
+// Every message is compressed on its own, as a raw deflate stream, so one
+// compressed copy serves every recipient of a fan-out exactly as the encoded
+// OP_TEXT frame does (message_buffer.h). Short chat lines share little with
+// themselves, so both ends prime deflate with a preset dictionary: samples of
+// typical traffic, which the messages can then refer back to. Priming costs
+// the compressor about 2us per KiB of dictionary on every message, while on
+// repetitive traffic a few KiB already find nearly everything that 32 KiB
+// would, so only the last COMPRESS_MAX_DICT bytes of a dictionary are used and
+// the strings most worth finding belong at its end.
+
+#pragma once
+
+#include <zlib.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <cstdint>
+#include "frame_codec.h"
+
+#define COMPRESS_MIN_BYTES 64        // default: shorter messages are sent as they are
+#define COMPRESS_MAX_DICT (4 << 10)  // dictionary bytes used, at most deflate's 32 KiB window
+#define COMPRESS_LEVEL 6
+
+// The ID of a dictionary: its Adler-32, as zlib would record it, or 0 for
+// none.
+inline uint32_t dictionary_id(std::string_view dict)
+{
+    return dict.empty() ? 0 : adler32(adler32(0, nullptr, 0), (const Bytef *)dict.data(), dict.size());
+}
+
+// Reads a dictionary file, keeping its last COMPRESS_MAX_DICT bytes.
+inline bool load_dictionary(const std::string &path, std::string &dict, std::string &error)
+{
+    std::ifstream in(path, std::ios::binary);
+    std::ostringstream contents;
+    if (!in || !(contents << in.rdbuf()))
+    {
+        error = path + ": cannot read";
+        return false;
+    }
+    dict = contents.str();
+    if (dict.size() > COMPRESS_MAX_DICT)
+        dict.erase(0, dict.size() - COMPRESS_MAX_DICT);
+    return true;
+}
+
+// Payload of OP_COMPRESS: a dictionary ID, big-endian.
+inline std::string encode_dictionary_id(uint32_t id)
+{
+    char bytes[4] = {(char)(id >> 24), (char)(id >> 16), (char)(id >> 8), (char)id};
+    return std::string(bytes, 4);
+}
+
+inline bool decode_dictionary_id(std::string_view payload, uint32_t &id)
+{
+    if (payload.size() != 4)
+        return false;
+    id = (uint32_t)(uint8_t)payload[0] << 24 | (uint32_t)(uint8_t)payload[1] << 16 |
+         (uint32_t)(uint8_t)payload[2] << 8 | (uint8_t)payload[3];
+    return true;
+}
+
+// Compresses messages one at a time. One per thread; the stream is reset, not
+// reallocated, between messages.
+class Deflater
+{
+public:
+    explicit Deflater(std::string_view dict) : dict(dict)
+    {
+        ok = deflateInit2(&stream, COMPRESS_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+    }
+
+    ~Deflater()
+    {
+        if (ok)
+            deflateEnd(&stream);
+    }
+
+    Deflater(const Deflater &) = delete;
+    Deflater &operator=(const Deflater &) = delete;
+
+    // Appends an OP_ZTEXT frame carrying text to out. Returns false, leaving
+    // out as it was, if the frame would be larger than the OP_TEXT one.
+    bool compress(std::string_view text, std::string &out)
+    {
+        if (!ok || deflateReset(&stream) != Z_OK ||
+            (!dict.empty() && deflateSetDictionary(&stream, (const Bytef *)dict.data(), dict.size()) != Z_OK))
+            return false;
+        size_t start = out.size();
+        out.resize(start + FRAME_HEADER_SIZE + text.size());
+        stream.next_in = (Bytef *)text.data();
+        stream.avail_in = text.size();
+        stream.next_out = (Bytef *)out.data() + start + FRAME_HEADER_SIZE;
+        stream.avail_out = text.size();
+        // Output that does not fit is not worth sending.
+        if (deflate(&stream, Z_FINISH) != Z_STREAM_END)
+        {
+            out.resize(start);
+            return false;
+        }
+        out.resize(start + FRAME_HEADER_SIZE + stream.total_out);
+        encode_frame_header(out.data() + start, OP_ZTEXT, stream.total_out);
+        return true;
+    }
+
+private:
+    std::string dict;
+    z_stream stream{};
+    bool ok;
+};
+
+// Decompresses OP_ZTEXT payloads.
+class Inflater
+{
+public:
+    explicit Inflater(std::string_view dict) : dict(dict)
+    {
+        ok = inflateInit2(&stream, -15) == Z_OK;
+    }
+
+    ~Inflater()
+    {
+        if (ok)
+            inflateEnd(&stream);
+    }
+
+    Inflater(const Inflater &) = delete;
+    Inflater &operator=(const Inflater &) = delete;
+
+    // Replaces text with the message payload holds. Returns false if it is
+    // corrupt or would expand beyond FRAME_MAX_PAYLOAD.
+    bool decompress(std::string_view payload, std::string &text)
+    {
+        if (!ok || inflateReset(&stream) != Z_OK ||
+            (!dict.empty() && inflateSetDictionary(&stream, (const Bytef *)dict.data(), dict.size()) != Z_OK))
+            return false;
+        text.resize(std::max<size_t>(4 * payload.size(), 256));
+        stream.next_in = (Bytef *)payload.data();
+        stream.avail_in = payload.size();
+        while (true)
+        {
+            stream.next_out = (Bytef *)text.data() + stream.total_out;
+            stream.avail_out = text.size() - stream.total_out;
+            int rc = inflate(&stream, Z_FINISH);
+            if (rc == Z_STREAM_END)
+                break;
+            if ((rc != Z_BUF_ERROR && rc != Z_OK) || stream.avail_out != 0 || text.size() >= FRAME_MAX_PAYLOAD)
+                return false;
+            text.resize(std::min<size_t>(2 * text.size(), FRAME_MAX_PAYLOAD));
+        }
+        text.resize(stream.total_out);
+        return true;
+    }
+
+private:
+    std::string dict;
+    z_stream stream{};
+    bool ok;
+};
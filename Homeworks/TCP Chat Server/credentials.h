@@ -0,0 +1,305 @@
+// Credential stores consulted at login.
+//
+// TextCredentials reads users.txt (username:password per line) into a hash
+// map, as the server always has. For large user bases, IndexedCredentials
+// instead memory-maps a precomputed index built by mkcreds, so startup costs
+// one mmap() however many users there are, and pages are only touched by the
+// logins that need them. The index never stores passwords: each user has a
+// random salt and a PBKDF2-HMAC-SHA256 key derived from the password.
+//
+// Index layout (host byte order, every section 8-byte aligned):
+//
+//   CredentialHeader
+//   CredentialSlot[slotCount]      open-addressing table, linear probing
+//   CredentialRecord[recordCount]  one per user
+//   names                          usernames, back to back
+//
+// A slot holds the upper half of the username's FNV-1a hash and the record
+// number plus one, zero marking an empty slot. The table is at most 70% full,
+// so lookups touch one or two slots before reaching the record.
+//
+// An index must be replaced by renaming a new file over it, as mkcreds does:
+// rewriting it in place would change pages under a running server's mapping.
+//
+// Deriving a key takes long enough that an event loop checking passwords
+// itself would stall every connection it serves during a login storm, so
+// CredentialCheckers runs the checks on threads of their own.
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <fstream>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
+
+#define CRED_MAGIC "CHATCRD1"
+#define CRED_VERSION 1
+#define CRED_SALT_SIZE 16
+#define CRED_KEY_SIZE 32
+#define CRED_DEFAULT_ITERATIONS 1000
+#define CRED_MAX_LOAD 0.7
+
+struct CredentialHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t iterations; // PBKDF2 rounds used for every key
+    uint64_t slotCount;  // power of two
+    uint64_t recordCount;
+    uint64_t namesSize;
+};
+
+struct CredentialSlot
+{
+    uint32_t tag;    // upper 32 bits of the username hash
+    uint32_t record; // record index + 1, 0 if the slot is empty
+};
+
+struct CredentialRecord
+{
+    uint32_t nameOffset; // into the names section
+    uint32_t nameLength;
+    uint8_t salt[CRED_SALT_SIZE];
+    uint8_t key[CRED_KEY_SIZE];
+};
+
+// 64-bit FNV-1a, stable across builds unlike std::hash.
+inline uint64_t credential_hash(std::string_view name)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : name)
+    {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+inline bool derive_key(std::string_view password, const uint8_t *salt, uint32_t iterations, uint8_t *key)
+{
+    return PKCS5_PBKDF2_HMAC(password.data(), password.size(), salt, CRED_SALT_SIZE, iterations, EVP_sha256(),
+                             CRED_KEY_SIZE, key) == 1;
+}
+
+// Splits one users.txt line. Returns false for lines without a colon.
+inline bool split_credentials(std::string_view line, std::string_view &user, std::string_view &pass)
+{
+    size_t colon = line.find(':');
+    if (colon == std::string_view::npos)
+        return false;
+    user = line.substr(0, colon);
+    pass = line.substr(colon + 1);
+    return true;
+}
+
+class CredentialStore
+{
+public:
+    virtual ~CredentialStore() = default;
+    virtual bool check(std::string_view user, std::string_view pass) const = 0;
+    virtual bool contains(std::string_view user) const = 0;
+    virtual size_t size() const = 0;
+};
+
+// users.txt held in memory.
+class TextCredentials : public CredentialStore
+{
+public:
+    // Returns nullptr, with the reason in error, if the file cannot be read.
+    static std::shared_ptr<const CredentialStore> load(const std::string &path, std::string &error)
+    {
+        std::ifstream file(path);
+        if (!file)
+        {
+            error = path + " not found!";
+            return nullptr;
+        }
+        auto store = std::make_shared<TextCredentials>();
+        std::string line;
+        while (std::getline(file, line))
+        {
+            std::string_view user, pass;
+            if (split_credentials(line, user, pass))
+                store->users[std::string(user)] = std::string(pass);
+        }
+        return store;
+    }
+
+    bool check(std::string_view user, std::string_view pass) const override
+    {
+        auto it = users.find(std::string(user));
+        return it != users.end() && it->second == pass;
+    }
+
+    bool contains(std::string_view user) const override { return users.count(std::string(user)) > 0; }
+
+    size_t size() const override { return users.size(); }
+
+private:
+    std::unordered_map<std::string, std::string> users; // valid username:password pairs
+};
+
+// A read-only mapping of an index written by mkcreds.
+class IndexedCredentials : public CredentialStore
+{
+public:
+    ~IndexedCredentials() override
+    {
+        if (base != MAP_FAILED)
+            munmap(base, length);
+    }
+
+    // Returns nullptr, with the reason in error, if the file is missing or
+    // not a valid index.
+    static std::shared_ptr<const CredentialStore> load(const std::string &path, std::string &error)
+    {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            error = path + ": " + strerror(errno);
+            return nullptr;
+        }
+        struct stat st;
+        auto store = std::make_shared<IndexedCredentials>();
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(CredentialHeader))
+        {
+            store->length = st.st_size;
+            store->base = mmap(nullptr, store->length, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (store->base == MAP_FAILED || !store->validate())
+        {
+            error = path + ": not a credential index";
+            return nullptr;
+        }
+        // Logins probe at random; reading ahead would only waste page cache.
+        madvise(store->base, store->length, MADV_RANDOM);
+        return store;
+    }
+
+    bool check(std::string_view user, std::string_view pass) const override
+    {
+        // An unknown user costs a key derivation too, against a salt no
+        // record has, so the time a failed login takes does not tell
+        // whether the username exists.
+        static const uint8_t unknownSalt[CRED_SALT_SIZE] = {};
+        const CredentialRecord *record = find(user);
+        uint8_t key[CRED_KEY_SIZE];
+        bool derived = derive_key(pass, record ? record->salt : unknownSalt, header->iterations, key);
+        return record && derived && CRYPTO_memcmp(key, record->key, CRED_KEY_SIZE) == 0;
+    }
+
+    bool contains(std::string_view user) const override { return find(user) != nullptr; }
+
+    size_t size() const override { return header->recordCount; }
+
+private:
+    const CredentialRecord *find(std::string_view user) const
+    {
+        uint64_t hash = credential_hash(user);
+        uint32_t tag = hash >> 32;
+        uint64_t mask = header->slotCount - 1;
+        // Entries are bounds-checked as they are used rather than at load
+        // time, which would read the whole file.
+        for (uint64_t i = hash & mask, probes = 0; probes < header->slotCount; i = (i + 1) & mask, probes++)
+        {
+            const CredentialSlot &slot = slots[i];
+            if (slot.record == 0 || slot.record > header->recordCount)
+                return nullptr;
+            if (slot.tag != tag)
+                continue;
+            const CredentialRecord &record = records[slot.record - 1];
+            if ((uint64_t)record.nameOffset + record.nameLength > header->namesSize)
+                return nullptr;
+            if (std::string_view(names + record.nameOffset, record.nameLength) == user)
+                return &record;
+        }
+        return nullptr;
+    }
+
+    // Checks that every section lies inside the file, so a truncated or
+    // foreign file is rejected up front.
+    bool validate()
+    {
+        header = (const CredentialHeader *)base;
+        if (memcmp(header->magic, CRED_MAGIC, 8) != 0 || header->version != CRED_VERSION ||
+            header->slotCount == 0 || (header->slotCount & (header->slotCount - 1)) != 0 ||
+            header->recordCount >= header->slotCount || header->iterations == 0)
+            return false;
+        uint64_t slotsEnd = sizeof(CredentialHeader) + header->slotCount * sizeof(CredentialSlot);
+        uint64_t recordsEnd = slotsEnd + header->recordCount * sizeof(CredentialRecord);
+        if (header->slotCount > length / sizeof(CredentialSlot) || recordsEnd + header->namesSize > length)
+            return false;
+        slots = (const CredentialSlot *)((const char *)base + sizeof(CredentialHeader));
+        records = (const CredentialRecord *)((const char *)base + slotsEnd);
+        names = (const char *)base + recordsEnd;
+        return true;
+    }
+
+    void *base = MAP_FAILED;
+    size_t length = 0;
+    const CredentialHeader *header = nullptr;
+    const CredentialSlot *slots = nullptr;
+    const CredentialRecord *records = nullptr;
+    const char *names = nullptr;
+};
+
+// A few threads that run password checks handed to them, in the order they
+// were handed over.
+class CredentialCheckers
+{
+public:
+    explicit CredentialCheckers(int threads)
+    {
+        for (int i = 0; i < threads; i++)
+            std::thread([this] { run(); }).detach();
+    }
+
+    CredentialCheckers(const CredentialCheckers &) = delete;
+    CredentialCheckers &operator=(const CredentialCheckers &) = delete;
+
+    // Queues a check. Any thread.
+    void submit(std::function<void()> check)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            checks.push_back(std::move(check));
+        }
+        wake.notify_one();
+    }
+
+private:
+    void run()
+    {
+        while (true)
+        {
+            std::function<void()> check;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] { return !checks.empty(); });
+                check = std::move(checks.front());
+                checks.pop_front();
+            }
+            check();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<std::function<void()>> checks;
+};
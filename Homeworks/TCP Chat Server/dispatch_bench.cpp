@@ -0,0 +1,225 @@
+// Microbenchmark of the server's command dispatch path.
+//
+// Compiles server_grp.cpp into this program and drives handle_command() and
+// handle_frame() directly, in thread-per-client mode, for a sender and a
+// receiver connected over socketpairs. Each command is parsed, its delivery
+// built and queued, and written to the receiver's socket, which is drained
+// after every command. malloc is wrapped to count heap allocations, so the
+// report shows how many each command makes once the arenas and queues have
+// warmed up: the target for /msg is zero.
+//
+// Times include the write to the receiver's socket and the read that drains
+// it, so they are an upper bound on the cost of dispatch itself.
+
+#define CHAT_SERVER_NO_MAIN
+#include "server_grp.cpp"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#define DISPATCH_WARMUP 10000    // commands run before counting
+#define DISPATCH_ITERATIONS 200000 // default commands measured per case
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+std::atomic<uint64_t> heapAllocations{0};
+
+// Every allocation, including operator new's, goes through these.
+extern "C" void *malloc(size_t size)
+{
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+// One end of a socketpair stands in for an accepted client socket; the bench
+// reads what the server writes from the other.
+struct BenchClient
+{
+    int server; // the server's socket for this client
+    int peer;   // the client's end
+};
+
+BenchClient connect_client(const std::string &user)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    output_opened(fds[0]);
+    client_joined(fds[0], user);
+    return {fds[0], fds[1]};
+}
+
+void drain(const BenchClient &client)
+{
+    char buffer[65536];
+    while (read(client.peer, buffer, sizeof(buffer)) > 0)
+        ;
+}
+
+// Reads frames from a client's end until one arrives, or a second passes.
+// Returns its payload, or fails if none came or the stream did not parse.
+bool receive_frame(const BenchClient &client, uint8_t &op, std::string &payload)
+{
+    FrameParser parser;
+    bool got = false, ok = true;
+    char buffer[65536];
+    pollfd pfd = {client.peer, POLLIN, 0};
+    while (!got && ok && poll(&pfd, 1, 1000) > 0)
+    {
+        ssize_t n = read(client.peer, buffer, sizeof(buffer));
+        if (n <= 0)
+            break;
+        ok = parser.feed(buffer, n, [&](uint8_t frameOp, std::string_view framePayload)
+        {
+            if (got)
+                return;
+            op = frameOp;
+            payload.assign(framePayload);
+            got = true;
+        });
+    }
+    return got && ok;
+}
+
+// Checks that the longest body the server accepts still reaches a framed
+// recipient in a frame its parser takes, and that a longer one is refused.
+void check_max_body(const BenchClient &sender, const BenchClient &receiver)
+{
+    socketFramed[receiver.server] = true;
+    std::string body(FRAME_MAX_BODY, 'x');
+    handle_frame(sender.server, OP_BROADCAST, body);
+    uint8_t op;
+    std::string payload;
+    MessageRef expected = add_prefix(sender.server, body);
+    if (!receive_frame(receiver, op, payload) || op != OP_TEXT ||
+        payload != std::string_view(expected.text(), expected.text_size()))
+    {
+        std::cerr << "A " << body.size() << "-byte broadcast did not reach a framed client intact" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    body.push_back('x');
+    handle_frame(sender.server, OP_BROADCAST, body);
+    char reply[256];
+    ssize_t n = read(sender.peer, reply, sizeof(reply));
+    if (n != (ssize_t)strlen(tooLongStr) || memcmp(reply, tooLongStr, n) != 0 || read(receiver.peer, reply, 1) > 0)
+    {
+        std::cerr << "A " << body.size() << "-byte broadcast was not refused" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    socketFramed[receiver.server] = false;
+}
+
+// Runs command iterations times after a warmup and prints the cost of one.
+template <typename Fn>
+void run_case(const char *name, long iterations, const std::vector<BenchClient> &clients, Fn &&command)
+{
+    for (int i = 0; i < DISPATCH_WARMUP; i++)
+    {
+        command();
+        for (const BenchClient &client : clients)
+            drain(client);
+    }
+    uint64_t allocations = heapAllocations.load();
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < iterations; i++)
+    {
+        command();
+        for (const BenchClient &client : clients)
+            drain(client);
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    uint64_t made = heapAllocations.load() - allocations;
+    printf("%-22s %9.1f ns/op  %6.3f allocations/op  (%llu in %ld commands)\n", name,
+           secs * 1e9 / iterations, (double)made / iterations, (unsigned long long)made, iterations);
+}
+
+int main(int argc, char *argv[])
+{
+    long iterations = DISPATCH_ITERATIONS;
+    size_t payload = 64;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--iterations" && i + 1 < argc)
+            iterations = atol(argv[++i]);
+        else if (arg == "--payload" && i + 1 < argc)
+            payload = atol(argv[++i]);
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--iterations N] [--payload BYTES]" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (iterations < 1 || payload < 1 || payload > BUFFER_SIZE - 32)
+    {
+        std::cerr << "--iterations must be positive and --payload between 1 and " << BUFFER_SIZE - 32 << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // The server's thread-per-client setup, with its default history.
+    socketUser = std::vector<std::atomic<uint32_t>>(1024);
+    for (auto &user : socketUser)
+        user.store(NO_SYMBOL, std::memory_order_relaxed);
+    socketFramed = std::vector<std::atomic<bool>>(1024);
+    socketOutput.resize(1024);
+    outputEpoll = epoll_create1(EPOLL_CLOEXEC);
+    std::thread(output_loop).detach();
+    historyStore = std::make_unique<HistoryStore>(HISTORY_MESSAGES, HISTORY_TOTAL_BYTES);
+
+    BenchClient alice = connect_client("alice");
+    BenchClient bob = connect_client("bob");
+    handle_command(alice.server, "/create_group team");
+    handle_command(bob.server, "/join_group team");
+    drain(alice);
+    drain(bob);
+    check_max_body(alice, bob);
+
+    std::string body(payload, 'x');
+    std::string msg = "/msg bob " + body;
+    std::string groupMsg = "/group_msg team " + body;
+    std::string broadcastMsg = "/broadcast " + body;
+    std::string framedMsg;
+    encode_named_frame(framedMsg, OP_MSG, "bob", body);
+    std::string_view framedPayload = std::string_view(framedMsg).substr(FRAME_HEADER_SIZE);
+
+    std::vector<BenchClient> both = {alice, bob};
+    run_case("/msg", iterations, both, [&] { handle_command(alice.server, msg); });
+    run_case("/msg (framed)", iterations, both, [&] { handle_frame(alice.server, OP_MSG, framedPayload); });
+    run_case("/group_msg", iterations, both, [&] { handle_command(alice.server, groupMsg); });
+    run_case("/broadcast", iterations, both, [&] { handle_command(alice.server, broadcastMsg); });
+
+    // Limits too high to refuse anything, so only the checks are added.
+    rateLimits.set(RATE_USER, 1e9, 1e9);
+    rateLimits.set(RATE_MSG, 1e9, 1e9);
+    run_case("/msg (rate limited)", iterations, both, [&] { handle_command(alice.server, msg); });
+
+    // Bob asks for compressed messages, without a dictionary, so each group
+    // message is also deflated once for him.
+    compressEnabled = true;
+    socketFramed[bob.server] = true;
+    socketCompressed = std::vector<std::atomic<bool>>(1024);
+    handle_frame(bob.server, OP_COMPRESS, encode_dictionary_id(0));
+    drain(bob);
+    run_case("/group_msg (compressed)", iterations, both, [&] { handle_command(alice.server, groupMsg); });
+    return 0;
+}
@@ -0,0 +1,209 @@
+// Length-prefixed binary framing shared by the chat server and client.
+//
+// The text protocol treats every read() as one command, so commands that the
+// network coalesces or splits are corrupted and nothing larger than one read
+// buffer gets through. A framed connection instead sends
+//
+//   magic   1 byte   FRAME_MAGIC
+//   opcode  1 byte   one of FrameOp
+//   length  4 bytes  payload size, big-endian, at most FRAME_MAX_PAYLOAD
+//   payload length bytes
+//
+// Commands addressed to a user or a group carry that name first, prefixed by
+// its length in one byte, followed by the message body.
+//
+// A client opts in by sending FRAME_MAGIC in front of its username. From then
+// on it sends only frames, and everything the server sends after the password
+// prompt, starting with the login result, arrives as OP_TEXT frames.
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#define FRAME_MAGIC 0xC3 // never the first byte of a UTF-8 text command
+#define FRAME_HEADER_SIZE 6
+#define FRAME_MAX_PAYLOAD (1 << 20)
+#define FRAME_MAX_NAME 255
+// Room kept in a server message for the "[user]: " or "[Group name]: " put in
+// front of a chat message body. Names are at most FRAME_MAX_NAME in frames,
+// and user names and text commands arrive in single 1 KiB reads, so a body of
+// at most FRAME_MAX_BODY is always delivered in a frame clients accept.
+#define FRAME_MAX_PREFIX 2048
+#define FRAME_MAX_BODY (FRAME_MAX_PAYLOAD - FRAME_MAX_PREFIX)
+
+enum FrameOp : uint8_t
+{
+    // client -> server
+    OP_MSG = 1,          // name = receiver
+    OP_BROADCAST = 2,
+    OP_GROUP_MSG = 3,    // name = group
+    OP_CREATE_GROUP = 4, // payload = group
+    OP_JOIN_GROUP = 5,   // payload = group
+    OP_LEAVE_GROUP = 6,  // payload = group
+    OP_HISTORY = 7,      // name = group, body = number of messages
+    OP_PONG = 8,         // answers OP_PING with its payload; either direction
+    OP_COMPRESS = 9,     // payload = dictionary ID (compress.h); the server answers
+                         // with the same ID if it will compress, empty if not
+    // server -> client
+    OP_TEXT = 32,        // any server message, same text as the text protocol
+    OP_PING = 33,        // asks for an OP_PONG; either direction. The server sends
+                         // one to a quiet client, and answers a client's after
+                         // handling everything the client sent before it
+    OP_ZTEXT = 34        // an OP_TEXT payload, deflated, after OP_COMPRESS
+};
+
+inline void encode_frame_header(char *out, uint8_t op, uint32_t len)
+{
+    out[0] = (char)FRAME_MAGIC;
+    out[1] = (char)op;
+    out[2] = (char)(len >> 24);
+    out[3] = (char)(len >> 16);
+    out[4] = (char)(len >> 8);
+    out[5] = (char)len;
+}
+
+// Appends a frame carrying payload to out.
+inline void encode_frame(std::string &out, uint8_t op, std::string_view payload)
+{
+    char header[FRAME_HEADER_SIZE];
+    encode_frame_header(header, op, payload.size());
+    out.append(header, FRAME_HEADER_SIZE);
+    out.append(payload);
+}
+
+// Appends a frame whose payload is a length-prefixed name followed by body.
+inline void encode_named_frame(std::string &out, uint8_t op, std::string_view name, std::string_view body)
+{
+    char header[FRAME_HEADER_SIZE];
+    encode_frame_header(header, op, 1 + name.size() + body.size());
+    out.append(header, FRAME_HEADER_SIZE);
+    out.push_back((char)name.size());
+    out.append(name);
+    out.append(body);
+}
+
+// Splits a named payload. Returns false if it is malformed.
+inline bool split_named(std::string_view payload, std::string_view &name, std::string_view &body)
+{
+    if (payload.empty())
+        return false;
+    size_t nameLen = (uint8_t)payload[0];
+    if (payload.size() < 1 + nameLen)
+        return false;
+    name = payload.substr(1, nameLen);
+    body = payload.substr(1 + nameLen);
+    return true;
+}
+
+// Converts a text-protocol command line into a frame appended to out.
+// Returns false if the line is not a command this protocol knows.
+inline bool encode_text_command(std::string_view line, std::string &out)
+{
+    auto arg = [&](size_t prefix) { return line.size() > prefix ? line.substr(prefix + 1) : std::string_view(); };
+    auto named = [&](uint8_t op, size_t prefix)
+    {
+        if (line.size() <= prefix + 1 || line[prefix] != ' ')
+            return false;
+        std::string_view rest = arg(prefix);
+        size_t space = rest.find(' ');
+        if (space == std::string_view::npos || space > FRAME_MAX_NAME)
+            return false;
+        encode_named_frame(out, op, rest.substr(0, space), rest.substr(space + 1));
+        return true;
+    };
+    auto plain = [&](uint8_t op, size_t prefix)
+    {
+        if (line.size() <= prefix + 1 || line[prefix] != ' ')
+            return false;
+        encode_frame(out, op, arg(prefix));
+        return true;
+    };
+
+    if (line.substr(0, 10) == "/group_msg")
+        return named(OP_GROUP_MSG, 10);
+    if (line.substr(0, 10) == "/broadcast")
+        return plain(OP_BROADCAST, 10);
+    if (line.substr(0, 4) == "/msg")
+        return named(OP_MSG, 4);
+    if (line.substr(0, 13) == "/create_group")
+        return plain(OP_CREATE_GROUP, 13);
+    if (line.substr(0, 11) == "/join_group")
+        return plain(OP_JOIN_GROUP, 11);
+    if (line.substr(0, 12) == "/leave_group")
+        return plain(OP_LEAVE_GROUP, 12);
+    if (line.substr(0, 8) == "/history")
+        return named(OP_HISTORY, 8);
+    return false;
+}
+
+// Incremental frame parser. Frames that arrive whole are handed out straight
+// from the caller's buffer; only a frame straddling two reads is copied.
+class FrameParser
+{
+public:
+    // Feeds received bytes and calls on_frame(op, payload) for every complete
+    // frame. Returns false on a protocol error, after which the stream is
+    // unusable.
+    template <typename Fn>
+    bool feed(const char *data, size_t len, Fn &&on_frame)
+    {
+        while (len > 0)
+        {
+            if (!partial.empty())
+            {
+                // Finish the header, then the payload, of the buffered frame.
+                if (partial.size() < FRAME_HEADER_SIZE)
+                {
+                    size_t take = std::min(FRAME_HEADER_SIZE - partial.size(), len);
+                    partial.append(data, take);
+                    data += take;
+                    len -= take;
+                    if (partial.size() < FRAME_HEADER_SIZE)
+                        return true;
+                }
+                size_t payloadLen;
+                if (!parse_header(partial.data(), payloadLen))
+                    return false;
+                size_t total = FRAME_HEADER_SIZE + payloadLen;
+                size_t take = std::min(total - partial.size(), len);
+                partial.append(data, take);
+                data += take;
+                len -= take;
+                if (partial.size() < total)
+                    return true;
+                on_frame((uint8_t)partial[1], std::string_view(partial.data() + FRAME_HEADER_SIZE, payloadLen));
+                partial.clear();
+                continue;
+            }
+
+            size_t payloadLen = 0;
+            if (len >= FRAME_HEADER_SIZE && !parse_header(data, payloadLen))
+                return false;
+            if (len < FRAME_HEADER_SIZE || len < FRAME_HEADER_SIZE + payloadLen)
+            {
+                partial.assign(data, len);
+                return true;
+            }
+            on_frame((uint8_t)data[1], std::string_view(data + FRAME_HEADER_SIZE, payloadLen));
+            data += FRAME_HEADER_SIZE + payloadLen;
+            len -= FRAME_HEADER_SIZE + payloadLen;
+        }
+        return true;
+    }
+
+private:
+    static bool parse_header(const char *header, size_t &payloadLen)
+    {
+        if ((uint8_t)header[0] != FRAME_MAGIC)
+            return false;
+        payloadLen = ((size_t)(uint8_t)header[2] << 24) | ((size_t)(uint8_t)header[3] << 16) |
+                     ((size_t)(uint8_t)header[4] << 8) | (size_t)(uint8_t)header[5];
+        return payloadLen <= FRAME_MAX_PAYLOAD;
+    }
+
+    std::string partial; // bytes of a frame not yet complete
+};
@@ -0,0 +1,640 @@
+// Groups and their members by username, so memberships outlive connections
+// and, given a directory, server restarts.
+//
+// The registry lives in memory. With a directory, every change is also
+// appended to a write-ahead log. Replaying a log costs more per byte than
+// loading a snapshot, so once the log grows past half the snapshot's size the
+// registry is written out whole as a new snapshot and a new log started:
+//
+//   snapshot  the registry as of the start of log nextWal
+//   wal-N     changes made after the previous log, records as in log_record.h:
+//             CREATE group / JOIN group, user / LEAVE group, user
+//
+// Recovery loads the snapshot and replays the logs numbered from its nextWal
+// on. The snapshot is replaced by renaming, so it is always whole; a log can
+// end in a torn record, which is cut off.
+//
+// In memory, groups and users are numbered in order of appearance and refer
+// to each other by number. Names are found through open-addressing tables of
+// numbers, so loading a snapshot inserts every name into a flat array once
+// and otherwise only appends to arrays. Snapshot layout (host byte order):
+//
+//   GroupSnapshotHeader
+//   per user:   name
+//   per group:  name, member count (4 bytes), members' user numbers (4 bytes each)
+//
+// where names are a 4-byte length followed by the bytes.
+//
+// Changes are appended to memory and written by a flusher thread, which
+// gathers them for one commit interval and fsyncs them together, so a crash
+// loses at most the last few milliseconds of changes. Snapshots are encoded
+// under the registry's lock and written without it.
+
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "log_record.h"
+
+#define REGISTRY_MAGIC "CHATGRP1"
+#define REGISTRY_VERSION 1
+#define REGISTRY_COMMIT_US 1000              // how long changes are gathered into one fsync
+#define REGISTRY_MIN_COMPACT_BYTES (8 << 20) // never snapshot over a smaller log
+
+enum RegistryRecordKind : uint8_t
+{
+    REG_CREATE = 1,
+    REG_JOIN = 2,
+    REG_LEAVE = 3
+};
+
+// Maps names to numbers with linear probing, like the credential index. The
+// names live in the entries they number, which name_of returns.
+class NameTable
+{
+public:
+    // Returns the number of name, or -1 if it has none.
+    template <typename NameOf>
+    int64_t find(std::string_view name, const NameOf &name_of) const
+    {
+        if (slots.empty())
+            return -1;
+        uint32_t hash = hash_name(name);
+        for (size_t i = hash & mask();; i = (i + 1) & mask())
+        {
+            const Slot &slot = slots[i];
+            if (slot.id == 0)
+                return -1;
+            if (slot.hash == hash && name_of(slot.id - 1) == name)
+                return slot.id - 1;
+        }
+    }
+
+    // Adds a name that is not in the table yet.
+    void insert(std::string_view name, uint32_t id)
+    {
+        if ((count + 1) * 10 > slots.size() * 7)
+            reserve(count + 1);
+        place({hash_name(name), id + 1});
+        count++;
+    }
+
+    // Makes room for count names, keeping the table at most 70% full.
+    void reserve(size_t names)
+    {
+        size_t size = 16;
+        while (size * 7 < names * 10)
+            size *= 2;
+        if (size <= slots.size())
+            return;
+        std::vector<Slot> old(size);
+        old.swap(slots);
+        for (const Slot &slot : old)
+        {
+            if (slot.id != 0)
+                place(slot);
+        }
+    }
+
+private:
+    struct Slot
+    {
+        uint32_t hash;
+        uint32_t id; // number + 1, 0 if the slot is empty
+    };
+
+    static uint32_t hash_name(std::string_view name) { return std::hash<std::string_view>()(name); }
+
+    size_t mask() const { return slots.size() - 1; }
+
+    void place(Slot slot)
+    {
+        size_t i = slot.hash & mask();
+        while (slots[i].id != 0)
+            i = (i + 1) & mask();
+        slots[i] = slot;
+    }
+
+    std::vector<Slot> slots; // power of two
+    size_t count = 0;
+};
+
+struct GroupSnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t checksum; // FNV-1a of everything after the header
+    uint64_t nextWal;  // first log not included
+    uint64_t userCount;
+    uint64_t groupCount;
+};
+
+class GroupRegistry
+{
+public:
+    // A registry kept in memory only.
+    GroupRegistry() = default;
+
+    // Opens or creates the registry stored in dir. Returns nullptr, with the
+    // reason in error, on failure.
+    static std::unique_ptr<GroupRegistry> open(const std::string &dir, std::string &error)
+    {
+        if (mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST)
+        {
+            error = dir + ": " + strerror(errno);
+            return nullptr;
+        }
+        std::unique_ptr<GroupRegistry> registry(new GroupRegistry());
+        registry->dir = dir;
+        if (!registry->recover(error))
+            return nullptr;
+        registry->flusher = std::thread(&GroupRegistry::flush_loop, registry.get());
+        return registry;
+    }
+
+    ~GroupRegistry()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        if (flusher.joinable())
+            flusher.join();
+        if (walFd >= 0)
+            close(walFd);
+    }
+
+    bool exists(const std::string &group) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return find_group(group) >= 0;
+    }
+
+    // Creates group unless it exists. Returns whether it was new.
+    bool create(const std::string &group)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (find_group(group) >= 0)
+            return false;
+        apply_create(group);
+        append(LogRecordWriter(REG_CREATE).field(group));
+        return true;
+    }
+
+    // Adds user to group. Returns false if there is no such group.
+    bool join(const std::string &group, const std::string &user)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (find_group(group) < 0)
+            return false;
+        if (apply_join(group, user))
+            append(LogRecordWriter(REG_JOIN).field(group).field(user));
+        return true;
+    }
+
+    // Removes user from group. Returns false if there is no such group.
+    bool leave(const std::string &group, const std::string &user)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (find_group(group) < 0)
+            return false;
+        if (apply_leave(group, user))
+            append(LogRecordWriter(REG_LEAVE).field(group).field(user));
+        return true;
+    }
+
+    bool is_member(const std::string &group, const std::string &user) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        int64_t g = find_group(group), u = find_user(user);
+        if (g < 0 || u < 0)
+            return false;
+        const std::vector<uint32_t> &userGroups = users[u].groups;
+        return std::find(userGroups.begin(), userGroups.end(), (uint32_t)g) != userGroups.end();
+    }
+
+    std::vector<std::string> groups_of(const std::string &user) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<std::string> names;
+        int64_t id = find_user(user);
+        if (id >= 0)
+        {
+            for (uint32_t group : users[id].groups)
+                names.push_back(groups[group].name);
+        }
+        return names;
+    }
+
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return groups.size();
+    }
+
+    // Calls fn(group, members) on every group, with the names of its members.
+    template <typename Fn>
+    void for_each(Fn &&fn) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<std::string_view> members;
+        for (const GroupEntry &group : groups)
+        {
+            members.clear();
+            for (uint32_t user : group.members)
+                members.push_back(users[user].name);
+            fn(group.name, members);
+        }
+    }
+
+private:
+    struct GroupEntry
+    {
+        std::string name;
+        std::vector<uint32_t> members; // user numbers
+    };
+
+    struct UserEntry
+    {
+        std::string name;
+        std::vector<uint32_t> groups; // group numbers
+    };
+
+    int64_t find_group(std::string_view group) const
+    {
+        return groupIndex.find(group, [this](uint32_t id) -> std::string_view { return groups[id].name; });
+    }
+
+    int64_t find_user(std::string_view user) const
+    {
+        return userIndex.find(user, [this](uint32_t id) -> std::string_view { return users[id].name; });
+    }
+
+    // Returns the number of group, creating it if needed.
+    uint32_t apply_create(std::string_view group)
+    {
+        int64_t id = find_group(group);
+        if (id >= 0)
+            return id;
+        groupIndex.insert(group, groups.size());
+        groups.push_back({std::string(group), {}});
+        return groups.size() - 1;
+    }
+
+    uint32_t user_id(std::string_view user)
+    {
+        int64_t id = find_user(user);
+        if (id >= 0)
+            return id;
+        userIndex.insert(user, users.size());
+        users.push_back({std::string(user), {}});
+        return users.size() - 1;
+    }
+
+    // Groups and users are small, so memberships are plain arrays of numbers.
+    bool apply_join(std::string_view group, std::string_view user)
+    {
+        uint32_t g = apply_create(group), u = user_id(user);
+        std::vector<uint32_t> &userGroups = users[u].groups;
+        if (std::find(userGroups.begin(), userGroups.end(), g) != userGroups.end())
+            return false;
+        userGroups.push_back(g);
+        groups[g].members.push_back(u);
+        return true;
+    }
+
+    bool apply_leave(std::string_view group, std::string_view user)
+    {
+        uint32_t g = apply_create(group), u = user_id(user);
+        if (!remove_from(users[u].groups, g))
+            return false;
+        remove_from(groups[g].members, u);
+        return true;
+    }
+
+    static bool remove_from(std::vector<uint32_t> &ids, uint32_t id)
+    {
+        auto it = std::find(ids.begin(), ids.end(), id);
+        if (it == ids.end())
+            return false;
+        *it = ids.back();
+        ids.pop_back();
+        return true;
+    }
+
+    // Queues a change for the flusher. Caller holds mutex.
+    void append(const LogRecordWriter &record)
+    {
+        if (dir.empty())
+            return;
+        bool idle = pending.empty();
+        record.finish(pending);
+        if (idle)
+            wake.notify_one();
+    }
+
+    std::string wal_path(uint64_t number) const { return dir + "/wal-" + std::to_string(number); }
+    std::string snapshot_path() const { return dir + "/snapshot"; }
+
+    // The whole registry as a snapshot file that starts log nextWal. Caller
+    // holds mutex.
+    std::string encode_snapshot(uint64_t nextWal) const
+    {
+        GroupSnapshotHeader header{};
+        memcpy(header.magic, REGISTRY_MAGIC, 8);
+        header.version = REGISTRY_VERSION;
+        header.nextWal = nextWal;
+        header.userCount = users.size();
+        header.groupCount = groups.size();
+        std::string out(sizeof(header), '\0');
+        out.reserve(snapshotSize);
+        for (const UserEntry &user : users)
+        {
+            put_u32(out, user.name.size());
+            out += user.name;
+        }
+        for (const GroupEntry &group : groups)
+        {
+            put_u32(out, group.name.size());
+            out += group.name;
+            put_u32(out, group.members.size());
+            for (uint32_t member : group.members)
+                put_u32(out, member);
+        }
+        header.checksum = log_checksum(std::string_view(out).substr(sizeof(header)));
+        memcpy(out.data(), &header, sizeof(header));
+        return out;
+    }
+
+    // Replaces the snapshot on disk.
+    bool write_snapshot(const std::string &snapshot)
+    {
+        std::string tmp = snapshot_path() + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        bool ok = fd >= 0 && write_at(fd, snapshot, 0) && fsync(fd) == 0;
+        if (fd >= 0)
+            close(fd);
+        if (!ok || rename(tmp.c_str(), snapshot_path().c_str()) < 0)
+        {
+            perror("Group registry snapshot");
+            unlink(tmp.c_str());
+            return false;
+        }
+        sync_dir(dir);
+        return true;
+    }
+
+    // Loads a snapshot. Returns the log it starts, or -1 with the reason in
+    // error.
+    long long load_snapshot(std::string &error)
+    {
+        int fd = ::open(snapshot_path().c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == ENOENT)
+                return 0;
+            error = snapshot_path() + ": " + strerror(errno);
+            return -1;
+        }
+        struct stat st;
+        std::string data;
+        if (fstat(fd, &st) == 0)
+        {
+            data.resize(st.st_size);
+            if (pread(fd, data.data(), data.size(), 0) != (ssize_t)data.size())
+                data.clear();
+        }
+        close(fd);
+
+        GroupSnapshotHeader header;
+        if (data.size() < sizeof(header))
+        {
+            error = snapshot_path() + ": not a group snapshot";
+            return -1;
+        }
+        memcpy(&header, data.data(), sizeof(header));
+        std::string_view body = std::string_view(data).substr(sizeof(header));
+        if (memcmp(header.magic, REGISTRY_MAGIC, 8) != 0 || header.version != REGISTRY_VERSION ||
+            log_checksum(body) != header.checksum)
+        {
+            error = snapshot_path() + ": not a group snapshot, or damaged";
+            return -1;
+        }
+
+        users.reserve(header.userCount);
+        userIndex.reserve(header.userCount);
+        groups.reserve(header.groupCount);
+        groupIndex.reserve(header.groupCount);
+        size_t at = 0;
+        auto u32 = [&](uint32_t &out)
+        {
+            if (body.size() - at < 4)
+                return false;
+            out = get_u32(body.data() + at);
+            at += 4;
+            return true;
+        };
+        auto name = [&](std::string_view &out)
+        {
+            uint32_t len;
+            if (!u32(len) || body.size() - at < len)
+                return false;
+            out = body.substr(at, len);
+            at += len;
+            return true;
+        };
+        std::string_view text;
+        for (uint64_t u = 0; u < header.userCount; u++)
+        {
+            if (!name(text))
+            {
+                error = snapshot_path() + ": truncated";
+                return -1;
+            }
+            user_id(text);
+        }
+        for (uint64_t g = 0; g < header.groupCount; g++)
+        {
+            uint32_t count, member;
+            if (!name(text) || !u32(count))
+            {
+                error = snapshot_path() + ": truncated";
+                return -1;
+            }
+            uint32_t id = apply_create(text);
+            std::vector<uint32_t> &members = groups[id].members;
+            members.reserve(count);
+            for (uint32_t m = 0; m < count; m++)
+            {
+                if (!u32(member) || member >= users.size())
+                {
+                    error = snapshot_path() + ": damaged";
+                    return -1;
+                }
+                members.push_back(member);
+                users[member].groups.push_back(id);
+            }
+        }
+        snapshotSize = data.size();
+        return header.nextWal;
+    }
+
+    bool recover(std::string &error)
+    {
+        long long nextWal = load_snapshot(error);
+        if (nextWal < 0)
+            return false;
+
+        // Logs older than the snapshot are left over from a crash right
+        // after it was written.
+        std::vector<uint64_t> logs;
+        if (DIR *d = opendir(dir.c_str()))
+        {
+            while (dirent *entry = readdir(d))
+            {
+                unsigned long long number;
+                int end = 0;
+                if (sscanf(entry->d_name, "wal-%llu%n", &number, &end) != 1 || entry->d_name[end] != '\0')
+                    continue;
+                if (number < (unsigned long long)nextWal)
+                    unlink(wal_path(number).c_str());
+                else
+                    logs.push_back(number);
+            }
+            closedir(d);
+        }
+        std::sort(logs.begin(), logs.end());
+
+        auto replay = [this](uint64_t, uint8_t kind, const std::vector<std::string_view> &fields)
+        {
+            if (kind == REG_CREATE && fields.size() == 1)
+                apply_create(fields[0]);
+            else if (kind == REG_JOIN && fields.size() == 2)
+                apply_join(fields[0], fields[1]);
+            else if (kind == REG_LEAVE && fields.size() == 2)
+                apply_leave(fields[0], fields[1]);
+        };
+        for (uint64_t number : logs)
+        {
+            int fd = ::open(wal_path(number).c_str(), O_RDWR | O_CLOEXEC);
+            long long length = fd < 0 ? -1 : replay_log_file(fd, wal_path(number), replay, error);
+            if (fd >= 0)
+                close(fd);
+            if (length < 0)
+            {
+                if (error.empty())
+                    error = wal_path(number) + ": " + strerror(errno);
+                return false;
+            }
+            walSize = length;
+        }
+
+        // Continue the last log, unless a crash left several: then fold them
+        // into a snapshot so the next start has less to replay.
+        walNumber = logs.empty() ? nextWal : logs.back();
+        if (logs.size() > 1)
+        {
+            walNumber++;
+            walSize = 0;
+            if (!write_snapshot(encode_snapshot(walNumber)))
+            {
+                error = snapshot_path() + ": cannot be written";
+                return false;
+            }
+            for (uint64_t number : logs)
+                unlink(wal_path(number).c_str());
+        }
+        walFd = ::open(wal_path(walNumber).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (walFd < 0)
+        {
+            error = wal_path(walNumber) + ": " + strerror(errno);
+            return false;
+        }
+        sync_dir(dir);
+        return true;
+    }
+
+    void flush_loop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            wake.wait(lock, [this] { return stopping || !pending.empty(); });
+            if (pending.empty())
+                return;
+            // Let a group of changes gather before paying for the fsync.
+            lock.unlock();
+            std::this_thread::sleep_for(std::chrono::microseconds(REGISTRY_COMMIT_US));
+            lock.lock();
+
+            std::string bytes;
+            bytes.swap(pending);
+            int fd = walFd;
+            uint64_t offset = walSize;
+            walSize += bytes.size();
+            std::string snapshot;
+            uint64_t oldWal = walNumber;
+            if (walSize > std::max<uint64_t>(REGISTRY_MIN_COMPACT_BYTES, snapshotSize / 2))
+            {
+                int next = ::open(wal_path(walNumber + 1).c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+                if (next >= 0)
+                {
+                    snapshot = encode_snapshot(walNumber + 1);
+                    snapshotSize = snapshot.size();
+                    walFd = next;
+                    walNumber++;
+                    walSize = 0;
+                }
+                else
+                    perror("Group registry log");
+            }
+            lock.unlock();
+
+            if (!write_at(fd, bytes, offset) || fdatasync(fd) < 0)
+                perror("Group registry log");
+            if (!snapshot.empty())
+            {
+                close(fd);
+                if (write_snapshot(snapshot))
+                {
+                    unlink(wal_path(oldWal).c_str());
+                    sync_dir(dir);
+                }
+            }
+            lock.lock();
+        }
+    }
+
+    std::string dir; // empty if kept in memory only
+    mutable std::mutex mutex;
+    std::vector<GroupEntry> groups; // by number
+    std::vector<UserEntry> users;   // by number
+    NameTable groupIndex;
+    NameTable userIndex;
+
+    std::condition_variable wake;
+    std::thread flusher;
+    bool stopping = false;
+    std::string pending;       // changes not written yet
+    int walFd = -1;
+    uint64_t walNumber = 0;
+    uint64_t walSize = 0;      // bytes written or being written to the log
+    uint64_t snapshotSize = 0; // of the last snapshot
+};
@@ -0,0 +1,199 @@
+// Recent messages of each group, kept in memory for /history.
+//
+// A group's history lives in one fixed-size arena: a table of (offset, length)
+// entries, used as a ring, followed by the message bytes, also used as a
+// ring. Appending copies the message after the previous one, wrapping to the
+// start of the byte ring when it does not fit before the end, and drops the
+// oldest messages it overwrites. No message ever gets a heap allocation of its
+// own.
+//
+// Arenas come from a HistoryStore, which caps their number and so the memory
+// all groups use together. Once the cap is reached, a group that needs an
+// arena takes the one of the group written to least recently, whose history is
+// lost.
+//
+// A ring's methods lock the ring; appends to different groups never contend.
+
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <string_view>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+
+#define HISTORY_MESSAGES 100            // default messages kept per group
+#define HISTORY_MAX_MESSAGES 1000       // most a group may keep
+#define HISTORY_GROUP_BYTES (64 << 10)  // arena size per group
+#define HISTORY_TOTAL_BYTES (64 << 20)  // default cap across all groups
+
+class HistoryRing;
+
+class HistoryStore
+{
+public:
+    // Keeps up to messages per group, in arenas of HISTORY_GROUP_BYTES, with
+    // at most totalBytes of arenas in all.
+    HistoryStore(size_t messages, size_t totalBytes)
+        : messages(messages), limit(totalBytes / HISTORY_GROUP_BYTES)
+    {
+    }
+
+    size_t messages_per_group() const { return messages; }
+    size_t data_bytes() const; // message bytes an arena holds after its entry table
+    uint64_t tick() { return clock.fetch_add(1, std::memory_order_relaxed); }
+
+    // Returns an arena for ring, taken from the least recently written ring
+    // once the cap is reached, or nullptr if there is none to take. Called
+    // with ring's lock held; other rings are only try-locked, so two rings
+    // looking for arenas at once cannot deadlock.
+    char *acquire(HistoryRing *ring);
+
+    size_t arenas()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return holders.size();
+    }
+
+private:
+    size_t messages;
+    size_t limit; // arenas
+    std::atomic<uint64_t> clock{0};
+    std::mutex mutex;
+    std::vector<std::unique_ptr<char[]>> pool;  // every arena allocated
+    std::vector<HistoryRing *> holders;         // rings holding one
+};
+
+class HistoryRing
+{
+public:
+    // Adds a message, dropping the oldest ones to make room. Messages larger
+    // than a whole arena are not kept.
+    void append(std::string_view text, HistoryStore &store)
+    {
+        size_t capacity = store.data_bytes();
+        if (text.size() > capacity)
+            return;
+        std::lock_guard<std::mutex> lock(mutex);
+        lastWrite.store(store.tick(), std::memory_order_relaxed);
+        if (!arena)
+        {
+            arena = store.acquire(this);
+            if (!arena)
+                return;
+            size = store.messages_per_group();
+            head = count = writePos = 0;
+        }
+        Entry *entries = (Entry *)arena;
+        char *data = arena + size * sizeof(Entry);
+
+        size_t pos = writePos;
+        if (pos + text.size() > capacity)
+        {
+            // Wrap around: everything left between here and the end is
+            // older than what was written from the start.
+            while (count > 0 && entries[head].offset >= writePos)
+                drop_oldest();
+            pos = 0;
+        }
+        while (count > 0 && (count == size || overlaps(entries[head], pos, text.size())))
+            drop_oldest();
+        memcpy(data + pos, text.data(), text.size());
+        entries[(head + count) % size] = {(uint32_t)pos, (uint32_t)text.size()};
+        count++;
+        writePos = pos + text.size();
+    }
+
+    // Calls fn(text) on each of the last n messages, oldest first, with the
+    // ring locked. Returns how many there were.
+    template <typename Fn>
+    size_t last(size_t n, Fn &&fn)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!arena)
+            return 0;
+        Entry *entries = (Entry *)arena;
+        char *data = arena + size * sizeof(Entry);
+        n = std::min(n, count);
+        for (size_t i = count - n; i < count; i++)
+        {
+            const Entry &entry = entries[(head + i) % size];
+            fn(std::string_view(data + entry.offset, entry.length));
+        }
+        return n;
+    }
+
+private:
+    friend class HistoryStore;
+
+    struct Entry
+    {
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    static bool overlaps(const Entry &entry, size_t pos, size_t len)
+    {
+        return entry.offset < pos + len && entry.offset + entry.length > pos;
+    }
+
+    void drop_oldest()
+    {
+        head = (head + 1) % size;
+        count--;
+    }
+
+    // Gives the arena up to another ring. Caller holds mutex.
+    char *surrender()
+    {
+        char *taken = arena;
+        arena = nullptr;
+        count = 0;
+        return taken;
+    }
+
+    std::mutex mutex;
+    std::atomic<uint64_t> lastWrite{0}; // store tick of the last append, read by other rings' acquire()
+    char *arena = nullptr;              // entry table, then message bytes
+    size_t size = 0;                    // entries in the table
+    size_t head = 0;                    // oldest entry
+    size_t count = 0;
+    size_t writePos = 0;                // byte offset after the newest message
+};
+
+inline char *HistoryStore::acquire(HistoryRing *ring)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (pool.size() < limit)
+    {
+        pool.emplace_back(new char[HISTORY_GROUP_BYTES]);
+        holders.push_back(ring);
+        return pool.back().get();
+    }
+    // Take the arena of the ring written to least recently. If that ring is
+    // busy right now it is evidently not idle, and the message goes
+    // unrecorded instead.
+    size_t oldest = holders.size();
+    for (size_t i = 0; i < holders.size(); i++)
+    {
+        if (holders[i] != ring && (oldest == holders.size() ||
+                                   holders[i]->lastWrite.load(std::memory_order_relaxed) <
+                                       holders[oldest]->lastWrite.load(std::memory_order_relaxed)))
+            oldest = i;
+    }
+    if (oldest == holders.size() || !holders[oldest]->mutex.try_lock())
+        return nullptr;
+    HistoryRing *victim = holders[oldest];
+    char *arena = victim->surrender();
+    victim->mutex.unlock();
+    holders[oldest] = ring;
+    return arena;
+}
+
+inline size_t HistoryStore::data_bytes() const
+{
+    return HISTORY_GROUP_BYTES - messages * sizeof(HistoryRing::Entry);
+}
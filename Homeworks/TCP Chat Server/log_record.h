@@ -0,0 +1,170 @@
+// Checksummed records shared by the server's append-only files (the message
+// log and the group registry's write-ahead log).
+//
+//   size      4 bytes  length of the body
+//   checksum  4 bytes  FNV-1a of the body
+//   body      kind byte, then fields as 4-byte length + bytes
+//
+// Integers are in host byte order: the files never leave the machine that
+// wrote them. A crash can leave a partial record at the end of a file; readers
+// stop at the first record that is incomplete or fails its checksum.
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define LOG_HEADER_SIZE 8
+
+inline uint32_t log_checksum(std::string_view body)
+{
+    uint32_t hash = 2166136261u;
+    for (unsigned char c : body)
+    {
+        hash ^= c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+inline void put_u32(std::string &out, uint32_t value)
+{
+    char bytes[4];
+    memcpy(bytes, &value, 4);
+    out.append(bytes, 4);
+}
+
+inline uint32_t get_u32(const char *in)
+{
+    uint32_t value;
+    memcpy(&value, in, 4);
+    return value;
+}
+
+// Builds records field by field.
+class LogRecordWriter
+{
+public:
+    explicit LogRecordWriter(uint8_t kind) { body.push_back((char)kind); }
+
+    LogRecordWriter &field(std::string_view value)
+    {
+        put_u32(body, value.size());
+        body.append(value);
+        return *this;
+    }
+
+    // Appends the framed record to out.
+    void finish(std::string &out) const
+    {
+        put_u32(out, body.size());
+        put_u32(out, log_checksum(body));
+        out += body;
+    }
+
+    size_t size() const { return LOG_HEADER_SIZE + body.size(); }
+
+private:
+    std::string body;
+};
+
+// Splits a record body into its kind and fields. Returns false if malformed.
+inline bool parse_log_record(std::string_view body, uint8_t &kind, std::vector<std::string_view> &fields)
+{
+    if (body.empty())
+        return false;
+    kind = (uint8_t)body[0];
+    fields.clear();
+    size_t at = 1;
+    while (at < body.size())
+    {
+        if (body.size() - at < 4)
+            return false;
+        uint32_t len = get_u32(body.data() + at);
+        at += 4;
+        if (body.size() - at < len)
+            return false;
+        fields.push_back(body.substr(at, len));
+        at += len;
+    }
+    return true;
+}
+
+// Calls fn(offset, kind, fields) on every intact record of the file open as fd,
+// in order, then cuts off whatever follows the last one. Returns the length of
+// the intact part, or -1 with the reason in error.
+template <typename Fn>
+long long replay_log_file(int fd, const std::string &path, Fn &&fn, std::string &error)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        error = path + ": " + strerror(errno);
+        return -1;
+    }
+    std::string data(st.st_size, '\0');
+    if (pread(fd, data.data(), data.size(), 0) != (ssize_t)data.size())
+    {
+        error = path + ": " + strerror(errno);
+        return -1;
+    }
+    std::vector<std::string_view> fields;
+    size_t at = 0;
+    while (data.size() - at >= LOG_HEADER_SIZE)
+    {
+        uint32_t size = get_u32(data.data() + at);
+        if (data.size() - at - LOG_HEADER_SIZE < size)
+            break;
+        std::string_view body(data.data() + at + LOG_HEADER_SIZE, size);
+        uint8_t kind;
+        if (log_checksum(body) != get_u32(data.data() + at + 4) || !parse_log_record(body, kind, fields))
+            break;
+        fn(at, kind, fields);
+        at += LOG_HEADER_SIZE + size;
+    }
+    if (at < data.size())
+    {
+        fprintf(stderr, "Discarding %zu damaged bytes at the end of %s\n", data.size() - at, path.c_str());
+        if (ftruncate(fd, at) < 0)
+        {
+            error = path + ": " + strerror(errno);
+            return -1;
+        }
+    }
+    return at;
+}
+
+inline bool write_at(int fd, std::string_view bytes, uint64_t offset)
+{
+    size_t done = 0;
+    while (done < bytes.size())
+    {
+        ssize_t n = pwrite(fd, bytes.data() + done, bytes.size() - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+// Makes files created, renamed or deleted in dir durable themselves, not just
+// their contents.
+inline void sync_dir(const std::string &dir)
+{
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0)
+    {
+        fsync(fd);
+        close(fd);
+    }
+}
@@ -0,0 +1,67 @@
+// Lock-free multi-producer single-consumer queue used to pass work between
+// reactor shards.
+//
+// This is Dmitry Vyukov's non-intrusive MPSC queue: producers swing `head`
+// with a single atomic exchange and then link the previous node, while the
+// only consumer walks from `tail`. A producer that has exchanged but not yet
+// linked makes the queue look momentarily empty; callers must therefore wake
+// the consumer after push() returns, never before.
+
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+template <typename T>
+class Mailbox
+{
+public:
+    Mailbox()
+    {
+        Node *stub = new Node();
+        head.store(stub, std::memory_order_relaxed);
+        tail = stub;
+    }
+
+    ~Mailbox()
+    {
+        T discard;
+        while (pop(discard))
+            ;
+        delete tail;
+    }
+
+    Mailbox(const Mailbox &) = delete;
+    Mailbox &operator=(const Mailbox &) = delete;
+
+    // Safe to call from any thread.
+    void push(T value)
+    {
+        Node *node = new Node();
+        node->value = std::move(value);
+        Node *prev = head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    // Consumer thread only. Returns false when no linked item is available.
+    bool pop(T &out)
+    {
+        Node *next = tail->next.load(std::memory_order_acquire);
+        if (!next)
+            return false;
+        out = std::move(next->value);
+        delete tail;
+        tail = next; // next becomes the new stub
+        return true;
+    }
+
+private:
+    struct Node
+    {
+        std::atomic<Node *> next{nullptr};
+        T value{};
+    };
+
+    std::atomic<Node *> head; // last pushed node, shared by producers
+    Node *tail;               // stub preceding the oldest item, consumer only
+};
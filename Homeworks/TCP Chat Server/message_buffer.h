@@ -0,0 +1,359 @@
+// Immutable, reference-counted outbound messages and the per-connection queue
+// that holds them.
+//
+// A message is encoded exactly once, however many clients receive it: the
+// bytes live in a single allocation behind a precomputed OP_TEXT frame header,
+// so text clients are sent text() and framed clients frame() from the same
+// memory. Fan-out then only copies a pointer into each recipient's queue.
+// Raw messages hold bytes already encoded for one particular connection and
+// are sent as-is to either kind of client.
+//
+// Messages made on a hot path come from a MessageArena instead of malloc: the
+// arena carves them out of fixed chunks, and a chunk whose messages have all
+// been released, by whichever thread, goes back to its arena to be reused.
+
+#pragma once
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <new>
+#include <string_view>
+#include <initializer_list>
+#include <utility>
+#include <vector>
+#include "frame_codec.h"
+
+#define ARENA_CHUNK_BYTES (8 << 10) // message memory per arena chunk
+#define ARENA_MAX_MESSAGE (2 << 10) // larger messages are allocated on their own
+#define ARENA_SPARE_CHUNKS 16       // free chunks an arena keeps for reuse
+
+struct ArenaState;
+
+// A block an arena carves messages out of. refs counts its live messages, plus
+// one while the arena is still carving from it.
+struct ArenaChunk
+{
+    std::atomic<uint32_t> refs;
+    uint32_t used;      // bytes carved, arena thread only
+    ArenaState *state;
+    ArenaChunk *next;   // in a list of free chunks
+    char *bytes() { return reinterpret_cast<char *>(this + 1); }
+};
+
+// The part of an arena that outlives it while its chunks are still in use.
+struct ArenaState
+{
+    std::atomic<uint32_t> refs{1};              // the arena, plus one per chunk allocated
+    std::atomic<ArenaChunk *> returned{nullptr}; // chunks freed by any thread, or ARENA_CLOSED
+};
+
+inline ArenaChunk *const ARENA_CLOSED = reinterpret_cast<ArenaChunk *>(uintptr_t(1)); // arena destroyed
+
+inline void arena_state_release(ArenaState *state)
+{
+    if (state->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        delete state;
+}
+
+inline void arena_free_chunk(ArenaChunk *chunk)
+{
+    ArenaState *state = chunk->state;
+    free(chunk);
+    arena_state_release(state);
+}
+
+// Drops a reference to a chunk. The last one hands the chunk back to its
+// arena, or frees it if the arena is gone. Lock-free: pushes only race other
+// pushes, and the arena takes the whole list at once.
+inline void arena_chunk_release(ArenaChunk *chunk)
+{
+    if (chunk->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+    std::atomic<ArenaChunk *> &returned = chunk->state->returned;
+    ArenaChunk *head = returned.load(std::memory_order_relaxed);
+    do
+    {
+        if (head == ARENA_CLOSED)
+        {
+            arena_free_chunk(chunk);
+            return;
+        }
+        chunk->next = head;
+    } while (!returned.compare_exchange_weak(head, chunk, std::memory_order_release, std::memory_order_relaxed));
+}
+
+class MessageRef
+{
+public:
+    MessageRef() = default;
+    MessageRef(const MessageRef &other) : buf(other.buf) { retain(); }
+    MessageRef(MessageRef &&other) noexcept : buf(other.buf) { other.buf = nullptr; }
+    ~MessageRef() { release(); }
+
+    MessageRef &operator=(MessageRef other) noexcept
+    {
+        std::swap(buf, other.buf);
+        return *this;
+    }
+
+    // Concatenates parts into a new message.
+    static MessageRef make(std::initializer_list<std::string_view> parts)
+    {
+        size_t len = 0;
+        for (std::string_view part : parts)
+            len += part.size();
+        return fill(allocate(len), parts);
+    }
+
+    static MessageRef make(std::string_view text) { return make({text}); }
+
+    // Wraps bytes already in the recipient's wire format.
+    static MessageRef raw(std::string_view bytes)
+    {
+        MessageRef msg = make({bytes});
+        msg.buf->raw = true;
+        return msg;
+    }
+
+    explicit operator bool() const { return buf != nullptr; }
+    bool is_raw() const { return buf->raw; }
+    const char *text() const { return buf->bytes() + FRAME_HEADER_SIZE; }
+    size_t text_size() const { return buf->size; }
+    const char *frame() const { return buf->raw ? text() : buf->bytes(); }
+    size_t frame_size() const { return buf->raw ? buf->size : FRAME_HEADER_SIZE + buf->size; }
+
+    // The bytes to put on the wire for a text or framed client.
+    const char *wire(bool framed) const { return framed ? frame() : text(); }
+    size_t wire_size(bool framed) const { return framed ? frame_size() : text_size(); }
+
+private:
+    friend class MessageArena;
+
+    struct Buffer
+    {
+        std::atomic<uint32_t> refs;
+        uint32_t size;     // text bytes, excluding the frame header
+        bool raw;          // already encoded, send text() to every client
+        ArenaChunk *chunk; // arena chunk holding it, null if malloc'ed
+        char *bytes() { return reinterpret_cast<char *>(this + 1); }
+    };
+
+    static Buffer *allocate(size_t len)
+    {
+        void *mem = malloc(sizeof(Buffer) + FRAME_HEADER_SIZE + len);
+        if (!mem)
+            throw std::bad_alloc();
+        return construct(mem, len, nullptr);
+    }
+
+    static Buffer *construct(void *mem, size_t len, ArenaChunk *chunk)
+    {
+        Buffer *buf = new (mem) Buffer{{1}, (uint32_t)len, false, chunk};
+        encode_frame_header(buf->bytes(), OP_TEXT, len);
+        return buf;
+    }
+
+    static MessageRef fill(Buffer *buf, std::initializer_list<std::string_view> parts)
+    {
+        MessageRef msg;
+        msg.buf = buf;
+        char *out = buf->bytes() + FRAME_HEADER_SIZE;
+        for (std::string_view part : parts)
+        {
+            memcpy(out, part.data(), part.size());
+            out += part.size();
+        }
+        return msg;
+    }
+
+    void retain()
+    {
+        if (buf)
+            buf->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void release()
+    {
+        if (buf && buf->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            ArenaChunk *chunk = buf->chunk;
+            buf->~Buffer();
+            if (chunk)
+                arena_chunk_release(chunk);
+            else
+                free(buf);
+        }
+        buf = nullptr;
+    }
+
+    Buffer *buf = nullptr;
+};
+
+// Makes messages for one thread, out of chunks that are recycled once their
+// messages are gone, so in steady state a message costs a pointer bump rather
+// than a malloc. Only the owning thread may call make(); the messages can be
+// sent to and released by any thread, and may outlive the arena.
+class MessageArena
+{
+public:
+    MessageArena() = default;
+    MessageArena(const MessageArena &) = delete;
+    MessageArena &operator=(const MessageArena &) = delete;
+
+    ~MessageArena()
+    {
+        if (!state)
+            return;
+        // Chunks still in use are freed by whoever releases them last.
+        free_chunks(state->returned.exchange(ARENA_CLOSED, std::memory_order_acquire));
+        free_chunks(spare);
+        if (current)
+            arena_chunk_release(current);
+        arena_state_release(state);
+    }
+
+    // Concatenates parts into a new message.
+    MessageRef make(std::initializer_list<std::string_view> parts)
+    {
+        size_t len = 0;
+        for (std::string_view part : parts)
+            len += part.size();
+        if (len > ARENA_MAX_MESSAGE)
+            return MessageRef::make(parts);
+        size_t need = sizeof(MessageRef::Buffer) + FRAME_HEADER_SIZE + len;
+        need = (need + alignof(MessageRef::Buffer) - 1) & ~(alignof(MessageRef::Buffer) - 1);
+        if (!current || current->used + need > ARENA_CHUNK_BYTES)
+            next_chunk();
+        void *mem = current->bytes() + current->used;
+        current->used += need;
+        current->refs.fetch_add(1, std::memory_order_relaxed);
+        return MessageRef::fill(MessageRef::construct(mem, len, current), parts);
+    }
+
+    MessageRef make(std::string_view text) { return make({text}); }
+
+    // Wraps bytes already in the recipient's wire format.
+    MessageRef raw(std::string_view bytes)
+    {
+        MessageRef msg = make({bytes});
+        msg.buf->raw = true;
+        return msg;
+    }
+
+private:
+    // Retires the current chunk and starts carving from a free one, reusing
+    // chunks other threads have handed back before allocating.
+    void next_chunk()
+    {
+        if (current)
+            arena_chunk_release(current);
+        if (!state)
+            state = new ArenaState;
+        if (!spare)
+            take_returned();
+        if (spare)
+        {
+            current = spare;
+            spare = spare->next;
+        }
+        else
+        {
+            current = static_cast<ArenaChunk *>(malloc(sizeof(ArenaChunk) + ARENA_CHUNK_BYTES));
+            if (!current)
+                throw std::bad_alloc();
+            current->state = state;
+            state->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+        current->refs.store(1, std::memory_order_relaxed);
+        current->used = 0;
+    }
+
+    // Moves the chunks handed back so far to spare, freeing any beyond
+    // ARENA_SPARE_CHUNKS.
+    void take_returned()
+    {
+        spare = state->returned.exchange(nullptr, std::memory_order_acquire);
+        ArenaChunk *last = spare;
+        for (int kept = 1; last && kept < ARENA_SPARE_CHUNKS; kept++)
+            last = last->next;
+        if (last)
+        {
+            free_chunks(last->next);
+            last->next = nullptr;
+        }
+    }
+
+    static void free_chunks(ArenaChunk *chunk)
+    {
+        while (chunk)
+        {
+            ArenaChunk *next = chunk->next;
+            arena_free_chunk(chunk);
+            chunk = next;
+        }
+    }
+
+    ArenaState *state = nullptr;   // created with the first chunk
+    ArenaChunk *current = nullptr; // chunk being carved
+    ArenaChunk *spare = nullptr;   // free chunks, arena thread only
+};
+
+// FIFO of messages waiting to be written to one connection. A ring buffer over
+// a power-of-two vector, so steady-state pushes and pops never allocate.
+class MessageQueue
+{
+public:
+    bool empty() const { return head == tail; }
+    size_t size() const { return tail - head; }
+
+    void push(MessageRef msg)
+    {
+        if (size() == slots.size())
+            grow();
+        slots[tail++ & (slots.size() - 1)] = std::move(msg);
+    }
+
+    // i-th queued message, 0 being the oldest.
+    const MessageRef &at(size_t i) const { return slots[(head + i) & (slots.size() - 1)]; }
+
+    void pop()
+    {
+        slots[head++ & (slots.size() - 1)] = MessageRef();
+    }
+
+    void pop_back()
+    {
+        slots[--tail & (slots.size() - 1)] = MessageRef();
+    }
+
+    // Removes the i-th message, keeping the older ones in order.
+    void erase(size_t i)
+    {
+        for (; i > 0; i--)
+            slots[(head + i) & (slots.size() - 1)] = std::move(slots[(head + i - 1) & (slots.size() - 1)]);
+        pop();
+    }
+
+    void clear()
+    {
+        while (!empty())
+            pop();
+    }
+
+private:
+    void grow()
+    {
+        std::vector<MessageRef> bigger(slots.empty() ? 4 : slots.size() * 2);
+        for (size_t i = 0; i < size(); i++)
+            bigger[i] = std::move(slots[(head + i) & (slots.size() - 1)]);
+        tail = size();
+        head = 0;
+        slots.swap(bigger);
+    }
+
+    std::vector<MessageRef> slots;
+    size_t head = 0; // index of the oldest message, grows without wrapping
+    size_t tail = 0; // one past the newest message
+};
@@ -0,0 +1,500 @@
+// Durable log of messages for users who are offline, replayed when they log
+// back in.
+//
+// The log is a directory of append-only segment files, each named after the
+// log position of its first byte (Kafka style), so a position identifies a
+// record across segments. Records (log_record.h) are of four kinds:
+//
+//   PRIVATE  from, to, text   a /msg to a registered user who was offline
+//   GROUP    group, text      a group message some offline member missed
+//   AWAY     user, groups...  the user logged out while a member of groups
+//   BACK     user             everything pending for user was delivered
+//
+// Per user the log keeps a cursor: the positions of the records waiting for
+// that user. It is rebuilt on startup by replaying every segment, so nothing
+// but the log itself needs to be stored. Each new segment starts with the
+// AWAY records of everyone still away, so a segment is only needed as long as
+// it holds undelivered messages; segments are deleted oldest first once none
+// of their messages is pending.
+//
+// Appending only encodes the record into memory under a mutex. A flusher
+// thread writes what accumulated during one commit interval and fsyncs it
+// with a single call (group commit), then runs the callbacks of the appends it
+// made durable. Delivery is at least once: a crash between replaying a user's
+// messages and making their BACK record durable replays them again.
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+#include "log_record.h"
+
+#define MLOG_SEGMENT_BYTES (64 << 20) // start a new segment beyond this size
+#define MLOG_COMMIT_US 1000           // how long appends are gathered into one fsync
+
+enum LogRecordKind : uint8_t
+{
+    LOG_PRIVATE = 1,
+    LOG_GROUP = 2,
+    LOG_AWAY = 3,
+    LOG_BACK = 4
+};
+
+// A message replayed to a returning user.
+struct MissedMessage
+{
+    LogRecordKind kind; // LOG_PRIVATE or LOG_GROUP
+    std::string from;   // sender of a private message, group of a group message
+    std::string text;
+};
+
+class MessageLog
+{
+public:
+    // Opens the log in dir, creating the directory if needed, and rebuilds
+    // every cursor from it. Returns nullptr, with the reason in error, on
+    // failure.
+    static std::unique_ptr<MessageLog> open(const std::string &dir, std::string &error)
+    {
+        if (mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST)
+        {
+            error = dir + ": " + strerror(errno);
+            return nullptr;
+        }
+        std::unique_ptr<MessageLog> log(new MessageLog(dir));
+        if (!log->recover(error))
+            return nullptr;
+        log->flusher = std::thread(&MessageLog::flush_loop, log.get());
+        return log;
+    }
+
+    ~MessageLog()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        if (flusher.joinable())
+            flusher.join();
+        for (auto &[base, segment] : segments)
+            close(segment.fd);
+    }
+
+    // Saves a private message for an offline user, unless still_offline()
+    // says otherwise once the log is locked: a user who logs in takes their
+    // messages under the same lock, so nothing falls in between. on_durable
+    // runs on the flusher thread once the message is on disk. Returns whether
+    // the message was saved.
+    template <typename Check>
+    bool store_private(std::string_view from, std::string_view to, std::string_view text, Check still_offline,
+                       std::function<void()> on_durable = nullptr)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!still_offline())
+            return false;
+        LogRecordWriter record(LOG_PRIVATE);
+        record.field(from).field(to).field(text);
+        uint64_t position = append(record);
+        add_pending(std::string(to), position);
+        if (on_durable)
+            callbacks.push_back(std::move(on_durable));
+        return true;
+    }
+
+    // Saves a group message for the group's offline members, if it has any.
+    // Groups without them cost one lock-free lookup.
+    void store_group(std::string_view group, std::string_view text)
+    {
+        if (!awayHint.contains(group))
+            return;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = awayMembers.find(std::string(group));
+        if (it == awayMembers.end())
+            return;
+        LogRecordWriter record(LOG_GROUP);
+        record.field(group).field(text);
+        uint64_t position = append(record);
+        for (const std::string &user : it->second)
+            add_pending(user, position);
+    }
+
+    // Records that a user logged out while a member of groups, so messages to
+    // those groups are kept for them.
+    void user_left(const std::string &user, const std::unordered_set<std::string> &groups)
+    {
+        if (groups.empty())
+            return;
+        std::lock_guard<std::mutex> lock(mutex);
+        LogRecordWriter record(LOG_AWAY);
+        record.field(user);
+        for (const std::string &group : groups)
+            record.field(group);
+        append(record);
+        set_away(user, std::vector<std::string>(groups.begin(), groups.end()));
+    }
+
+    // Returns the messages a user missed, oldest first, and forgets them.
+    // Call once the user can be reached directly, so that nothing sent from
+    // now on is stored instead.
+    std::vector<MissedMessage> user_returned(const std::string &user)
+    {
+        std::vector<MissedMessage> missed;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = pending.find(user);
+        bool away = awayGroups.count(user) > 0;
+        if (it == pending.end() && !away)
+            return missed;
+        if (it != pending.end())
+        {
+            std::vector<std::string_view> fields;
+            std::string body;
+            uint8_t kind;
+            for (uint64_t position : it->second)
+            {
+                if (!read_record(position, body) || !parse_log_record(body, kind, fields))
+                    continue;
+                if (kind == LOG_PRIVATE && fields.size() == 3)
+                    missed.push_back({LOG_PRIVATE, std::string(fields[0]), std::string(fields[2])});
+                else if (kind == LOG_GROUP && fields.size() == 2)
+                    missed.push_back({LOG_GROUP, std::string(fields[0]), std::string(fields[1])});
+            }
+        }
+        LogRecordWriter record(LOG_BACK);
+        record.field(user);
+        append(record);
+        clear_user(user);
+        return missed;
+    }
+
+private:
+    struct Segment
+    {
+        int fd;
+        uint64_t base;       // log position of the first byte
+        size_t pending = 0;  // undelivered messages it holds
+    };
+
+    // Bytes appended but not written yet, all within one segment.
+    struct Unwritten
+    {
+        uint64_t position;
+        int fd;          // segment it belongs to
+        uint64_t offset; // of position within the segment
+        std::string bytes;
+    };
+
+    explicit MessageLog(std::string dir) : dir(std::move(dir)) {}
+
+    std::string segment_path(uint64_t base) const
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "%020llu.log", (unsigned long long)base);
+        return dir + "/" + name;
+    }
+
+    bool open_segment(uint64_t base, std::string &error)
+    {
+        std::string path = segment_path(base);
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd < 0)
+        {
+            error = path + ": " + strerror(errno);
+            return false;
+        }
+        segments[base] = Segment{fd, base};
+        dirChanged = true;
+        return true;
+    }
+
+    // Encodes a record at the end of the log and returns its position. The
+    // flusher writes it out. Caller holds mutex.
+    uint64_t append(const LogRecordWriter &record)
+    {
+        uint64_t active = segments.rbegin()->first;
+        if (nextPosition - active + record.size() > MLOG_SEGMENT_BYTES && nextPosition > active)
+            roll();
+        const Segment &segment = segments.rbegin()->second;
+        uint64_t position = nextPosition;
+        if (unwritten.empty() || unwritten.back().fd != segment.fd)
+            unwritten.push_back({position, segment.fd, position - segment.base, std::string()});
+        record.finish(unwritten.back().bytes);
+        nextPosition += record.size();
+        if (unwritten.size() == 1 && unwritten.back().bytes.size() == record.size())
+            wake.notify_one();
+        return position;
+    }
+
+    // Starts a new segment with the state of everyone still away.
+    void roll()
+    {
+        std::string error;
+        if (!open_segment(nextPosition, error))
+        {
+            // Keep growing the current segment rather than lose messages.
+            fprintf(stderr, "Message log: %s\n", error.c_str());
+            return;
+        }
+        for (const auto &[user, groups] : awayGroups)
+        {
+            LogRecordWriter record(LOG_AWAY);
+            record.field(user);
+            for (const std::string &group : groups)
+                record.field(group);
+            append(record);
+        }
+    }
+
+    uint64_t segment_of(uint64_t position) const { return std::prev(segments.upper_bound(position))->first; }
+
+    // Applies a record read back during recovery, as the live methods did.
+    void apply(uint64_t position, uint8_t kind, const std::vector<std::string_view> &fields)
+    {
+        if (kind == LOG_PRIVATE && fields.size() == 3)
+            add_pending(std::string(fields[1]), position);
+        else if (kind == LOG_GROUP && fields.size() == 2)
+        {
+            auto it = awayMembers.find(std::string(fields[0]));
+            if (it != awayMembers.end())
+            {
+                for (const std::string &user : it->second)
+                    add_pending(user, position);
+            }
+        }
+        else if (kind == LOG_AWAY && !fields.empty())
+            set_away(std::string(fields[0]), std::vector<std::string>(fields.begin() + 1, fields.end()));
+        else if (kind == LOG_BACK && fields.size() == 1)
+            clear_user(std::string(fields[0]));
+    }
+
+    void add_pending(const std::string &user, uint64_t position)
+    {
+        pending[user].push_back(position);
+        segments[segment_of(position)].pending++;
+    }
+
+    void set_away(const std::string &user, std::vector<std::string> groups)
+    {
+        remove_away(user);
+        for (const std::string &group : groups)
+        {
+            if (awayMembers[group].insert(user).second && awayMembers[group].size() == 1)
+                awayHint.assign(group, true);
+        }
+        awayGroups[user] = std::move(groups);
+    }
+
+    void remove_away(const std::string &user)
+    {
+        auto it = awayGroups.find(user);
+        if (it == awayGroups.end())
+            return;
+        for (const std::string &group : it->second)
+        {
+            auto members = awayMembers.find(group);
+            if (members == awayMembers.end())
+                continue;
+            members->second.erase(user);
+            if (members->second.empty())
+            {
+                awayMembers.erase(members);
+                awayHint.erase(group);
+            }
+        }
+        awayGroups.erase(it);
+    }
+
+    void clear_user(const std::string &user)
+    {
+        auto it = pending.find(user);
+        if (it != pending.end())
+        {
+            for (uint64_t position : it->second)
+                segments[segment_of(position)].pending--;
+            pending.erase(it);
+        }
+        remove_away(user);
+    }
+
+    // Reads the body of the record at position, from disk or from memory if
+    // the flusher has not written it yet. Caller holds mutex.
+    bool read_record(uint64_t position, std::string &body)
+    {
+        char header[LOG_HEADER_SIZE];
+        if (position >= writtenPosition)
+        {
+            for (const Unwritten &chunk : unwritten)
+            {
+                if (position < chunk.position || position >= chunk.position + chunk.bytes.size())
+                    continue;
+                const char *at = chunk.bytes.data() + (position - chunk.position);
+                body.assign(at + LOG_HEADER_SIZE, get_u32(at));
+                return true;
+            }
+            // Taken by the flusher and being written right now.
+            return read_flushing(position, body);
+        }
+        const Segment &segment = segments[segment_of(position)];
+        if (pread(segment.fd, header, LOG_HEADER_SIZE, position - segment.base) != LOG_HEADER_SIZE)
+            return false;
+        body.resize(get_u32(header));
+        return pread(segment.fd, body.data(), body.size(), position - segment.base + LOG_HEADER_SIZE) ==
+                   (ssize_t)body.size() &&
+               log_checksum(body) == get_u32(header + 4);
+    }
+
+    bool read_flushing(uint64_t position, std::string &body)
+    {
+        for (const Unwritten &chunk : flushing)
+        {
+            if (position < chunk.position || position >= chunk.position + chunk.bytes.size())
+                continue;
+            const char *at = chunk.bytes.data() + (position - chunk.position);
+            body.assign(at + LOG_HEADER_SIZE, get_u32(at));
+            return true;
+        }
+        return false;
+    }
+
+    // Replays every segment, oldest first, truncating a torn write at the end
+    // of the log.
+    bool recover(std::string &error)
+    {
+        std::vector<uint64_t> bases;
+        if (DIR *d = opendir(dir.c_str()))
+        {
+            while (dirent *entry = readdir(d))
+            {
+                unsigned long long base;
+                char tail[8];
+                if (sscanf(entry->d_name, "%20llu.%7s", &base, tail) == 2 && strcmp(tail, "log") == 0)
+                    bases.push_back(base);
+            }
+            closedir(d);
+        }
+        std::sort(bases.begin(), bases.end());
+        if (bases.empty())
+            bases.push_back(0);
+        for (uint64_t base : bases)
+        {
+            if (!open_segment(base, error))
+                return false;
+        }
+
+        for (auto &[base, segment] : segments)
+        {
+            uint64_t start = base;
+            auto replay = [&](uint64_t offset, uint8_t kind, const std::vector<std::string_view> &fields)
+            {
+                apply(start + offset, kind, fields);
+            };
+            long long length = replay_log_file(segment.fd, segment_path(base), replay, error);
+            if (length < 0)
+                return false;
+            nextPosition = base + length;
+        }
+        writtenPosition = nextPosition;
+        return true;
+    }
+
+    void flush_loop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            wake.wait(lock, [this] { return stopping || !unwritten.empty(); });
+            if (unwritten.empty())
+                return;
+            // Let a group of appends gather before paying for the fsync.
+            lock.unlock();
+            std::this_thread::sleep_for(std::chrono::microseconds(MLOG_COMMIT_US));
+            lock.lock();
+            flushing.swap(unwritten);
+            uint64_t durable = nextPosition;
+            std::vector<std::function<void()>> done;
+            done.swap(callbacks);
+            bool syncDir = dirChanged;
+            dirChanged = false;
+            lock.unlock();
+
+            // Segments are only closed by this thread, so the descriptors
+            // stay valid without the lock.
+            std::vector<int> fds;
+            for (const Unwritten &chunk : flushing)
+            {
+                if (!write_at(chunk.fd, chunk.bytes, chunk.offset))
+                    perror("Message log write");
+                if (fds.empty() || fds.back() != chunk.fd)
+                    fds.push_back(chunk.fd);
+            }
+            for (int fd : fds)
+            {
+                if (fdatasync(fd) < 0)
+                    perror("Message log fsync");
+            }
+            if (syncDir)
+                sync_dir(dir);
+            for (auto &callback : done)
+                callback();
+
+            lock.lock();
+            flushing.clear();
+            writtenPosition = durable;
+            collect_segments();
+        }
+    }
+
+    // Deletes the oldest segments while none of their messages is pending.
+    // The active segment always stays. Caller holds mutex.
+    void collect_segments()
+    {
+        while (segments.size() > 1)
+        {
+            auto oldest = segments.begin();
+            if (oldest->second.pending > 0 || std::next(oldest)->first > writtenPosition)
+                return;
+            close(oldest->second.fd);
+            unlink(segment_path(oldest->first).c_str());
+            segments.erase(oldest);
+        }
+    }
+
+    std::string dir;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::thread flusher;
+    bool stopping = false;
+    bool dirChanged = false;                // a segment was created since the last fsync
+    std::map<uint64_t, Segment> segments;   // by base position
+    uint64_t nextPosition = 0;              // where the next record goes
+    uint64_t writtenPosition = 0;           // everything before this is on disk
+    std::vector<Unwritten> unwritten;       // appended, waiting for the flusher
+    std::vector<Unwritten> flushing;        // being written by the flusher
+    std::vector<std::function<void()>> callbacks; // of appends not yet durable
+
+    // Cursors: for each user, the records waiting for them.
+    std::unordered_map<std::string, std::vector<uint64_t>> pending;
+    std::unordered_map<std::string, std::vector<std::string>> awayGroups;            // user -> groups
+    std::unordered_map<std::string, std::unordered_set<std::string>> awayMembers;    // group -> users
+    SnapshotMap<std::string, bool> awayHint; // groups in awayMembers, read without the mutex
+};
@@ -0,0 +1,373 @@
+// Per-thread counters and histograms for the chat server, exported in the
+// Prometheus text format.
+//
+// Every thread that records a metric gets its own block of cells, registered
+// once when the thread first records anything. Only the owning thread writes
+// its block, with plain relaxed stores, so recording never takes a lock or a
+// contended cache line. A scrape sums the blocks of all live threads plus the
+// totals of threads that have exited; it takes only the registry's own mutex,
+// never the chat server's.
+//
+// Histograms have power-of-two buckets: bucket i counts values up to
+// unit << i, and the last one catches everything larger. Durations are
+// recorded in nanoseconds with a unit of one microsecond, so the buckets run
+// from 1us to about 8s.
+
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define METRIC_BUCKETS 24 // finite histogram buckets, followed by +Inf
+
+enum MetricCounter
+{
+    CONNECTIONS_ACCEPTED,
+    CONNECTIONS_CLOSED,
+    LOGINS_OK,
+    LOGINS_FAILED,
+    LOGINS_TIMED_OUT,
+    USERS_LEFT,
+    COMMANDS_UNKNOWN,
+    // Commands refused by a rate limit, by the bucket that was empty, in the
+    // order of RateClass (rate_limit.h).
+    THROTTLED_USER,
+    THROTTLED_MSG,
+    THROTTLED_BROADCAST,
+    THROTTLED_GROUP_MSG,
+    THROTTLED_MEMBERSHIP,
+    THROTTLED_HISTORY,
+    THROTTLED_GROUP,
+    HEARTBEATS_SENT,
+    SESSIONS_IDLE,         // dropped by the idle timeout
+    SESSIONS_UNRESPONSIVE, // dropped for not answering a heartbeat
+    MESSAGES_COMPRESSED,   // once per message, however many receive it compressed
+    COMPRESSED_BYTES_IN,   // text of those messages
+    COMPRESSED_BYTES_OUT,  // their deflated payloads
+    NUM_COUNTERS
+};
+
+// Durations, in nanoseconds.
+enum MetricTiming
+{
+    CMD_MSG,
+    CMD_BROADCAST,
+    CMD_GROUP_MSG,
+    CMD_CREATE_GROUP,
+    CMD_JOIN_GROUP,
+    CMD_LEAVE_GROUP,
+    CMD_HISTORY,
+    AUTH,
+    LOCK_CLIENT, // waiting for client_mutex
+    LOCK_GROUP,  // waiting for group_mutex
+    NUM_TIMINGS
+};
+
+// Recipients of one message.
+enum MetricFanout
+{
+    FANOUT_BROADCAST,
+    FANOUT_GROUP,
+    NUM_FANOUTS
+};
+
+// Adds to a cell that only the calling thread writes.
+inline void bump(std::atomic<uint64_t> &cell, uint64_t by = 1)
+{
+    cell.store(cell.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+}
+
+struct HistogramCells
+{
+    std::atomic<uint64_t> buckets[METRIC_BUCKETS + 1] = {};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> count{0};
+
+    void observe(uint64_t value, uint64_t unit)
+    {
+        uint64_t units = (value + unit - 1) / unit;
+        size_t i = units <= 1 ? 0 : 64 - __builtin_clzll(units - 1);
+        bump(buckets[std::min<size_t>(i, METRIC_BUCKETS)]);
+        bump(sum, value);
+        bump(count);
+    }
+
+    void add(const HistogramCells &other)
+    {
+        for (size_t i = 0; i <= METRIC_BUCKETS; i++)
+            bump(buckets[i], other.buckets[i].load(std::memory_order_relaxed));
+        bump(sum, other.sum.load(std::memory_order_relaxed));
+        bump(count, other.count.load(std::memory_order_relaxed));
+    }
+};
+
+struct ThreadMetrics
+{
+    std::atomic<uint64_t> counters[NUM_COUNTERS] = {};
+    HistogramCells timings[NUM_TIMINGS];
+    HistogramCells fanouts[NUM_FANOUTS];
+
+    void add(const ThreadMetrics &other)
+    {
+        for (size_t i = 0; i < NUM_COUNTERS; i++)
+            bump(counters[i], other.counters[i].load(std::memory_order_relaxed));
+        for (size_t i = 0; i < NUM_TIMINGS; i++)
+            timings[i].add(other.timings[i]);
+        for (size_t i = 0; i < NUM_FANOUTS; i++)
+            fanouts[i].add(other.fanouts[i]);
+    }
+};
+
+// Every thread's block, plus what exited threads recorded.
+struct MetricsRegistry
+{
+    std::mutex mutex;
+    std::vector<ThreadMetrics *> live;
+    ThreadMetrics retired;
+};
+
+inline MetricsRegistry &metrics_registry()
+{
+    static MetricsRegistry registry;
+    return registry;
+}
+
+// Registers the calling thread's block on first use and folds it into the
+// retired totals when the thread exits.
+class ThreadMetricsSlot
+{
+public:
+    ThreadMetricsSlot()
+    {
+        MetricsRegistry &registry = metrics_registry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.live.push_back(&metrics);
+    }
+
+    ~ThreadMetricsSlot()
+    {
+        MetricsRegistry &registry = metrics_registry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.retired.add(metrics);
+        registry.live.erase(std::find(registry.live.begin(), registry.live.end(), &metrics));
+    }
+
+    ThreadMetrics metrics;
+};
+
+inline ThreadMetrics &thread_metrics()
+{
+    thread_local ThreadMetricsSlot slot;
+    return slot.metrics;
+}
+
+inline int64_t metrics_now_ns()
+{
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+inline void count_metric(MetricCounter counter, uint64_t by = 1)
+{
+    bump(thread_metrics().counters[counter], by);
+}
+
+inline void observe_timing(MetricTiming timing, uint64_t ns)
+{
+    thread_metrics().timings[timing].observe(ns, 1000);
+}
+
+inline void observe_fanout(MetricFanout fanout, uint64_t recipients)
+{
+    thread_metrics().fanouts[fanout].observe(recipients, 1);
+}
+
+// Records how long the enclosing scope took.
+class ScopedTiming
+{
+public:
+    explicit ScopedTiming(MetricTiming timing) : timing(timing), start(metrics_now_ns()) {}
+    ~ScopedTiming() { observe_timing(timing, metrics_now_ns() - start); }
+
+private:
+    MetricTiming timing;
+    int64_t start;
+};
+
+// Locks a mutex, recording how long the caller waited. The clock is only read
+// when the lock is actually contended.
+inline std::unique_lock<std::mutex> timed_lock(std::mutex &mutex, MetricTiming timing)
+{
+    std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+    if (lock.owns_lock())
+    {
+        observe_timing(timing, 0);
+        return lock;
+    }
+    int64_t start = metrics_now_ns();
+    lock.lock();
+    observe_timing(timing, metrics_now_ns() - start);
+    return lock;
+}
+
+// Appends one Prometheus histogram series. scale converts recorded values
+// into the exported unit.
+inline void render_histogram(std::string &out, const char *name, const std::string &labels,
+                             const HistogramCells &cells, uint64_t unit, double scale)
+{
+    char line[256];
+    const char *sep = labels.empty() ? "" : ",";
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i <= METRIC_BUCKETS; i++)
+    {
+        cumulative += cells.buckets[i].load(std::memory_order_relaxed);
+        if (i < METRIC_BUCKETS)
+            snprintf(line, sizeof(line), "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels.c_str(), sep,
+                     (double)(unit << i) * scale, (unsigned long long)cumulative);
+        else
+            snprintf(line, sizeof(line), "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels.c_str(), sep,
+                     (unsigned long long)cumulative);
+        out += line;
+    }
+    const char *open = labels.empty() ? "" : "{";
+    const char *close = labels.empty() ? "" : "}";
+    snprintf(line, sizeof(line), "%s_sum%s%s%s %g\n", name, open, labels.c_str(), close,
+             cells.sum.load(std::memory_order_relaxed) * scale);
+    out += line;
+    snprintf(line, sizeof(line), "%s_count%s%s%s %llu\n", name, open, labels.c_str(), close,
+             (unsigned long long)cells.count.load(std::memory_order_relaxed));
+    out += line;
+}
+
+// Sums the blocks of every thread, live or exited.
+inline void metrics_total(ThreadMetrics &total)
+{
+    MetricsRegistry &registry = metrics_registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    total.add(registry.retired);
+    for (ThreadMetrics *metrics : registry.live)
+        total.add(*metrics);
+}
+
+// Formats the totals of every thread. extra appends server-specific series.
+inline std::string render_metrics(const std::function<void(std::string &)> &extra)
+{
+    ThreadMetrics total;
+    metrics_total(total);
+    auto counter = [&](MetricCounter c) { return (unsigned long long)total.counters[c].load(); };
+
+    std::string out;
+    char line[256];
+    auto emit = [&](const char *format, auto... args)
+    {
+        snprintf(line, sizeof(line), format, args...);
+        out += line;
+    };
+    emit("# HELP chat_connections Open client connections.\n# TYPE chat_connections gauge\n");
+    emit("chat_connections %lld\n", (long long)(counter(CONNECTIONS_ACCEPTED) - counter(CONNECTIONS_CLOSED)));
+    emit("# HELP chat_connections_accepted_total Connections accepted.\n# TYPE chat_connections_accepted_total counter\n");
+    emit("chat_connections_accepted_total %llu\n", counter(CONNECTIONS_ACCEPTED));
+    emit("# HELP chat_logins_total Login attempts by result.\n# TYPE chat_logins_total counter\n");
+    emit("chat_logins_total{result=\"ok\"} %llu\n", counter(LOGINS_OK));
+    emit("chat_logins_total{result=\"failed\"} %llu\n", counter(LOGINS_FAILED));
+    emit("chat_logins_total{result=\"timeout\"} %llu\n", counter(LOGINS_TIMED_OUT));
+    emit("# HELP chat_commands_unknown_total Commands that were not recognised.\n# TYPE chat_commands_unknown_total counter\n");
+    emit("chat_commands_unknown_total %llu\n", counter(COMMANDS_UNKNOWN));
+    static const char *limits[] = {"user", "msg", "broadcast", "group_msg", "membership", "history", "group"};
+    emit("# HELP chat_throttled_total Commands refused by a rate limit, by the limit.\n# TYPE chat_throttled_total counter\n");
+    for (int c = THROTTLED_USER; c <= THROTTLED_GROUP; c++)
+        emit("chat_throttled_total{limit=\"%s\"} %llu\n", limits[c - THROTTLED_USER], counter((MetricCounter)c));
+    emit("# HELP chat_heartbeats_total Heartbeat pings sent to quiet clients.\n# TYPE chat_heartbeats_total counter\n");
+    emit("chat_heartbeats_total %llu\n", counter(HEARTBEATS_SENT));
+    emit("# HELP chat_sessions_expired_total Clients dropped by their session timer, by reason.\n"
+         "# TYPE chat_sessions_expired_total counter\n");
+    emit("chat_sessions_expired_total{reason=\"idle\"} %llu\n", counter(SESSIONS_IDLE));
+    emit("chat_sessions_expired_total{reason=\"heartbeat\"} %llu\n", counter(SESSIONS_UNRESPONSIVE));
+    emit("# HELP chat_compressed_messages_total Messages deflated for clients that asked.\n"
+         "# TYPE chat_compressed_messages_total counter\n");
+    emit("chat_compressed_messages_total %llu\n", counter(MESSAGES_COMPRESSED));
+    emit("# HELP chat_compression_bytes_total Size of the compressed messages before and after.\n"
+         "# TYPE chat_compression_bytes_total counter\n");
+    emit("chat_compression_bytes_total{stage=\"in\"} %llu\n", counter(COMPRESSED_BYTES_IN));
+    emit("chat_compression_bytes_total{stage=\"out\"} %llu\n", counter(COMPRESSED_BYTES_OUT));
+
+    static const char *commands[] = {"msg", "broadcast", "group_msg", "create_group", "join_group", "leave_group",
+                                     "history"};
+    out += "# HELP chat_command_duration_seconds Time to dispatch a command, including fan-out.\n"
+           "# TYPE chat_command_duration_seconds histogram\n";
+    for (int c = CMD_MSG; c <= CMD_HISTORY; c++)
+        render_histogram(out, "chat_command_duration_seconds", std::string("command=\"") + commands[c] + "\"",
+                         total.timings[c], 1000, 1e-9);
+    out += "# HELP chat_auth_duration_seconds Time to check a username and password.\n"
+           "# TYPE chat_auth_duration_seconds histogram\n";
+    render_histogram(out, "chat_auth_duration_seconds", "", total.timings[AUTH], 1000, 1e-9);
+    out += "# HELP chat_lock_wait_seconds Time spent waiting for a server mutex.\n"
+           "# TYPE chat_lock_wait_seconds histogram\n";
+    render_histogram(out, "chat_lock_wait_seconds", "lock=\"client\"", total.timings[LOCK_CLIENT], 1000, 1e-9);
+    render_histogram(out, "chat_lock_wait_seconds", "lock=\"group\"", total.timings[LOCK_GROUP], 1000, 1e-9);
+    out += "# HELP chat_fanout_recipients Recipients of each broadcast or group message.\n"
+           "# TYPE chat_fanout_recipients histogram\n";
+    render_histogram(out, "chat_fanout_recipients", "kind=\"broadcast\"", total.fanouts[FANOUT_BROADCAST], 1, 1);
+    render_histogram(out, "chat_fanout_recipients", "kind=\"group\"", total.fanouts[FANOUT_GROUP], 1, 1);
+    extra(out);
+    return out;
+}
+
+// Serves GET /metrics over HTTP on 127.0.0.1:port, one request at a time.
+// Runs on its own thread and never returns unless the port cannot be bound.
+inline void serve_metrics(int port, const std::function<std::string()> &render)
+{
+    int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int opt = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (bind(server_fd, (sockaddr *)&address, sizeof(address)) < 0 || listen(server_fd, 16) < 0)
+    {
+        perror("Metrics endpoint");
+        close(server_fd);
+        return;
+    }
+    while (true)
+    {
+        int client = accept(server_fd, nullptr, nullptr);
+        if (client < 0)
+            continue;
+        // A scraper that stalls must not hold up the next one for long.
+        struct timeval timeout = {1, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        char request[1024];
+        ssize_t n = read(client, request, sizeof(request) - 1);
+        if (n > 0)
+        {
+            request[n] = '\0';
+            std::string response;
+            if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0)
+            {
+                std::string body = render();
+                response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                           std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+            }
+            else
+                response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            send(client, response.data(), response.size(), MSG_NOSIGNAL);
+        }
+        close(client);
+    }
+}
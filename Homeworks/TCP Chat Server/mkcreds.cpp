@@ -0,0 +1,182 @@
+// Builds the credential index that server_grp --credentials memory-maps (see
+// credentials.h) from a users.txt file.
+//
+//   ./mkcreds [--iterations N] [--threads N] users.txt users.db
+//
+// The index is written next to its destination and renamed over it, so a
+// running server can be told to reload it (SIGHUP) at any time and never sees
+// a half-written file.
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <unordered_map>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <openssl/rand.h>
+#include "credentials.h"
+
+struct Entry
+{
+    std::string user;
+    std::string pass;
+};
+
+// Reads username:password lines; a repeated username keeps its last password,
+// as the server always did.
+std::vector<Entry> read_users(const std::string &path)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        std::cerr << path << " not found!" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    std::vector<Entry> entries;
+    std::unordered_map<std::string, size_t> seen;
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::string_view user, pass;
+        if (!split_credentials(line, user, pass))
+            continue;
+        auto [it, added] = seen.emplace(std::string(user), entries.size());
+        if (added)
+            entries.push_back({std::string(user), std::string(pass)});
+        else
+            entries[it->second].pass = pass;
+    }
+    return entries;
+}
+
+bool write_all(int fd, const void *data, size_t len)
+{
+    const char *bytes = (const char *)data;
+    while (len > 0)
+    {
+        ssize_t n = write(fd, bytes, len);
+        if (n < 0)
+            return false;
+        bytes += n;
+        len -= n;
+    }
+    return true;
+}
+
+void usage(const char *prog)
+{
+    std::cerr << "Usage: " << prog << " [--iterations N] [--threads N] users.txt users.db\n";
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t iterations = CRED_DEFAULT_ITERATIONS;
+    int numThreads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--iterations" && i + 1 < argc)
+            iterations = atoi(argv[++i]);
+        else if (arg == "--threads" && i + 1 < argc)
+            numThreads = atoi(argv[++i]);
+        else
+            paths.push_back(arg);
+    }
+    if (paths.size() != 2 || iterations == 0 || numThreads < 1)
+    {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<Entry> entries = read_users(paths[0]);
+
+    CredentialHeader header{};
+    memcpy(header.magic, CRED_MAGIC, 8);
+    header.version = CRED_VERSION;
+    header.iterations = iterations;
+    header.recordCount = entries.size();
+    header.slotCount = 1;
+    while (header.slotCount * CRED_MAX_LOAD < entries.size() + 1)
+        header.slotCount *= 2;
+
+    // Records, names and one random salt per user.
+    std::vector<CredentialRecord> records(entries.size());
+    std::vector<uint8_t> salts(entries.size() * CRED_SALT_SIZE);
+    if (!salts.empty() && RAND_bytes(salts.data(), salts.size()) != 1)
+    {
+        std::cerr << "Cannot generate salts" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    std::string names;
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        records[i].nameOffset = names.size();
+        records[i].nameLength = entries[i].user.size();
+        memcpy(records[i].salt, &salts[i * CRED_SALT_SIZE], CRED_SALT_SIZE);
+        names += entries[i].user;
+    }
+    header.namesSize = names.size();
+
+    // Key derivation dominates the build, so it is spread across threads.
+    std::vector<std::thread> threads;
+    std::atomic<bool> failed{false};
+    for (int t = 0; t < numThreads; t++)
+    {
+        threads.emplace_back([&, t]
+        {
+            for (size_t i = t; i < entries.size(); i += numThreads)
+            {
+                if (!derive_key(entries[i].pass, records[i].salt, iterations, records[i].key))
+                    failed = true;
+            }
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+    if (failed)
+    {
+        std::cerr << "Key derivation failed" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // Open-addressing table with linear probing.
+    std::vector<CredentialSlot> slots(header.slotCount);
+    uint64_t mask = header.slotCount - 1;
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        uint64_t hash = credential_hash(entries[i].user);
+        uint64_t s = hash & mask;
+        while (slots[s].record != 0)
+            s = (s + 1) & mask;
+        slots[s] = {(uint32_t)(hash >> 32), (uint32_t)(i + 1)};
+    }
+
+    std::string tmp = paths[1] + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    bool ok = fd >= 0 && write_all(fd, &header, sizeof(header)) &&
+              write_all(fd, slots.data(), slots.size() * sizeof(CredentialSlot)) &&
+              write_all(fd, records.data(), records.size() * sizeof(CredentialRecord)) &&
+              write_all(fd, names.data(), names.size()) && fsync(fd) == 0;
+    if (fd >= 0)
+        close(fd);
+    if (!ok || rename(tmp.c_str(), paths[1].c_str()) < 0)
+    {
+        perror(paths[1].c_str());
+        unlink(tmp.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Wrote " << entries.size() << " users to " << paths[1] << " in " << secs << " s" << std::endl;
+    return 0;
+}
@@ -0,0 +1,200 @@
+// Bounded per-connection output queues, and what to do when a client stops
+// keeping up.
+//
+// Every connection buffers the messages its socket has not taken yet. Left
+// unbounded, a client that stops reading grows its queue until the server runs
+// out of memory; with blocking sends it instead stalls every fan-out that
+// includes it. An OutboundQueue caps both the number of queued messages and
+// their bytes, and applies an OverflowPolicy once either limit is reached:
+//
+//   drop-oldest  discard the oldest queued messages to make room
+//   disconnect   close the connection
+//   coalesce     merge the queued messages into one buffer, which frees ring
+//                slots without losing anything; disconnects once the byte
+//                limit is reached too
+//
+// A message already partly written is never dropped or merged, so the byte
+// stream the client sees stays well-formed. Nor are messages pinned by an
+// asynchronous send that is still reading them.
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <sys/uio.h>
+#include "message_buffer.h"
+
+#define OUTBOUND_MAX_MESSAGES 1024    // default queue limit in messages
+#define OUTBOUND_MAX_BYTES (4 << 20)  // default queue limit in bytes
+
+enum class OverflowPolicy
+{
+    DropOldest,
+    Disconnect,
+    Coalesce
+};
+
+inline bool parse_overflow_policy(std::string_view name, OverflowPolicy &policy)
+{
+    if (name == "drop-oldest")
+        policy = OverflowPolicy::DropOldest;
+    else if (name == "disconnect")
+        policy = OverflowPolicy::Disconnect;
+    else if (name == "coalesce")
+        policy = OverflowPolicy::Coalesce;
+    else
+        return false;
+    return true;
+}
+
+struct OutboundLimits
+{
+    size_t maxMessages = OUTBOUND_MAX_MESSAGES;
+    size_t maxBytes = OUTBOUND_MAX_BYTES;
+    OverflowPolicy policy = OverflowPolicy::DropOldest;
+};
+
+// Counters shared by the queues of one writer: a reactor, or every client
+// thread in thread-per-client mode. Other threads may read them at any time.
+struct OutboundStats
+{
+    std::atomic<uint64_t> depth{0};        // messages queued right now
+    std::atomic<uint64_t> dropped{0};      // messages discarded by drop-oldest
+    std::atomic<uint64_t> coalesced{0};    // messages merged by coalesce
+    std::atomic<uint64_t> disconnected{0}; // connections closed for falling behind
+};
+
+class OutboundQueue
+{
+public:
+    bool empty() const { return q.empty(); }
+    size_t size() const { return q.size(); }
+    size_t bytes() const { return queuedBytes; }
+
+    // Queues a message for a framed or text client. Returns false if the
+    // client is too far behind and must be disconnected instead.
+    bool push(MessageRef msg, bool framed, const OutboundLimits &limits, OutboundStats &stats)
+    {
+        size_t len = msg.wire_size(framed);
+        if (full(len, limits) && !make_room(len, framed, limits, stats))
+        {
+            stats.disconnected.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        queuedBytes += len;
+        q.push(std::move(msg));
+        stats.depth.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Points iov at up to max unwritten buffers, oldest first. Returns how
+    // many were filled in.
+    size_t gather(iovec *iov, size_t max, bool framed) const
+    {
+        size_t count = std::min(q.size(), max);
+        for (size_t i = 0; i < count; i++)
+        {
+            const MessageRef &msg = q.at(i);
+            size_t skip = i == 0 ? offset : 0;
+            iov[i] = {(void *)(msg.wire(framed) + skip), msg.wire_size(framed) - skip};
+        }
+        return count;
+    }
+
+    // Keeps the oldest count messages in place until pin(0): an asynchronous
+    // send (io_uring) is reading them.
+    void pin(size_t count) { pinned = count; }
+
+    // Forgets the first n unwritten bytes, which the socket has taken.
+    void consume(size_t n, bool framed, OutboundStats &stats)
+    {
+        queuedBytes -= n;
+        while (n > 0)
+        {
+            size_t left = q.at(0).wire_size(framed) - offset;
+            if (n < left)
+            {
+                offset += n;
+                return;
+            }
+            n -= left;
+            q.pop();
+            offset = 0;
+            stats.depth.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    void clear(OutboundStats &stats)
+    {
+        stats.depth.fetch_sub(q.size(), std::memory_order_relaxed);
+        q.clear();
+        queuedBytes = 0;
+        offset = 0;
+        pinned = 0;
+    }
+
+private:
+    bool full(size_t len, const OutboundLimits &limits) const
+    {
+        return q.size() >= limits.maxMessages || queuedBytes + len > limits.maxBytes;
+    }
+
+    bool make_room(size_t len, bool framed, const OutboundLimits &limits, OutboundStats &stats)
+    {
+        // Messages on the wire stay.
+        size_t first = std::max<size_t>(offset > 0 ? 1 : 0, pinned);
+        switch (limits.policy)
+        {
+        case OverflowPolicy::DropOldest:
+            // A message larger than the byte limit still goes through once
+            // everything before it is gone.
+            while (q.size() > first && full(len, limits))
+            {
+                queuedBytes -= q.at(first).wire_size(framed);
+                if (first == 0)
+                    q.pop();
+                else
+                    q.erase(first);
+                stats.depth.fetch_sub(1, std::memory_order_relaxed);
+                stats.dropped.fetch_add(1, std::memory_order_relaxed);
+            }
+            return true;
+        case OverflowPolicy::Coalesce:
+        {
+            if (queuedBytes + len > limits.maxBytes)
+                return false;
+            // Merge what arrived since the last merge, so earlier merged
+            // buffers are not copied again; only once the queue holds little
+            // else are they folded together.
+            size_t start = q.size();
+            while (start > first && !q.at(start - 1).is_raw())
+                start--;
+            if (q.size() - start < 2)
+                start = first;
+            size_t merging = q.size() - start;
+            if (merging < 2)
+                return false;
+            std::string merged;
+            for (size_t i = start; i < q.size(); i++)
+                merged.append(q.at(i).wire(framed), q.at(i).wire_size(framed));
+            while (q.size() > start)
+                q.pop_back();
+            q.push(MessageRef::raw(merged));
+            stats.depth.fetch_sub(merging - 1, std::memory_order_relaxed);
+            stats.coalesced.fetch_add(merging, std::memory_order_relaxed);
+            return !full(len, limits);
+        }
+        case OverflowPolicy::Disconnect:
+            break;
+        }
+        return false;
+    }
+
+    MessageQueue q;
+    size_t queuedBytes = 0; // wire bytes not yet written
+    size_t offset = 0;      // bytes of the oldest message already written
+    size_t pinned = 0;      // oldest messages an asynchronous send is reading
+};
@@ -0,0 +1,141 @@
+// Token-bucket rate limits on chat commands.
+//
+// A bucket holds up to burst tokens and refills at rate tokens per second;
+// every command takes a token and one that finds its bucket empty is refused.
+// Each user has a bucket for all their commands and one per kind of command,
+// and each group has one for the messages sent to it by anyone, so neither one
+// user nor many users together can flood a group.
+//
+// A bucket is stored as one number: the time at which it will be full again,
+// which moves forward by 1/rate seconds per token taken. A bucket is empty
+// when that time is more than (burst - 1)/rate seconds away. Taking a token is
+// a compare-and-swap on that time, so buckets shared between threads, like a
+// group's, never lock. The time comes from CLOCK_MONOTONIC_COARSE, which the
+// vDSO reads without a system call; its resolution of a few milliseconds is
+// far finer than any useful limit.
+//
+// Limits are kept per class of bucket and may be replaced at any time, for
+// example from a file reloaded on SIGHUP. Buckets follow the new limits from
+// their next command on.
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdint>
+#include <ctime>
+
+enum RateClass
+{
+    RATE_USER,       // every command of one user
+    RATE_MSG,        // /msg, per user
+    RATE_BROADCAST,  // /broadcast, per user
+    RATE_GROUP_MSG,  // /group_msg, per user
+    RATE_MEMBERSHIP, // /create_group, /join_group and /leave_group, per user
+    RATE_HISTORY,    // /history, per user
+    RATE_GROUP,      // messages to one group, from all its senders together
+    NUM_RATE_CLASSES
+};
+
+// Classes whose buckets belong to a user.
+#define RATE_USER_CLASSES RATE_GROUP
+
+inline const char *rate_class_name(int cls)
+{
+    static const char *names[] = {"user", "msg", "broadcast", "group_msg", "membership", "history", "group"};
+    return names[cls];
+}
+
+inline int64_t rate_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// A bucket: the time it will be full again, in rate_now_ns() units. Starts full.
+typedef std::atomic<int64_t> RateBucket;
+
+class RateLimits
+{
+public:
+    // Limits cls to rate commands per second with bursts of up to burst.
+    // A rate of 0 lifts the limit.
+    void set(RateClass cls, double rate, double burst)
+    {
+        int64_t interval = rate > 0 ? std::max<int64_t>(1, 1e9 / rate) : 0;
+        limits[cls].slack.store((int64_t)((std::max(burst, 1.0) - 1) * interval), std::memory_order_relaxed);
+        limits[cls].interval.store(interval, std::memory_order_relaxed);
+    }
+
+    bool limited(RateClass cls) const { return limits[cls].interval.load(std::memory_order_relaxed) != 0; }
+
+    // Takes a token from bucket under cls's limit. Returns false, taking
+    // nothing, if the bucket is empty.
+    bool take(RateClass cls, RateBucket &bucket) const
+    {
+        int64_t interval = limits[cls].interval.load(std::memory_order_relaxed);
+        if (interval == 0)
+            return true;
+        int64_t slack = limits[cls].slack.load(std::memory_order_relaxed);
+        int64_t now = rate_now_ns();
+        int64_t full = bucket.load(std::memory_order_relaxed);
+        while (true)
+        {
+            int64_t from = std::max(full, now);
+            if (from - now > slack)
+                return false;
+            if (bucket.compare_exchange_weak(full, from + interval, std::memory_order_relaxed))
+                return true;
+        }
+    }
+
+    // Reads limits from a file of lines "class rate burst", where class is
+    // one of rate_class_name()'s; blank lines and lines starting with '#' are
+    // skipped. Classes the file does not mention are unlimited. Nothing
+    // changes unless the whole file is valid.
+    bool load(const std::string &path, std::string &error)
+    {
+        std::ifstream in(path);
+        if (!in)
+        {
+            error = path + ": cannot open";
+            return false;
+        }
+        double rates[NUM_RATE_CLASSES] = {}, bursts[NUM_RATE_CLASSES] = {};
+        std::string line;
+        for (int lineNo = 1; std::getline(in, line); lineNo++)
+        {
+            std::istringstream fields(line);
+            std::string name, extra;
+            double rate, burst;
+            if (!(fields >> name) || name[0] == '#')
+                continue;
+            int cls = 0;
+            while (cls < NUM_RATE_CLASSES && name != rate_class_name(cls))
+                cls++;
+            if (cls == NUM_RATE_CLASSES || !(fields >> rate >> burst) || fields >> extra || rate < 0 || burst < 1)
+            {
+                error = path + ":" + std::to_string(lineNo) + ": expected \"class rate burst\"";
+                return false;
+            }
+            rates[cls] = rate;
+            bursts[cls] = burst;
+        }
+        for (int cls = 0; cls < NUM_RATE_CLASSES; cls++)
+            set((RateClass)cls, rates[cls], bursts[cls]);
+        return true;
+    }
+
+private:
+    struct Limit
+    {
+        std::atomic<int64_t> interval{0}; // ns per token, 0 if unlimited
+        std::atomic<int64_t> slack{0};    // how far ahead of now a bucket may be full: (burst - 1) * interval
+    };
+
+    Limit limits[NUM_RATE_CLASSES];
+};
@@ -0,0 +1,802 @@
+// Edge-triggered epoll event loop used by the server's "epoll" mode.
+//
+// A Reactor owns a set of non-blocking client sockets and multiplexes them
+// from one thread. Each connection has its own receive buffer and a bounded
+// queue of shared, immutable messages waiting to be written (outbound_queue.h).
+// Queues are flushed with one gathering write per connection at the end of
+// each loop pass, and again when epoll reports a full socket writable. Other
+// threads hand work to a reactor through its lock-free mailbox.
+//
+// A reactor may also own listening sockets. New connections are accepted on
+// the reactor thread and start out unauthenticated; the login exchange is
+// driven by the same read events as chat traffic, bounded by a per-connection
+// deadline. Deadlines live in a hierarchical timing wheel (timer_wheel.h), so
+// arming, moving and cancelling one is O(1) however many connections there
+// are, and the loop sleeps exactly until the next one is due.
+//
+// With the io_uring backend (uring.h) the same loop is driven by completions
+// instead of readiness: every connection has one multishot receive that fills
+// buffers from a shared provided-buffer ring, listeners use multishot accept,
+// and each pass queues one sendmsg per connection with output, all of which
+// reach the kernel in a single io_uring_enter(). A broadcast to thousands of
+// clients thus costs a handful of system calls rather than one per client.
+// A connection keeps at most one send in flight; what is queued meanwhile
+// goes out when it completes. Closing shuts the socket down and only closes
+// the descriptor once the kernel has finished with its receive and send.
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "mailbox.h"
+#include "frame_codec.h"
+#include "message_buffer.h"
+#include "outbound_queue.h"
+#include "uring.h"
+#include "timer_wheel.h"
+
+#define REACTOR_MAX_EVENTS 256
+#define REACTOR_READ_BUDGET 16   // reads per connection before yielding to others
+#define REACTOR_ACCEPT_BUDGET 64 // accepts per listener readiness before yielding
+#define REACTOR_FLUSH_IOV 64     // queued messages gathered into one write
+#define REACTOR_URING_ENTRIES 4096 // io_uring submission slots
+#define REACTOR_URING_BUFFERS 512  // provided receive buffers per reactor (power of two)
+#define REACTOR_URING_SEND_IOV 1024 // queued messages gathered into one io_uring sendmsg
+
+enum class ReactorBackend
+{
+    Epoll,
+    Uring
+};
+
+// Where a connection is in its lifetime.
+enum class ConnState
+{
+    AwaitUser, // prompted for a username
+    AwaitPass, // prompted for a password
+    Chatting   // authenticated, commands are dispatched
+};
+
+// Per-connection state owned by a reactor.
+struct Connection
+{
+    int fd;
+    uint64_t id;  // unique for the reactor's lifetime, unlike fds which get reused
+    size_t slot;  // position in the reactor's live connection list
+    ConnState state = ConnState::AwaitUser;
+    std::string user;
+    bool framed = false;     // speaks the length-prefixed protocol (frame_codec.h)
+    bool checking = false;   // the password is being checked off the reactor thread
+    std::vector<std::string> held; // reads received meanwhile, handled once logged in
+    FrameParser frames;      // partial inbound frame of a framed connection
+    std::vector<char> inbuf; // receive buffer, one read() worth of data
+    OutboundQueue outq;      // messages not yet fully written
+    bool flush_pending = false; // listed for the end-of-pass flush
+    bool blocked = false;       // socket buffer full, waiting for EPOLLOUT
+    TimerNode<Connection> timer; // fires on_timeout, scheduled while a deadline is set
+    int64_t last_input = 0;  // monotonic ms of the last data received
+    int64_t ping_sent = 0;   // when the server last sent a heartbeat, 0 if never
+    bool draining = false;   // close once outq has been flushed
+    bool closing = false;
+
+    // io_uring backend only.
+    struct PendingSend
+    {
+        msghdr hdr;
+        std::vector<iovec> iov; // grown to the largest batch sent so far
+    };
+    std::unique_ptr<PendingSend> outgoing; // the sendmsg in flight, if send_inflight
+    bool send_inflight = false;
+    bool recv_armed = false; // a multishot receive is outstanding
+    bool closed = false;     // on_close ran; waiting for the kernel to let go
+};
+
+// Puts a socket into non-blocking mode.
+inline bool set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+// Milliseconds on the monotonic clock.
+inline int64_t monotonic_ms()
+{
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// Callbacks through which a reactor reports connection events. All of them run
+// on the reactor thread.
+struct ReactorHandlers
+{
+    // A connection was accepted on one of the reactor's listeners.
+    std::function<void(Connection &)> on_accept;
+    // Called once per read() with the bytes received, like the thread-per-client loop.
+    std::function<void(Connection &, const char *, size_t)> on_message;
+    // The connection's deadline passed.
+    std::function<void(Connection &)> on_timeout;
+    // Called before a connection is closed and forgotten.
+    std::function<void(Connection &)> on_close;
+};
+
+class Reactor
+{
+public:
+    Reactor(size_t buffer_size, OutboundLimits limits, ReactorHandlers handlers,
+            ReactorBackend backend = ReactorBackend::Epoll)
+        : buffer_size(buffer_size), limits(limits), handlers(std::move(handlers)), timers(1, monotonic_ms())
+    {
+        wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        sparefd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (backend == ReactorBackend::Uring)
+        {
+            std::string error;
+            uring = std::make_unique<Uring>();
+            if (wakefd < 0 || !uring->init(REACTOR_URING_ENTRIES, error) ||
+                !uring->setup_buffers(0, REACTOR_URING_BUFFERS, buffer_size, error))
+            {
+                fprintf(stderr, "io_uring: %s\n", error.c_str());
+                exit(EXIT_FAILURE);
+            }
+            epfd = -1;
+            return;
+        }
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd < 0 || wakefd < 0)
+        {
+            perror("epoll");
+            exit(EXIT_FAILURE);
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = wakefd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+    }
+
+    ~Reactor()
+    {
+        close(sparefd);
+        close(wakefd);
+        if (epfd >= 0)
+            close(epfd);
+    }
+
+    // Queues a task to run on the reactor thread. Safe to call from any thread.
+    void post(std::function<void()> task)
+    {
+        tasks.push(std::move(task));
+        // Only the first producer after the reactor drained its mailbox pays for
+        // the eventfd write; the rest piggyback on the pending wakeup.
+        if (!wake_pending.exchange(true))
+        {
+            uint64_t one = 1;
+            if (write(wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+                perror("eventfd write");
+        }
+    }
+
+    // Accepts connections from a listening socket on the reactor thread. Call
+    // before run().
+    void add_listener(int fd)
+    {
+        set_nonblocking(fd);
+        listeners.push_back(fd);
+        if (uring)
+            return; // armed when run() starts
+        // Level-triggered, so a listener that hit its accept budget is reported again.
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    // Takes ownership of a connected socket. Reactor thread only.
+    Connection &adopt(int fd)
+    {
+        set_nonblocking(fd);
+        if ((size_t)fd >= conns.size())
+            conns.resize(fd + 1);
+        conns[fd] = std::make_unique<Connection>();
+        Connection &conn = *conns[fd];
+        conn.fd = fd;
+        conn.id = next_id++;
+        conn.slot = live.size();
+        conn.timer.owner = &conn;
+        conn.last_input = monotonic_ms();
+        live.push_back(fd);
+        if (uring)
+        {
+            arm_recv(conn);
+            return conn;
+        }
+        conn.inbuf.resize(buffer_size);
+
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        {
+            perror("epoll_ctl");
+            schedule_close(conn);
+        }
+        return conn;
+    }
+
+    Connection *find(int fd)
+    {
+        if (fd < 0 || (size_t)fd >= conns.size())
+            return nullptr;
+        return conns[fd].get();
+    }
+
+    // Queues a message for a connection; it is written at the end of the
+    // current loop pass, batched with anything else queued for the same
+    // client. Framed connections get the message's frame encoding. A client
+    // whose queue overflows is dealt with by the overflow policy. Reactor
+    // thread only.
+    void send_to(int fd, MessageRef msg)
+    {
+        Connection *conn = find(fd);
+        if (!conn || conn->closing)
+            return;
+        // A long burst, such as a mailbox full of fan-out, writes whole
+        // batches as it goes so the queue limit only bites on clients whose
+        // socket is actually full.
+        if (!conn->blocked && conn->outq.size() >= std::min(limits.maxMessages, (size_t)REACTOR_FLUSH_IOV))
+        {
+            flush(*conn);
+            if (conn->closing)
+                return;
+        }
+        if (!conn->outq.push(std::move(msg), conn->framed, limits, stats))
+        {
+            schedule_close(*conn);
+            return;
+        }
+        if (!conn->flush_pending && !conn->blocked)
+        {
+            conn->flush_pending = true;
+            dirty.push_back(fd);
+        }
+    }
+
+    void send_to(int fd, const char *data, size_t len)
+    {
+        send_to(fd, MessageRef::make(std::string_view(data, len)));
+    }
+
+    // Queues a message for the logged-in connection with this id, dropping it
+    // if that connection has gone: a message posted from another thread may
+    // run after the fd was closed and accepted again for someone else.
+    void send_to(int fd, uint64_t id, MessageRef msg)
+    {
+        Connection *conn = find(fd);
+        if (!conn || conn->id != id || conn->state != ConnState::Chatting)
+            return;
+        send_to(fd, std::move(msg));
+    }
+
+    // Arms (or re-arms) the connection's deadline, replacing any earlier one.
+    void set_timeout(Connection &conn, int64_t ms)
+    {
+        timers.schedule(conn.timer, monotonic_ms() + ms);
+    }
+
+    void clear_timeout(Connection &conn)
+    {
+        timers.cancel(conn.timer);
+    }
+
+    // Event loop; never returns.
+    void run()
+    {
+        if (uring)
+            run_uring();
+        epoll_event events[REACTOR_MAX_EVENTS];
+        while (true)
+        {
+            int n = epoll_wait(epfd, events, REACTOR_MAX_EVENTS, wait_timeout());
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                perror("epoll_wait");
+                exit(EXIT_FAILURE);
+            }
+            pass_time = monotonic_ms();
+            for (int i = 0; i < n; i++)
+            {
+                int fd = events[i].data.fd;
+                if (fd == wakefd)
+                {
+                    run_tasks();
+                    continue;
+                }
+                if (is_listener(fd))
+                {
+                    accept_ready(fd);
+                    continue;
+                }
+                Connection *conn = find(fd);
+                if (!conn)
+                    continue;
+                if (events[i].events & EPOLLOUT)
+                {
+                    conn->blocked = false;
+                    flush(*conn);
+                }
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    read_ready(*conn);
+            }
+
+            // Connections that exhausted their read budget get another turn.
+            std::vector<int> pending;
+            pending.swap(backlog);
+            for (int fd : pending)
+            {
+                if (Connection *conn = find(fd))
+                    read_ready(*conn);
+            }
+            expire_timers();
+            // Closing announces departures, which queues more output.
+            do
+            {
+                flush_dirty();
+                close_pending();
+            } while (!dirty.empty());
+        }
+    }
+
+    // Calls fn on every open connection owned by this reactor.
+    template <typename Fn>
+    void for_each_connection(Fn &&fn)
+    {
+        for (size_t i = 0; i < live.size(); i++)
+            fn(*conns[live[i]]);
+    }
+
+    // Marks a connection for closing at the end of the current loop pass.
+    void schedule_close(Connection &conn)
+    {
+        if (!conn.closing)
+        {
+            conn.closing = true;
+            closing.push_back(conn.fd);
+        }
+    }
+
+    // Counters for this reactor's outbound queues; readable from any thread.
+    const OutboundStats &outbound_stats() const { return stats; }
+
+    // Stops reading from a connection and closes it once its output is written.
+    void close_after_flush(Connection &conn)
+    {
+        conn.draining = true;
+        if (conn.outq.empty())
+            schedule_close(conn);
+    }
+
+private:
+    // Tags in the upper half of an io_uring user_data; the lower half is the fd.
+    enum UringOp : uint64_t
+    {
+        URING_WAKE = 1,
+        URING_ACCEPT,
+        URING_RECV,
+        URING_SEND
+    };
+
+    static uint64_t uring_tag(UringOp op, int fd) { return (uint64_t)op << 32 | (uint32_t)fd; }
+
+    // The io_uring counterpart of run()'s epoll loop.
+    [[noreturn]] void run_uring()
+    {
+        arm_wake();
+        for (int fd : listeners)
+            arm_accept(fd);
+        while (true)
+        {
+            // Submits everything the previous pass queued, then sleeps.
+            if (!uring->submit(wait_timeout(), true))
+            {
+                perror("io_uring_enter");
+                exit(EXIT_FAILURE);
+            }
+            pass_time = monotonic_ms();
+            // Sends, accepts and wakeups are handled at once. Received data
+            // is handled a budget at a time, after the sends that completed
+            // meanwhile, so a flood of input cannot outrun a reader's output;
+            // the buffers it holds throttle the senders through TCP.
+            uring->for_each_completion([this](const io_uring_cqe &cqe)
+            {
+                if (cqe.user_data >> 32 == URING_RECV)
+                    received.push_back(cqe);
+                else
+                    complete(cqe);
+            });
+            for (int budget = REACTOR_MAX_EVENTS; budget > 0 && !received.empty(); budget--)
+            {
+                io_uring_cqe cqe = received.front();
+                received.pop_front();
+                complete(cqe);
+            }
+            expire_timers();
+            do
+            {
+                flush_dirty();
+                close_pending();
+            } while (!dirty.empty());
+        }
+    }
+
+    void arm_wake()
+    {
+        io_uring_sqe *sqe = uring->get_sqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = wakefd;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->user_data = uring_tag(URING_WAKE, wakefd);
+    }
+
+    void arm_accept(int listener)
+    {
+        io_uring_sqe *sqe = uring->get_sqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listener;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->user_data = uring_tag(URING_ACCEPT, listener);
+    }
+
+    void arm_recv(Connection &conn)
+    {
+        io_uring_sqe *sqe = uring->get_sqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = conn.fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        sqe->user_data = uring_tag(URING_RECV, conn.fd);
+        conn.recv_armed = true;
+    }
+
+    // Queues one sendmsg for the oldest queued messages, unless one is
+    // already in flight. It is submitted with everything else at the start
+    // of the next pass.
+    void submit_send(Connection &conn)
+    {
+        if (conn.send_inflight || conn.outq.empty() || conn.closing)
+            return;
+        if (!conn.outgoing)
+            conn.outgoing = std::make_unique<Connection::PendingSend>();
+        std::vector<iovec> &iov = conn.outgoing->iov;
+        iov.resize(std::max(iov.size(), std::min(conn.outq.size(), (size_t)REACTOR_URING_SEND_IOV)));
+        size_t count = conn.outq.gather(iov.data(), iov.size(), conn.framed);
+        conn.outq.pin(count);
+        conn.outgoing->hdr = msghdr{};
+        conn.outgoing->hdr.msg_iov = iov.data();
+        conn.outgoing->hdr.msg_iovlen = count;
+        io_uring_sqe *sqe = uring->get_sqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = conn.fd;
+        sqe->addr = (uint64_t)&conn.outgoing->hdr;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = uring_tag(URING_SEND, conn.fd);
+        conn.send_inflight = true;
+    }
+
+    void complete(const io_uring_cqe &cqe)
+    {
+        int fd = (int)(uint32_t)cqe.user_data;
+        bool more = cqe.flags & IORING_CQE_F_MORE;
+        switch (cqe.user_data >> 32)
+        {
+        case URING_WAKE:
+            run_tasks();
+            if (!more)
+                arm_wake();
+            break;
+        case URING_ACCEPT:
+            if (cqe.res >= 0)
+                handlers.on_accept(adopt(cqe.res));
+            else if (cqe.res == -EMFILE || cqe.res == -ENFILE)
+                shed_connection(fd);
+            else if (cqe.res != -EAGAIN && cqe.res != -EINTR && cqe.res != -ECONNABORTED)
+                fprintf(stderr, "Accept: %s\n", strerror(-cqe.res));
+            if (!more)
+                arm_accept(fd);
+            break;
+        case URING_RECV:
+            if (Connection *conn = find(fd))
+                recv_done(*conn, cqe);
+            break;
+        case URING_SEND:
+            if (Connection *conn = find(fd))
+                send_done(*conn, cqe.res);
+            break;
+        }
+    }
+
+    void recv_done(Connection &conn, const io_uring_cqe &cqe)
+    {
+        if (cqe.flags & IORING_CQE_F_BUFFER)
+        {
+            uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            if (cqe.res > 0 && !conn.closing && !conn.draining)
+            {
+                conn.last_input = pass_time;
+                handlers.on_message(conn, uring->buffer(bid), cqe.res);
+            }
+            uring->recycle(bid);
+        }
+        if (cqe.flags & IORING_CQE_F_MORE)
+            return;
+        conn.recv_armed = false;
+        if (conn.closing)
+            release_if_idle(conn);
+        // The receive also ends when the buffer ring runs dry; start another.
+        else if (cqe.res > 0 || cqe.res == -ENOBUFS)
+            arm_recv(conn);
+        else
+            schedule_close(conn);
+    }
+
+    void send_done(Connection &conn, int res)
+    {
+        conn.send_inflight = false;
+        conn.outq.pin(0);
+        if (res >= 0)
+            conn.outq.consume(res, conn.framed, stats);
+        else if (res != -EINTR && res != -EAGAIN)
+            schedule_close(conn);
+        if (conn.closing)
+        {
+            release_if_idle(conn);
+            return;
+        }
+        if (!conn.outq.empty())
+            submit_send(conn); // what was queued meanwhile, or the unsent rest
+        else if (conn.draining)
+            schedule_close(conn);
+    }
+
+    // Closes and forgets a connection once on_close has run and the kernel
+    // holds no more operations on it, so its fd cannot be reused too early.
+    void release_if_idle(Connection &conn)
+    {
+        if (!conn.closed || conn.recv_armed || conn.send_inflight)
+            return;
+        int fd = conn.fd;
+        conn.outq.clear(stats);
+        close(fd);
+        conns[fd].reset();
+    }
+
+    bool is_listener(int fd) const
+    {
+        for (int listener : listeners)
+        {
+            if (listener == fd)
+                return true;
+        }
+        return false;
+    }
+
+    // How long epoll_wait may block: not at all with a read backlog, otherwise
+    // until the nearest deadline.
+    int wait_timeout()
+    {
+        if (!backlog.empty() || !received.empty())
+            return 0;
+        return (int)std::min<int64_t>(timers.next_due(monotonic_ms()), INT32_MAX);
+    }
+
+    void run_tasks()
+    {
+        uint64_t count;
+        while (read(wakefd, &count, sizeof(count)) > 0)
+            ;
+        // Clear the flag before draining so a push racing with the drain
+        // either gets picked up below or triggers a fresh wakeup.
+        wake_pending.store(false);
+        std::function<void()> task;
+        while (tasks.pop(task))
+            task();
+    }
+
+    void accept_ready(int listener)
+    {
+        for (int budget = REACTOR_ACCEPT_BUDGET; budget > 0; budget--)
+        {
+            int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+            {
+                if (errno == EMFILE || errno == ENFILE)
+                {
+                    shed_connection(listener);
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    perror("Accept");
+                return;
+            }
+            handlers.on_accept(adopt(fd));
+        }
+    }
+
+    // Out of descriptors: accept with the spare one and drop the connection,
+    // otherwise the listener keeps reporting it.
+    void shed_connection(int listener)
+    {
+        close(sparefd);
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd >= 0)
+            close(fd);
+        sparefd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+
+    // Edge-triggered: drain the socket until EAGAIN or the budget runs out.
+    void read_ready(Connection &conn)
+    {
+        for (int budget = REACTOR_READ_BUDGET; budget > 0; budget--)
+        {
+            if (conn.closing || conn.draining)
+                return;
+            ssize_t n = read(conn.fd, conn.inbuf.data(), conn.inbuf.size());
+            if (n > 0)
+            {
+                conn.last_input = pass_time;
+                handlers.on_message(conn, conn.inbuf.data(), n);
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;
+            if (n < 0 && errno == EINTR)
+                continue;
+            schedule_close(conn);
+            return;
+        }
+        backlog.push_back(conn.fd);
+    }
+
+    void flush_dirty()
+    {
+        std::vector<int> batch;
+        batch.swap(dirty);
+        for (int fd : batch)
+        {
+            Connection *conn = find(fd);
+            if (!conn || !conn->flush_pending)
+                continue;
+            conn->flush_pending = false;
+            flush(*conn);
+        }
+    }
+
+    // Writes as much of the queue as the socket takes, up to REACTOR_FLUSH_IOV
+    // messages per sendmsg().
+    void flush(Connection &conn)
+    {
+        if (uring)
+        {
+            submit_send(conn);
+            return;
+        }
+        while (!conn.outq.empty() && !conn.closing)
+        {
+            iovec iov[REACTOR_FLUSH_IOV];
+            size_t count = conn.outq.gather(iov, REACTOR_FLUSH_IOV, conn.framed);
+            size_t total = 0;
+            for (size_t i = 0; i < count; i++)
+                total += iov[i].iov_len;
+            msghdr hdr{};
+            hdr.msg_iov = iov;
+            hdr.msg_iovlen = count;
+            ssize_t n = sendmsg(conn.fd, &hdr, MSG_NOSIGNAL);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    conn.blocked = true;
+                else
+                    schedule_close(conn);
+                return;
+            }
+
+            conn.outq.consume(n, conn.framed, stats);
+            if ((size_t)n < total)
+            {
+                conn.blocked = true; // the kernel buffer is full; EPOLLOUT resumes us
+                return;
+            }
+        }
+        if (conn.draining && conn.outq.empty())
+            schedule_close(conn);
+    }
+
+    // Fires on_timeout for every connection whose deadline has passed.
+    void expire_timers()
+    {
+        timers.advance(monotonic_ms(), [this](Connection &conn)
+        {
+            if (!conn.closing)
+                handlers.on_timeout(conn);
+        });
+    }
+
+    void close_pending()
+    {
+        // on_close may broadcast and schedule further closes, so loop until stable.
+        while (!closing.empty())
+        {
+            std::vector<int> batch;
+            batch.swap(closing);
+            for (int fd : batch)
+            {
+                Connection *conn = find(fd);
+                if (!conn)
+                    continue;
+                handlers.on_close(*conn);
+                timers.cancel(conn->timer);
+                // Swap-remove from the live list.
+                int moved = live.back();
+                live[conn->slot] = moved;
+                conns[moved]->slot = conn->slot;
+                live.pop_back();
+                if (uring)
+                {
+                    // Ends the receive and any blocked send; the descriptor
+                    // is closed when both have completed.
+                    conn->closed = true;
+                    shutdown(fd, SHUT_RDWR);
+                    release_if_idle(*conn);
+                    continue;
+                }
+                conn->outq.clear(stats);
+                epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+                close(fd);
+                conns[fd].reset();
+            }
+        }
+    }
+
+    size_t buffer_size;
+    OutboundLimits limits;
+    OutboundStats stats;
+    ReactorHandlers handlers;
+    int epfd;
+    std::unique_ptr<Uring> uring; // set when using the io_uring backend
+    int wakefd;
+    int sparefd; // reserve descriptor for shedding connections at EMFILE
+    uint64_t next_id = 1;
+    Mailbox<std::function<void()>> tasks;
+    std::atomic<bool> wake_pending{false};
+    std::vector<int> listeners;
+    std::vector<std::unique_ptr<Connection>> conns; // indexed by fd
+    std::vector<int> live;                          // fds of open connections
+    std::vector<int> backlog;                       // fds with unread data left
+    std::deque<io_uring_cqe> received;              // io_uring receives not handled yet
+    std::vector<int> closing;                       // fds to close after this pass
+    std::vector<int> dirty;                         // fds with output to flush this pass
+    TimerWheel<Connection> timers;                  // connection deadlines
+    int64_t pass_time = 0;                          // monotonic ms when the current loop pass woke up
+};
@@ -1,362 +1,2222 @@
 #include <iostream>
 #include <string>
 #include <thread>
+#include <chrono>
 #include <mutex>
+#include <atomic>
+#include <memory>
+#include <functional>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
+#include <algorithm>
 #include <sstream>
 #include <cstring>
 #include <cstdlib>
+#include <cerrno>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
-#include <fstream>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/epoll.h>
+#include <csignal>
+#include <condition_variable>
+#include <netinet/tcp.h>
+#include "frame_codec.h"
+#include "message_buffer.h"
+#include "outbound_queue.h"
+#include "reactor.h"
+#include "snapshot.h"
+#include "credentials.h"
+#include "metrics.h"
+#include "message_log.h"
+#include "group_registry.h"
+#include "history.h"
+#include "symbols.h"
+#include "cluster.h"
+#include "rate_limit.h"
+#include "tls.h"
+#include "timer_wheel.h"
+#include "compress.h"
 
 // Port and buffer constants
 #define PORT 12345
 #define BUFFER_SIZE 1024
+#define LOGIN_TIMEOUT_MS 10000 // default time allowed to finish logging in
+#define HEARTBEAT_MS 30000     // default silence after which a framed client is pinged
+#define DRAIN_TIMEOUT_MS 5000  // time a client dropped for idling has to take the notice
+#define MAX_SOCKETS (1 << 20)  // cap on descriptors, sizes the per-socket tables
 
-// Global containers
-std::unordered_map<int, std::string> socketsUser; // maps socket to username
-std::unordered_map<std::string, int> userSockets;   // maps username to socket
-std::unordered_map<std::string, std::string> validUsers; // valid username:password pairs
-std::unordered_map<std::string, std::unordered_set<int>> groups; // group name -> set of sockets
+// A name read in one buffer, with the text around it, must fit the room kept
+// for prefixes, or a body of FRAME_MAX_BODY would make too large a frame.
+static_assert(BUFFER_SIZE + sizeof("[Group ]: ") <= FRAME_MAX_PREFIX, "prefix room too small for a name");
 
-// Global mutexes
-std::mutex client_mutex;  // protects socketsUser and userSockets
-std::mutex group_mutex;   // protects groups
+// Login prompts and replies
+const char *userStr = "Enter username: ";
+const char *passStr = "Enter password: ";
+const char *welcomeStr = "Welcome to the server";
+const char *authFailedStr = "Authentication Failed";
+const char *loginTimeoutStr = "Login timed out";
+const char *noGroupStr = "No such group exists.";
+const char *noUserStr  = "No such user exists.";
+const char *offlineStr = " is offline; the message will be delivered when they log in.";
+const char *historyUsageStr = "Usage: /history <group> <n>";
+const char *throttledStr = "Rate limit exceeded; the command was dropped.";
+const char *tooLongStr = "Message too long; it was not sent.";
+const char *idleTimeoutStr = "Disconnected: idle for too long.";
 
-// Helper function to add a prefix to a message.
-std::string add_prefix(std::string sender, std::string message)
+// The online members of a group, published as a snapshot of their own so a
+// membership change copies one group. Created when a member first comes
+// online and never deleted. Who belongs to which group, online or not, is
+// kept by the registry.
+struct Group
 {
-    return '[' + sender + "]: " + message;
+    Snapshot<std::vector<int>> members; // sockets, sorted
+    HistoryRing history;                // recent messages, if historyStore is set
+    std::atomic<uint64_t> remoteNodes{0}; // cluster peers with members online, one bit each
+    RateBucket bucket{0};                 // messages to the group, under the RATE_GROUP limit
+};
+
+// A user's state while the server runs, created when they first log in.
+struct UserState
+{
+    std::atomic<int> socket{-1}; // where they are logged in, -1 if offline
+    std::atomic<int> node{-1};   // cluster peer they are logged in on, -1 if none
+    RateBucket buckets[RATE_USER_CLASSES] = {}; // by RateClass, kept across logins
+};
+
+// Global containers. Users and groups are known by dense IDs (symbols.h): a
+// command looks a name up once and from then on only indexes flat tables,
+// which readers use without locking, like the membership snapshots
+// (snapshot.h) read by every group message.
+SymbolTable userNames;                   // username <-> user ID
+SymbolTable groupNames;                  // group name <-> group ID
+DenseTable<UserState> users;             // user ID -> online state
+DenseTable<std::atomic<Group *>> groups; // group ID -> online members, null until first needed
+std::vector<std::atomic<uint32_t>> socketUser; // socket -> ID of its logged-in user, NO_SYMBOL if none
+std::atomic<int> socketHighWater{-1};    // largest socket ever logged in, bounds scans of socketUser
+std::atomic<std::shared_ptr<const CredentialStore>> credentials; // replaced whole on reload
+std::unique_ptr<GroupRegistry> registry = std::make_unique<GroupRegistry>(); // every group and member, by username
+std::unordered_map<int, std::vector<uint32_t>> socketGroups; // socket -> IDs of its groups
+std::atomic<int> onlineUsers{0}; // logged-in clients, for fan-out metrics
+
+// Global mutexes, taken only to change the containers above
+std::mutex client_mutex;  // serializes updates to users and socketUser
+std::mutex group_mutex;   // serializes updates to groups, socketGroups and the registry
+
+// In epoll mode every connection is owned by exactly one shard: an event loop
+// thread plus the per-connection state only that thread touches. Other threads
+// reach a connection by posting to its shard's lock-free mailbox.
+struct Shard
+{
+    int index;
+    Reactor reactor;
+    // group ID -> members owned by this shard, so fan-out needs no global lock
+    std::vector<std::vector<int>> localGroups;
+};
+
+std::vector<Shard *> shards;                // empty in thread-per-client mode
+thread_local Shard *currentShard = nullptr; // shard owning the calling thread
+std::vector<std::atomic<int>> socketShard;  // socket -> owning shard index, -1 if none
+std::vector<std::atomic<uint64_t>> socketConn; // socket -> id of its Connection on that shard
+std::vector<std::atomic<bool>> socketFramed; // socket -> uses framing, thread mode only
+int loginTimeoutMs = LOGIN_TIMEOUT_MS;
+int heartbeatMs = HEARTBEAT_MS; // 0 disables heartbeats and TCP keepalive
+int idleTimeoutMs = 0;          // silence after which a client is dropped, 0 for never
+std::string credentialsPath; // credential index built by mkcreds, empty to read users.txt
+OutboundLimits outboundLimits; // bound and overflow policy of every client's output queue
+std::unique_ptr<MessageLog> messageLog; // offline delivery, null unless --message-log is given
+std::unique_ptr<HistoryStore> historyStore; // arenas for group history, null if disabled
+std::unique_ptr<Cluster> cluster; // links to the other nodes, null unless --cluster is given
+int clientPort = PORT; // where clients connect, set by --port
+RateLimits rateLimits;       // all unlimited unless --rate-limits is given
+std::unique_ptr<TlsTerminator> tls; // handshakes and relays, null unless --tls-cert is given
+std::unique_ptr<CredentialCheckers> credentialCheckers; // password checks, epoll mode only
+std::string rateLimitsPath;  // reloaded on SIGHUP, empty if none
+thread_local MessageArena messageArena; // messages built by commands run on this thread
+bool compressEnabled = false;  // framed clients may ask for OP_ZTEXT, set by --compress
+std::string compressDict;      // preset dictionary, empty for none
+uint32_t compressDictId = 0;   // its dictionary_id(), which clients must name
+size_t compressMinBytes = COMPRESS_MIN_BYTES;
+std::vector<std::atomic<bool>> socketCompressed; // socket -> negotiated OP_ZTEXT
+std::atomic<int> compressingClients{0}; // sockets set in socketCompressed
+thread_local std::unique_ptr<Deflater> deflater; // primed with compressDict, made on first use
+
+// Thread mode: output a client's socket has not taken yet. Senders queue under
+// the mutex and write what the socket accepts without blocking; the rest is
+// flushed by output_loop once the socket becomes writable, so a slow client
+// never stalls the thread fanning a message out to it.
+struct SocketOutput
+{
+    std::mutex mutex;
+    OutboundQueue queue;
+    bool watched = false; // registered with outputEpoll
+    bool dropped = false; // disconnected for falling behind
+};
+
+std::vector<std::unique_ptr<SocketOutput>> socketOutput; // socket -> its output, thread mode only
+int outputEpoll = -1;       // writability of sockets with queued output, thread mode only
+OutboundStats threadOutbound; // counters of all thread-mode queues
+
+// Thread mode: writes queued output until the socket is full, then asks
+// output_loop to resume once it drains. Called with out.mutex held.
+void write_output(int socket, SocketOutput &out)
+{
+    bool framed = socketFramed[socket];
+    while (!out.queue.empty())
+    {
+        iovec iov[REACTOR_FLUSH_IOV];
+        msghdr hdr{};
+        hdr.msg_iov = iov;
+        hdr.msg_iovlen = out.queue.gather(iov, REACTOR_FLUSH_IOV, framed);
+        ssize_t n = sendmsg(socket, &hdr, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                // The client's reader thread sees the same error and disconnects it.
+                out.queue.clear(threadOutbound);
+                return;
+            }
+            break;
+        }
+        out.queue.consume(n, framed, threadOutbound);
+    }
+    if (out.queue.empty())
+        return;
+    epoll_event ev{};
+    ev.events = EPOLLOUT | EPOLLONESHOT;
+    ev.data.fd = socket;
+    epoll_ctl(outputEpoll, out.watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, socket, &ev);
+    out.watched = true;
+}
+
+// Thread mode: queues a message for a client and writes it right away unless
+// earlier output is still waiting for the socket.
+void queue_output(int socket, const MessageRef &msg)
+{
+    if (socket < 0 || (size_t)socket >= socketOutput.size() || !socketOutput[socket])
+        return;
+    SocketOutput &out = *socketOutput[socket];
+    std::lock_guard<std::mutex> lock(out.mutex);
+    if (out.dropped)
+        return;
+    if (!out.queue.push(msg, socketFramed[socket], outboundLimits, threadOutbound))
+    {
+        // Shutting the socket down wakes the client's reader thread, which
+        // then disconnects it the usual way.
+        out.dropped = true;
+        out.queue.clear(threadOutbound);
+        shutdown(socket, SHUT_RDWR);
+        return;
+    }
+    if (out.queue.size() == 1)
+        write_output(socket, out);
+}
+
+// Thread mode: flushes queued output as sockets become writable.
+void output_loop()
+{
+    epoll_event events[REACTOR_MAX_EVENTS];
+    while (true)
+    {
+        int n = epoll_wait(outputEpoll, events, REACTOR_MAX_EVENTS, -1);
+        for (int i = 0; i < n; i++)
+        {
+            int socket = events[i].data.fd;
+            SocketOutput &out = *socketOutput[socket];
+            std::lock_guard<std::mutex> lock(out.mutex);
+            write_output(socket, out);
+        }
+    }
+}
+
+// Thread mode: gives a newly accepted socket an empty output queue. A reused
+// descriptor keeps its SocketOutput; closing the old socket already removed it
+// from outputEpoll.
+void output_opened(int socket)
+{
+    if (!socketOutput[socket])
+        socketOutput[socket] = std::make_unique<SocketOutput>();
+    SocketOutput &out = *socketOutput[socket];
+    std::lock_guard<std::mutex> lock(out.mutex);
+    out.queue.clear(threadOutbound);
+    out.watched = false;
+    out.dropped = false;
+}
+
+// Runs a task on a shard's thread, inline if the caller is already on it.
+void run_on(Shard *shard, std::function<void()> task)
+{
+    if (shard == currentShard)
+        task();
+    else
+        shard->reactor.post(std::move(task));
+}
+
+// Sends a message to a client through whichever I/O model is active. The
+// message is shared, not copied, when it crosses shards.
+void send_message(int socket, const MessageRef &msg)
+{
+    if (shards.empty())
+    {
+        queue_output(socket, msg);
+        return;
+    }
+    if (socket < 0 || (size_t)socket >= socketShard.size())
+        return;
+    int owner = socketShard[socket].load(std::memory_order_acquire);
+    if (owner < 0)
+        return;
+    // Addressed to this connection, not to whichever one has the fd by the
+    // time the owning shard gets to it.
+    uint64_t conn = socketConn[socket].load(std::memory_order_relaxed);
+    Shard *shard = shards[owner];
+    if (shard == currentShard)
+        shard->reactor.send_to(socket, conn, msg);
+    else
+        shard->reactor.post([shard, socket, conn, msg] { shard->reactor.send_to(socket, conn, msg); });
+}
+
+void send_message(int socket, const char *data, size_t len)
+{
+    send_message(socket, MessageRef::make(std::string_view(data, len)));
+}
+
+void send_message(int socket, const std::string &message)
+{
+    send_message(socket, MessageRef::make(message));
+}
+
+// Builds "[sender]: message", the form in which chat messages are delivered.
+MessageRef add_prefix(std::string_view sender, std::string_view message)
+{
+    return messageArena.make({"[", sender, "]: ", message});
+}
+
+// The OP_ZTEXT form of a message, made once for every recipient of a fan-out
+// that asked for compression. Empty, so the message goes out as it is, if no
+// such client is online or the message is too short or does not shrink.
+MessageRef compressed_form(const MessageRef &msg)
+{
+    static thread_local std::string frame;
+    if (compressingClients.load(std::memory_order_relaxed) == 0 || msg.is_raw() || msg.text_size() < compressMinBytes)
+        return MessageRef();
+    if (!deflater)
+        deflater = std::make_unique<Deflater>(compressDict);
+    frame.clear();
+    if (!deflater->compress(std::string_view(msg.text(), msg.text_size()), frame))
+        return MessageRef();
+    count_metric(MESSAGES_COMPRESSED);
+    count_metric(COMPRESSED_BYTES_IN, msg.text_size());
+    count_metric(COMPRESSED_BYTES_OUT, frame.size() - FRAME_HEADER_SIZE);
+    return messageArena.raw(frame);
+}
+
+// Which of a message and its compressed form, if it has one, goes to socket.
+const MessageRef &form_for(int socket, const MessageRef &msg, const MessageRef &compressed)
+{
+    if (compressed && (size_t)socket < socketCompressed.size() && socketCompressed[socket].load(std::memory_order_relaxed))
+        return compressed;
+    return msg;
+}
+
+// Sends a message with a single recipient, compressed if it asked for that.
+void send_compressible(int socket, const MessageRef &msg)
+{
+    if ((size_t)socket < socketCompressed.size() && socketCompressed[socket].load(std::memory_order_relaxed))
+    {
+        MessageRef compressed = compressed_form(msg);
+        send_message(socket, compressed ? compressed : msg);
+        return;
+    }
+    send_message(socket, msg);
+}
+
+// The ID of the user logged in on socket, or NO_SYMBOL.
+uint32_t user_of(int socket)
+{
+    if (socket < 0 || (size_t)socket >= socketUser.size())
+        return NO_SYMBOL;
+    return socketUser[socket].load(std::memory_order_acquire);
+}
+
+// The name of the user logged in on socket, empty if there is none.
+std::string_view user_name(int socket)
+{
+    uint32_t id = user_of(socket);
+    return id == NO_SYMBOL ? std::string_view() : userNames.name(id);
+}
+
+// The socket a user is logged in on, or -1.
+int socket_of(std::string_view user)
+{
+    uint32_t id = userNames.find(user);
+    const UserState *state = id == NO_SYMBOL ? nullptr : users.get(id);
+    return state ? state->socket.load(std::memory_order_acquire) : -1;
+}
+
+// The Group with this ID, or nullptr if it has none yet.
+Group *find_group(uint32_t id)
+{
+    const std::atomic<Group *> *slot = id == NO_SYMBOL ? nullptr : groups.get(id);
+    return slot ? slot->load(std::memory_order_acquire) : nullptr;
+}
+
+// The same, naming the user logged in on the sender's socket.
+MessageRef add_prefix(int sender, std::string_view message)
+{
+    return add_prefix(user_name(sender), message);
+}
+
+// Queues a cluster frame for the peers whose bits are set in mask. Frames are
+// encoded into a per-thread buffer, so forwarding allocates nothing once it
+// has grown.
+void cluster_send(uint64_t mask, uint8_t op, std::string_view payload)
+{
+    static thread_local std::string frame;
+    if (!cluster || !mask)
+        return;
+    frame.clear();
+    encode_frame(frame, op, payload);
+    cluster->send(mask, frame);
+}
+
+// The same for a frame that names a user or group. Names too long to frame
+// stay on this node, as they do for framed clients.
+void cluster_send(uint64_t mask, uint8_t op, std::string_view name, std::string_view body)
+{
+    static thread_local std::string frame;
+    if (!cluster || !mask || name.size() > FRAME_MAX_NAME)
+        return;
+    frame.clear();
+    encode_named_frame(frame, op, name, body);
+    cluster->send(mask, frame);
+}
+
+// Refuses a command because a bucket of class cls is empty.
+bool throttled(int socket, RateClass cls)
+{
+    static const MessageRef reply = MessageRef::make(throttledStr);
+    count_metric((MetricCounter)(THROTTLED_USER + (int)cls));
+    send_message(socket, reply);
+    return false;
+}
+
+// Refuses a message body too long to deliver in one frame once its sender or
+// group is put in front. Returns false, after telling the sender, if so.
+bool body_fits(int socket, std::string_view body)
+{
+    if (body.size() <= FRAME_MAX_BODY)
+        return true;
+    send_message(socket, tooLongStr, strlen(tooLongStr));
+    return false;
 }
 
-// Sends a message to all members of a group except the sender.
-void group_message(int sender, std::string group_name, std::string group_msg)
-{
-    group_msg = add_prefix("Group " + group_name, group_msg);
+// Takes a token from the sender's bucket for all their commands and from the
+// one for commands of class cls. Returns false, after telling the sender, if
+// either was empty.
+bool rate_allowed(int socket, RateClass cls)
+{
+    if (!rateLimits.limited(RATE_USER) && !rateLimits.limited(cls))
+        return true;
+    uint32_t id = user_of(socket);
+    UserState *state = id == NO_SYMBOL ? nullptr : users.get(id);
+    if (!state)
+        return true;
+    if (!rateLimits.take(RATE_USER, state->buckets[RATE_USER]))
+        return throttled(socket, RATE_USER);
+    if (!rateLimits.take(cls, state->buckets[cls]))
+        return throttled(socket, cls);
+    return true;
+}
+
+// Sends a message to all members of a group except the sender.
+void group_message(int sender, uint32_t group_id, std::string_view group_text)
+{
+    // Encoded once; every recipient queues a reference to the same bytes.
+    std::string_view group_name = groupNames.name(group_id);
+    MessageRef group_msg = messageArena.make({"[Group ", group_name, "]: ", group_text});
+
+    if (messageLog)
+        messageLog->store_group(group_name, group_text);
+
+    // If no member has been online yet, there is nobody to deliver to.
+    Group *group = find_group(group_id);
+    if (!group)
+        return;
+    if (historyStore)
+        group->history.append(std::string_view(group_msg.text(), group_msg.text_size()), *historyStore);
+    auto groupClients = group->members.load();
+    observe_fanout(FANOUT_GROUP, groupClients->size() - std::binary_search(groupClients->begin(), groupClients->end(), sender));
+
+    MessageRef compressed = compressed_form(group_msg);
+
+    // In epoll mode each shard delivers to the members it owns.
+    if (!shards.empty())
+    {
+        for (Shard *shard : shards)
+        {
+            run_on(shard, [shard, sender, group_id, group_msg, compressed]
+            {
+                if (group_id >= shard->localGroups.size())
+                    return;
+                for (int client : shard->localGroups[group_id])
+                {
+                    if (client != sender)
+                        shard->reactor.send_to(client, form_for(client, group_msg, compressed));
+                }
+            });
+        }
+        return;
+    }
+
+    // Send the group message to all members (except the sender) of the
+    // current membership snapshot.
+    for (auto client : *groupClients)
+    {
+        if (client != sender)
+        {
+            send_message(client, form_for(client, group_msg, compressed));
+        }
+    }
+}
+
+// Sends a message to all connected clients except the sender.
+void broadcast(int sender, const MessageRef &message)
+{
+    observe_fanout(FANOUT_BROADCAST, std::max(0, onlineUsers.load(std::memory_order_relaxed) - (sender >= 0)));
+    MessageRef compressed = compressed_form(message);
+
+    // In epoll mode each shard delivers to the connections it owns.
+    if (!shards.empty())
+    {
+        for (Shard *shard : shards)
+        {
+            run_on(shard, [shard, sender, message, compressed]
+            {
+                shard->reactor.for_each_connection([&](Connection &conn)
+                {
+                    // Connections still logging in are not part of the chat yet.
+                    if (conn.fd != sender && conn.state == ConnState::Chatting)
+                        shard->reactor.send_to(conn.fd, form_for(conn.fd, message, compressed));
+                });
+            });
+        }
+        return;
+    }
+
+    // Sockets are numbered densely from 0, so the table of who is logged in
+    // on each is scanned directly.
+    int top = socketHighWater.load(std::memory_order_acquire);
+    for (int client = 0; client <= top; client++)
+    {
+        if (client != sender && socketUser[client].load(std::memory_order_relaxed) != NO_SYMBOL)
+        {
+            send_message(client, form_for(client, message, compressed));
+        }
+    }
+}
+
+// Returns a group's ID, interning its name and creating its Group if that
+// has not happened yet. Caller holds group_mutex.
+uint32_t live_group(std::string_view group_name)
+{
+    uint32_t id = groupNames.intern(group_name);
+    std::atomic<Group *> &slot = groups.at(id);
+    if (!slot.load(std::memory_order_relaxed))
+        slot.store(new Group, std::memory_order_release);
+    return id;
+}
+
+// Adds a socket to a group's online members and returns the group's ID.
+// Caller holds group_mutex.
+uint32_t add_member(std::string_view group_name, int socket)
+{
+    uint32_t id = live_group(group_name);
+    bool first = false;
+    find_group(id)->members.update([socket, &first](std::vector<int> &clients)
+    {
+        auto it = std::lower_bound(clients.begin(), clients.end(), socket);
+        if (it == clients.end() || *it != socket)
+            clients.insert(it, socket);
+        first = clients.size() == 1;
+    });
+    // The other nodes forward the group's messages here from now on.
+    if (first)
+        cluster_send(CLUSTER_ALL_PEERS, CLUSTER_GROUP_ON, group_name);
+    std::vector<uint32_t> &memberOf = socketGroups[socket];
+    if (std::find(memberOf.begin(), memberOf.end(), id) == memberOf.end())
+        memberOf.push_back(id);
+    return id;
+}
+
+// Removes a socket from a sorted list of members, if it is there.
+void remove_member(std::vector<int> &clients, int socket)
+{
+    auto it = std::lower_bound(clients.begin(), clients.end(), socket);
+    if (it != clients.end() && *it == socket)
+        clients.erase(it);
+}
+
+// Removes a socket from a group's online members. Caller holds group_mutex.
+void drop_member(uint32_t group_id, int socket)
+{
+    bool last = false;
+    find_group(group_id)->members.update([socket, &last](std::vector<int> &clients)
+    {
+        size_t before = clients.size();
+        remove_member(clients, socket);
+        last = before == 1 && clients.empty();
+    });
+    if (last)
+        cluster_send(CLUSTER_ALL_PEERS, CLUSTER_GROUP_OFF, groupNames.name(group_id));
+}
+
+// Epoll mode: records that a socket owned by the calling shard is a member of
+// a group.
+void add_local_member(uint32_t group_id, int socket)
+{
+    if (!currentShard)
+        return;
+    std::vector<std::vector<int>> &local = currentShard->localGroups;
+    if (group_id >= local.size())
+        local.resize(group_id + 1);
+    if (std::find(local[group_id].begin(), local[group_id].end(), socket) == local[group_id].end())
+        local[group_id].push_back(socket);
+}
+
+void remove_local_member(uint32_t group_id, int socket)
+{
+    if (!currentShard || group_id >= currentShard->localGroups.size())
+        return;
+    std::vector<int> &members = currentShard->localGroups[group_id];
+    auto it = std::find(members.begin(), members.end(), socket);
+    if (it != members.end())
+    {
+        *it = members.back();
+        members.pop_back();
+    }
+}
+
+// Called when a client disconnects. It removes the client from all the data structures.
+void client_disconnected(int socket)
+{
+    std::string_view user; // names are never freed
+    std::vector<uint32_t> memberOf;
+    {
+        // Lock both mutexes, always client_mutex first
+        auto clientLock = timed_lock(client_mutex, LOCK_CLIENT);
+        auto groupLock = timed_lock(group_mutex, LOCK_GROUP);
+        uint32_t userId = user_of(socket);
+        user = user_name(socket);
+        // Only the groups the client is a member of need updating.
+        auto node = socketGroups.extract(socket);
+        if (!node.empty())
+            memberOf = std::move(node.mapped());
+        for (uint32_t group_id : memberOf)
+            drop_member(group_id, socket);
+        // Log the client out. A user who has since logged in again elsewhere
+        // stays online there.
+        socketUser[socket].store(NO_SYMBOL, std::memory_order_release);
+        if ((size_t)socket < socketCompressed.size() && socketCompressed[socket].exchange(false))
+            compressingClients.fetch_sub(1, std::memory_order_relaxed);
+        if (userId != NO_SYMBOL)
+        {
+            int expected = socket;
+            if (users.at(userId).socket.compare_exchange_strong(expected, -1))
+                cluster_send(CLUSTER_ALL_PEERS, CLUSTER_USER_OFF, user);
+        }
+        // Still under group_mutex, so no message to these groups falls
+        // between leaving them and being remembered as away.
+        if (messageLog && userId != NO_SYMBOL)
+        {
+            std::unordered_set<std::string> groupNamesOf;
+            for (uint32_t group_id : memberOf)
+                groupNamesOf.emplace(groupNames.name(group_id));
+            messageLog->user_left(std::string(user), groupNamesOf);
+        }
+    }
+    onlineUsers.fetch_sub(1, std::memory_order_relaxed);
+    count_metric(USERS_LEFT);
+    for (uint32_t group_id : memberOf)
+        remove_local_member(group_id, socket);
+    MessageRef left = MessageRef::make({user, " left the chat."});
+    broadcast(-1, left);
+    cluster_send(CLUSTER_ALL_PEERS, CLUSTER_BROADCAST, std::string_view(left.text(), left.text_size()));
+}
+
+// Command implementations shared by the text and framed protocols.
+
+// Sends a message to every other member of a group.
+void cmd_group_msg(int socket, std::string_view group_name, std::string_view group_msg)
+{
+    ScopedTiming timing(CMD_GROUP_MSG);
+    if (!body_fits(socket, group_msg) || !rate_allowed(socket, RATE_GROUP_MSG))
+        return;
+    uint32_t group_id = groupNames.find(group_name);
+    if (!find_group(group_id))
+    {
+        if (!registry->exists(std::string(group_name)))
+        {
+            send_message(socket, noGroupStr, strlen(noGroupStr));
+            return;
+        }
+        // Nobody in the group has been online yet, but it still keeps history.
+        auto lock = timed_lock(group_mutex, LOCK_GROUP);
+        group_id = live_group(group_name);
+    }
+    if (!rateLimits.take(RATE_GROUP, find_group(group_id)->bucket))
+    {
+        throttled(socket, RATE_GROUP);
+        return;
+    }
+    group_message(socket, group_id, group_msg);
+    // Nodes with members online deliver it there.
+    cluster_send(find_group(group_id)->remoteNodes.load(std::memory_order_acquire), CLUSTER_GROUP_MSG, group_name, group_msg);
+}
+
+// Sends a message to every other connected client.
+void cmd_broadcast(int socket, std::string_view msg)
+{
+    ScopedTiming timing(CMD_BROADCAST);
+    if (!body_fits(socket, msg) || !rate_allowed(socket, RATE_BROADCAST))
+        return;
+    MessageRef message = add_prefix(socket, msg);
+    broadcast(socket, message);
+    cluster_send(CLUSTER_ALL_PEERS, CLUSTER_BROADCAST, std::string_view(message.text(), message.text_size()));
+}
+
+// Sends a private message to one user.
+void cmd_private_msg(int socket, std::string_view receiverName, std::string_view msg)
+{
+    ScopedTiming timing(CMD_MSG);
+    if (!body_fits(socket, msg) || !rate_allowed(socket, RATE_MSG))
+        return;
+    int receiver_socket = socket_of(receiverName);
+    if (receiver_socket >= 0)
+    {
+        send_compressible(receiver_socket, add_prefix(socket, msg));
+        return;
+    }
+    // Logged in on another node: that node delivers it.
+    uint32_t receiver_id = userNames.find(receiverName);
+    const UserState *state = receiver_id == NO_SYMBOL ? nullptr : users.get(receiver_id);
+    int node = state ? state->node.load(std::memory_order_acquire) : -1;
+    if (node >= 0)
+    {
+        MessageRef message = add_prefix(socket, msg);
+        cluster_send(1ull << node, CLUSTER_PRIVATE, receiverName, std::string_view(message.text(), message.text_size()));
+        return;
+    }
+    std::string receiver(receiverName);
+    if (!messageLog || !credentials.load()->contains(receiver))
+    {
+        send_message(socket, noUserStr, strlen(noUserStr));
+        return;
+    }
+    // Registered but offline: keep the message for them and tell the sender
+    // once it is safely on disk.
+    std::string senderName(user_name(socket));
+    auto stillOffline = [&] { return (receiver_socket = socket_of(receiver)) < 0; };
+    auto acknowledge = [socket, senderName, receiver]
+    {
+        // The sender may have gone and its socket been reused meanwhile.
+        if (user_of(socket) != NO_SYMBOL && user_name(socket) == senderName)
+            send_message(socket, receiver + offlineStr);
+    };
+    if (!messageLog->store_private(senderName, receiver, msg, stillOffline, acknowledge))
+        send_compressible(receiver_socket, add_prefix(senderName, msg)); // logged in meanwhile
+}
+
+void cmd_create_group(int socket, const std::string &group_name)
+{
+    ScopedTiming timing(CMD_CREATE_GROUP);
+    if (!rate_allowed(socket, RATE_MEMBERSHIP))
+        return;
+    std::string groupCreatedStr = "Group " + group_name + " created.";
+    send_message(socket, groupCreatedStr);
+    std::string user(user_name(socket));
+    uint32_t group_id;
+    {
+        auto lock = timed_lock(group_mutex, LOCK_GROUP);
+        registry->create(group_name);
+        registry->join(group_name, user);
+        cluster_send(CLUSTER_ALL_PEERS, CLUSTER_CREATE, group_name);
+        cluster_send(CLUSTER_ALL_PEERS, CLUSTER_JOIN, group_name, user);
+        group_id = add_member(group_name, socket);
+    }
+    add_local_member(group_id, socket);
+}
+
+void cmd_join_group(int socket, const std::string &group_name)
+{
+    ScopedTiming timing(CMD_JOIN_GROUP);
+    if (!rate_allowed(socket, RATE_MEMBERSHIP))
+        return;
+    std::string user(user_name(socket));
+    uint32_t group_id;
+    {
+        auto lock = timed_lock(group_mutex, LOCK_GROUP);
+        if (!registry->join(group_name, user))
+        {
+            send_message(socket, noGroupStr, strlen(noGroupStr));
+            return;
+        }
+        cluster_send(CLUSTER_ALL_PEERS, CLUSTER_JOIN, group_name, user);
+        group_id = add_member(group_name, socket);
+    }
+    add_local_member(group_id, socket);
+    std::string joinGroupStr = "You joined the group " + group_name + '.';
+    send_message(socket, joinGroupStr);
+}
+
+void cmd_leave_group(int socket, const std::string &group_name)
+{
+    ScopedTiming timing(CMD_LEAVE_GROUP);
+    if (!rate_allowed(socket, RATE_MEMBERSHIP))
+        return;
+    std::string user(user_name(socket));
+    uint32_t group_id = groupNames.find(group_name);
+    {
+        auto lock = timed_lock(group_mutex, LOCK_GROUP);
+        if (!registry->leave(group_name, user))
+        {
+            send_message(socket, noGroupStr, strlen(noGroupStr));
+            return;
+        }
+        cluster_send(CLUSTER_ALL_PEERS, CLUSTER_LEAVE, group_name, user);
+        std::vector<uint32_t> &memberOf = socketGroups[socket];
+        auto it = std::find(memberOf.begin(), memberOf.end(), group_id);
+        if (it != memberOf.end())
+        {
+            drop_member(group_id, socket);
+            memberOf.erase(it);
+        }
+    }
+    remove_local_member(group_id, socket);
+    std::string groupLeftStr = "You left the group " + group_name + '.';
+    send_message(socket, groupLeftStr);
+}
+
+// Sends a member the last messages of a group, all in one write: one frame per
+// message for a framed client, one line per message otherwise.
+void cmd_history(int socket, const std::string &group_name, const std::string &count, bool framed)
+{
+    ScopedTiming timing(CMD_HISTORY);
+    if (!rate_allowed(socket, RATE_HISTORY))
+        return;
+    char *end;
+    long n = strtol(count.c_str(), &end, 10);
+    if (count.empty() || *end != '\0' || n < 1)
+    {
+        send_message(socket, historyUsageStr, strlen(historyUsageStr));
+        return;
+    }
+    std::string user(user_name(socket));
+    if (!registry->exists(group_name))
+    {
+        send_message(socket, noGroupStr, strlen(noGroupStr));
+        return;
+    }
+    if (!registry->is_member(group_name, user))
+    {
+        send_message(socket, "You are not a member of the group " + group_name + '.');
+        return;
+    }
+    std::string out;
+    Group *group = find_group(groupNames.find(group_name));
+    if (historyStore && group)
+    {
+        group->history.last(n, [&](std::string_view text)
+        {
+            if (framed)
+                encode_frame(out, OP_TEXT, text);
+            else
+            {
+                out += text;
+                out += '\n';
+            }
+        });
+    }
+    if (out.empty())
+        send_message(socket, "No history for the group " + group_name + '.');
+    else
+        send_message(socket, MessageRef::raw(out));
+}
+
+// Handles a single text-protocol message/command received from a client. The
+// arguments are views into the receive buffer; commands copy only what they
+// keep.
+void handle_command(int socket, std::string_view message)
+{
+    size_t space1 = message.find(' ');
+    size_t space2 = space1 == std::string_view::npos ? space1 : message.find(' ', space1 + 1);
+    bool oneArg = space1 != std::string_view::npos;
+    bool twoArgs = space2 != std::string_view::npos;
+
+    if (message.starts_with("/group_msg"))
+    {
+        if (twoArgs)
+            cmd_group_msg(socket, message.substr(space1 + 1, space2 - space1 - 1), message.substr(space2 + 1));
+    }
+    else if (message.starts_with("/broadcast"))
+    {
+        if (oneArg)
+            cmd_broadcast(socket, message.substr(space1 + 1));
+    }
+    else if (message.starts_with("/msg"))
+    {
+        if (twoArgs)
+            cmd_private_msg(socket, message.substr(space1 + 1, space2 - space1 - 1), message.substr(space2 + 1));
+    }
+    else if (message.starts_with("/create_group"))
+    {
+        if (oneArg)
+            cmd_create_group(socket, std::string(message.substr(space1 + 1)));
+    }
+    else if (message.starts_with("/join_group"))
+    {
+        if (oneArg)
+            cmd_join_group(socket, std::string(message.substr(space1 + 1)));
+    }
+    else if (message.starts_with("/leave_group"))
+    {
+        if (oneArg)
+            cmd_leave_group(socket, std::string(message.substr(space1 + 1)));
+    }
+    else if (message.starts_with("/history"))
+    {
+        if (twoArgs)
+            cmd_history(socket, std::string(message.substr(space1 + 1, space2 - space1 - 1)),
+                        std::string(message.substr(space2 + 1)), false);
+        else
+            send_message(socket, historyUsageStr, strlen(historyUsageStr));
+    }
+    else
+        count_metric(COMMANDS_UNKNOWN);
+}
+
+// Handles one command frame. Unknown opcodes and malformed payloads are
+// ignored, like unknown text commands.
+void handle_frame(int socket, uint8_t op, std::string_view payload)
+{
+    std::string_view name, body;
+    switch (op)
+    {
+    case OP_MSG:
+        if (split_named(payload, name, body))
+            cmd_private_msg(socket, name, body);
+        break;
+    case OP_BROADCAST:
+        cmd_broadcast(socket, payload);
+        break;
+    case OP_GROUP_MSG:
+        if (split_named(payload, name, body))
+            cmd_group_msg(socket, name, body);
+        break;
+    case OP_CREATE_GROUP:
+        cmd_create_group(socket, std::string(payload));
+        break;
+    case OP_JOIN_GROUP:
+        cmd_join_group(socket, std::string(payload));
+        break;
+    case OP_LEAVE_GROUP:
+        cmd_leave_group(socket, std::string(payload));
+        break;
+    case OP_HISTORY:
+        if (split_named(payload, name, body))
+            cmd_history(socket, std::string(name), std::string(body), true);
+        break;
+    case OP_PING:
+    {
+        // Queued behind the replies to everything the client sent before, so
+        // the client can time how long its commands take to be handled.
+        static thread_local std::string pong;
+        pong.clear();
+        encode_frame(pong, OP_PONG, payload);
+        send_message(socket, messageArena.raw(pong));
+        break;
+    }
+    case OP_PONG:
+        break; // receiving it was the point
+    case OP_COMPRESS:
+    {
+        // Only the server's own dictionary will do. The client must be ready
+        // for OP_ZTEXT from its request on, since fan-outs on other threads
+        // may compress for it before the answer is queued.
+        uint32_t id;
+        bool agreed = compressEnabled && decode_dictionary_id(payload, id) && id == compressDictId &&
+                      (size_t)socket < socketCompressed.size();
+        if (agreed && !socketCompressed[socket].exchange(true))
+            compressingClients.fetch_add(1, std::memory_order_relaxed);
+        static thread_local std::string answer;
+        answer.clear();
+        encode_frame(answer, OP_COMPRESS, agreed ? payload : std::string_view());
+        send_message(socket, messageArena.raw(answer));
+        break;
+    }
+    default:
+        count_metric(COMMANDS_UNKNOWN);
+        break;
+    }
+}
+
+// What a logged-in client's timer found when it fired.
+enum SessionCheck
+{
+    SESSION_OK,   // nothing to do yet
+    SESSION_PING, // quiet for a heartbeat interval: send OP_PING
+    SESSION_IDLE, // quiet for the idle timeout
+    SESSION_DEAD  // a ping went unanswered for a heartbeat interval
+};
+
+// Decides what a logged-in client's timer does at now, given when the client
+// last sent anything and when it was last pinged, and sets next to when the
+// timer should fire again, or 0 if it need not. Only framed clients can
+// answer pings; text clients rely on TCP keepalive to find dead peers.
+// Activity never touches the timer: it fires at the earliest moment the
+// client could have gone quiet for long enough and looks again.
+SessionCheck check_session(int64_t lastInput, int64_t &pingSent, bool framed, int64_t now, int64_t &next)
+{
+    next = 0;
+    auto due = [&next](int64_t at) { next = next ? std::min(next, at) : at; };
+    if (idleTimeoutMs > 0)
+    {
+        if (now - lastInput >= idleTimeoutMs)
+            return SESSION_IDLE;
+        due(lastInput + idleTimeoutMs);
+    }
+    if (heartbeatMs == 0 || !framed)
+        return SESSION_OK;
+    if (pingSent > lastInput)
+    {
+        if (now - pingSent >= heartbeatMs)
+            return SESSION_DEAD;
+        due(pingSent + heartbeatMs);
+        return SESSION_OK;
+    }
+    if (now - lastInput >= heartbeatMs)
+    {
+        pingSent = now;
+        due(now + heartbeatMs);
+        return SESSION_PING;
+    }
+    due(lastInput + heartbeatMs);
+    return SESSION_OK;
+}
+
+// An OP_PING frame, sent as-is.
+const MessageRef &ping_message()
+{
+    static const MessageRef ping = []
+    {
+        std::string frame;
+        encode_frame(frame, OP_PING, "");
+        return MessageRef::raw(frame);
+    }();
+    return ping;
+}
+
+// Asks the kernel to probe a client that has been silent for a heartbeat
+// interval and to give up on one that stops acknowledging, so a vanished
+// peer's socket reports an error instead of staying open for hours.
+void enable_keepalive(int socket)
+{
+    if (heartbeatMs == 0)
+        return;
+    int on = 1, idle = std::max(1, heartbeatMs / 1000), interval = std::max(1, idle / 3), probes = 3;
+    unsigned userTimeout = 2 * heartbeatMs;
+    setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    setsockopt(socket, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(socket, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(socket, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+    setsockopt(socket, IPPROTO_TCP, TCP_USER_TIMEOUT, &userTimeout, sizeof(userTimeout));
+}
+
+// Replies are already gathered into as few writes as the output queues allow,
+// so Nagle's algorithm only delays them: a client that pipelines commands would
+// otherwise wait for a delayed ACK before every reply after the first.
+void disable_nagle(int socket)
+{
+    int on = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+// Thread mode: the timer of a logged-in client. All timers share one wheel
+// and one thread, which pings and drops clients on behalf of their blocked
+// reader threads.
+struct SessionTimer
+{
+    TimerNode<SessionTimer> node;
+    int socket = -1;
+    bool framed = false;
+    std::atomic<int64_t> lastInput{0}; // written by the reader thread
+    int64_t pingSent = 0;
+};
+
+std::mutex sessionTimerMutex; // guards sessionTimers and every SessionTimer but lastInput
+std::condition_variable sessionTimerWake;
+std::unique_ptr<TimerWheel<SessionTimer>> sessionTimers; // null unless heartbeats or idle timeouts are on
+std::vector<std::unique_ptr<SessionTimer>> socketTimer;   // socket -> its timer, thread mode only
+
+// Thread mode: handles a timer that fired. Called with sessionTimerMutex held.
+void session_timer_fired(SessionTimer &timer)
+{
+    int64_t now = monotonic_ms(), next;
+    switch (check_session(timer.lastInput.load(std::memory_order_relaxed), timer.pingSent, timer.framed, now, next))
+    {
+    case SESSION_PING:
+        send_message(timer.socket, ping_message());
+        count_metric(HEARTBEATS_SENT);
+        break;
+    case SESSION_IDLE:
+        count_metric(SESSIONS_IDLE);
+        send_message(timer.socket, idleTimeoutStr, strlen(idleTimeoutStr));
+        // The reader thread wakes up to a closed socket and disconnects the
+        // client as usual; the descriptor cannot be reused before it does.
+        shutdown(timer.socket, SHUT_RDWR);
+        return;
+    case SESSION_DEAD:
+        count_metric(SESSIONS_UNRESPONSIVE);
+        shutdown(timer.socket, SHUT_RDWR);
+        return;
+    case SESSION_OK:
+        break;
+    }
+    if (next)
+        sessionTimers->schedule(timer.node, next);
+}
+
+// Thread mode: runs the session timers.
+void session_timer_loop()
+{
+    std::unique_lock<std::mutex> lock(sessionTimerMutex);
+    while (true)
+    {
+        sessionTimers->advance(monotonic_ms(), session_timer_fired);
+        int64_t wait = sessionTimers->next_due(monotonic_ms());
+        if (wait < 0)
+            sessionTimerWake.wait(lock);
+        else
+            sessionTimerWake.wait_for(lock, std::chrono::milliseconds(wait));
+    }
+}
+
+// Thread mode: starts the timer of a client that just logged in.
+void session_timer_started(int socket, bool framed)
+{
+    if (!sessionTimers)
+        return;
+    std::lock_guard<std::mutex> lock(sessionTimerMutex);
+    if (!socketTimer[socket])
+        socketTimer[socket] = std::make_unique<SessionTimer>();
+    SessionTimer &timer = *socketTimer[socket];
+    timer.node.owner = &timer;
+    timer.socket = socket;
+    timer.framed = framed;
+    timer.lastInput.store(monotonic_ms(), std::memory_order_relaxed);
+    timer.pingSent = 0;
+    session_timer_fired(timer);
+    sessionTimerWake.notify_one();
+}
+
+void session_timer_stopped(int socket)
+{
+    if (!sessionTimers)
+        return;
+    std::lock_guard<std::mutex> lock(sessionTimerMutex);
+    sessionTimers->cancel(socketTimer[socket]->node);
+}
+
+// This function handles the messages/commands coming from a particular client
+// in thread-per-client mode.
+void handle_client_requests(int socket)
+{
+    SessionTimer *timer = sessionTimers ? socketTimer[socket].get() : nullptr;
+    char buffer[BUFFER_SIZE] = {0};
+    int bytesReceived;
+    FrameParser frames;
+
+    while (true)
+    {
+        bytesReceived = read(socket, buffer, BUFFER_SIZE);
+        if (bytesReceived <= 0)
+        {
+            session_timer_stopped(socket);
+            client_disconnected(socket);
+            return;
+        }
+        if (timer)
+            timer->lastInput.store(monotonic_ms(), std::memory_order_relaxed);
+        if (!socketFramed[socket])
+        {
+            handle_command(socket, std::string_view(buffer, bytesReceived));
+            continue;
+        }
+        bool ok = frames.feed(buffer, bytesReceived, [socket](uint8_t op, std::string_view payload)
+                              { handle_frame(socket, op, payload); });
+        // A corrupt stream cannot be resynchronised; the next read() reports the disconnect.
+        if (!ok)
+            shutdown(socket, SHUT_RDWR);
+    }
+}
+
+// Adds an authenticated client to the client maps and announces it.
+void client_joined(int socket, const std::string &user)
+{
+    MessageRef joined = MessageRef::make({user, " has joined the chat."});
+    broadcast(-1, joined);
+    cluster_send(CLUSTER_ALL_PEERS, CLUSTER_BROADCAST, std::string_view(joined.text(), joined.text_size()));
+
+    // Protect client maps while adding a new client.
+    {
+        auto lock = timed_lock(client_mutex, LOCK_CLIENT);
+        uint32_t id = userNames.intern(user);
+        users.at(id).socket.store(socket, std::memory_order_release);
+        cluster_send(CLUSTER_ALL_PEERS, CLUSTER_USER_ON, user);
+        socketUser[socket].store(id, std::memory_order_release);
+        if (socket > socketHighWater.load(std::memory_order_relaxed))
+            socketHighWater.store(socket, std::memory_order_release);
+    }
+    onlineUsers.fetch_add(1, std::memory_order_relaxed);
+
+    // Memberships outlive connections: go back online in the user's groups.
+    std::vector<uint32_t> userGroups;
+    {
+        auto lock = timed_lock(group_mutex, LOCK_GROUP);
+        for (const std::string &group_name : registry->groups_of(user))
+            userGroups.push_back(add_member(group_name, socket));
+    }
+    for (uint32_t group_id : userGroups)
+        add_local_member(group_id, socket);
+}
+
+// Delivers whatever the message log kept for a user while they were away, in
+// the form it would have arrived live. Call after client_joined, so nothing
+// sent from then on is kept instead.
+void deliver_missed(int socket, const std::string &user)
+{
+    if (!messageLog)
+        return;
+    for (const MissedMessage &missed : messageLog->user_returned(user))
+    {
+        if (missed.kind == LOG_GROUP)
+            send_message(socket, MessageRef::make({"[Group ", missed.from, "]: ", missed.text}));
+        else
+            send_message(socket, add_prefix(missed.from, missed.text));
+    }
+}
+
+// Cluster: appends the frames that tell a peer linking to this node which
+// users and groups are online here, and every group in the registry.
+void cluster_snapshot(std::string &out)
+{
+    auto clientLock = timed_lock(client_mutex, LOCK_CLIENT);
+    auto groupLock = timed_lock(group_mutex, LOCK_GROUP);
+    for (uint32_t id = 0; id < userNames.size(); id++)
+    {
+        const UserState *state = users.get(id);
+        if (state && state->socket.load(std::memory_order_relaxed) >= 0)
+            encode_frame(out, CLUSTER_USER_ON, userNames.name(id));
+    }
+    registry->for_each([&out](const std::string &group, const std::vector<std::string_view> &members)
+    {
+        encode_frame(out, CLUSTER_CREATE, group);
+        if (group.size() > FRAME_MAX_NAME)
+            return;
+        for (std::string_view member : members)
+            encode_named_frame(out, CLUSTER_JOIN, group, member);
+    });
+    for (uint32_t id = 0; id < groupNames.size(); id++)
+    {
+        Group *group = find_group(id);
+        if (group && !group->members.load()->empty())
+            encode_frame(out, CLUSTER_GROUP_ON, groupNames.name(id));
+    }
+}
+
+// Cluster: forgets which users and groups a peer had online, until its next
+// snapshot says again.
+void cluster_peer_reset(int peer)
+{
+    {
+        auto lock = timed_lock(client_mutex, LOCK_CLIENT);
+        for (uint32_t id = 0; id < userNames.size(); id++)
+        {
+            int expected = peer;
+            if (UserState *state = users.get(id))
+                state->node.compare_exchange_strong(expected, -1);
+        }
+    }
+    auto lock = timed_lock(group_mutex, LOCK_GROUP);
+    for (uint32_t id = 0; id < groupNames.size(); id++)
+    {
+        if (Group *group = find_group(id))
+            group->remoteNodes.fetch_and(~(1ull << peer), std::memory_order_release);
+    }
+}
+
+// Cluster: applies one frame from a peer. Messages are delivered only to the
+// clients of this node and never forwarded again.
+void cluster_frame(int peer, uint8_t op, std::string_view payload)
+{
+    std::string_view name, body;
+    switch (op)
+    {
+    case CLUSTER_USER_ON:
+    {
+        auto lock = timed_lock(client_mutex, LOCK_CLIENT);
+        users.at(userNames.intern(payload)).node.store(peer, std::memory_order_release);
+        break;
+    }
+    case CLUSTER_USER_OFF:
+    {
+        auto lock = timed_lock(client_mutex, LOCK_CLIENT);
+        uint32_t id = userNames.find(payload);
+        int expected = peer;
+        if (id != NO_SYMBOL)
+            users.at(id).node.compare_exchange_strong(expected, -1);
+        break;
+    }
+    case CLUSTER_GROUP_ON:
+    {
+        auto lock = timed_lock(group_mutex, LOCK_GROUP);
+        find_group(live_group(payload))->remoteNodes.fetch_or(1ull << peer, std::memory_order_release);
+        break;
+    }
+    case CLUSTER_GROUP_OFF:
+    {
+        auto lock = timed_lock(group_mutex, LOCK_GROUP);
+        if (Group *group = find_group(groupNames.find(payload)))
+            group->remoteNodes.fetch_and(~(1ull << peer), std::memory_order_release);
+        break;
+    }
+    case CLUSTER_CREATE:
+    {
+        auto lock = timed_lock(group_mutex, LOCK_GROUP);
+        registry->create(std::string(payload));
+        break;
+    }
+    case CLUSTER_JOIN:
+    case CLUSTER_LEAVE:
+        if (split_named(payload, name, body))
+        {
+            auto lock = timed_lock(group_mutex, LOCK_GROUP);
+            std::string group(name);
+            if (op == CLUSTER_LEAVE)
+                registry->leave(group, std::string(body));
+            else
+            {
+                registry->create(group); // in case its CREATE was lost
+                registry->join(group, std::string(body));
+            }
+        }
+        break;
+    case CLUSTER_PRIVATE:
+        // The receiver may have logged out since the peer last heard.
+        if (split_named(payload, name, body))
+        {
+            int receiver_socket = socket_of(name);
+            if (receiver_socket >= 0)
+                send_compressible(receiver_socket, MessageRef::make(body));
+        }
+        break;
+    case CLUSTER_BROADCAST:
+        broadcast(-1, MessageRef::make(payload));
+        break;
+    case CLUSTER_GROUP_MSG:
+        if (split_named(payload, name, body))
+        {
+            uint32_t group_id = groupNames.find(name);
+            if (!find_group(group_id))
+            {
+                auto lock = timed_lock(group_mutex, LOCK_GROUP);
+                group_id = live_group(name);
+            }
+            group_message(-1, group_id, body);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// Loads the configured credential store: the index at credentialsPath if one
+// was given, users.txt otherwise. Returns nullptr after printing why on failure.
+std::shared_ptr<const CredentialStore> load_credentials()
+{
+    std::string error;
+    std::shared_ptr<const CredentialStore> store = credentialsPath.empty()
+                                                       ? TextCredentials::load("users.txt", error)
+                                                       : IndexedCredentials::load(credentialsPath, error);
+    if (!store)
+        std::cerr << error << std::endl;
+    return store;
+}
+
+// Loads the rate limits from rateLimitsPath, if set. Returns false after
+// printing why on failure, leaving the limits as they were.
+bool load_rate_limits()
+{
+    std::string error;
+    if (rateLimitsPath.empty() || rateLimits.load(rateLimitsPath, error))
+        return true;
+    std::cerr << "Rate limits: " << error << std::endl;
+    return false;
+}
+
+// Swaps in a freshly loaded credential store, and the rate limits, whenever
+// the process receives SIGHUP. Logins in progress finish against the store
+// they started with; buckets follow the new limits from their next command.
+void reload_loop()
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    while (true)
+    {
+        int sig;
+        if (sigwait(&set, &sig) != 0)
+            continue;
+        if (auto store = load_credentials())
+        {
+            credentials.store(store, std::memory_order_release);
+            std::cout << "Reloaded " << store->size() << " credentials." << std::endl;
+        }
+        if (!rateLimitsPath.empty() && load_rate_limits())
+            std::cout << "Reloaded the rate limits." << std::endl;
+    }
+}
+
+// Returns true if the username/password pair is valid.
+// Also counts the attempt by result.
+bool check_credentials(const std::string &user, const std::string &pass)
+{
+    bool ok;
+    {
+        ScopedTiming timing(AUTH);
+        ok = credentials.load(std::memory_order_acquire)->check(user, pass);
+    }
+    count_metric(ok ? LOGINS_OK : LOGINS_FAILED);
+    return ok;
+}
+
+// Creates a listening socket on clientPort. With reusePort several sockets can share
+// the port and the kernel spreads incoming connections across them.
+int create_listener(bool reusePort)
+{
+    int server_fd;
+    struct sockaddr_in address;
+    int opt = 1;
+
+    // Create socket file descriptor
+    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    {
+        perror("Socket failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // Set socket options (macOS compatible)
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)))
+    {
+        perror("setsockopt");
+        exit(EXIT_FAILURE);
+    }
+    if (reusePort && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)))
+    {
+        perror("setsockopt SO_REUSEPORT");
+        exit(EXIT_FAILURE);
+    }
+
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(clientPort);
 
-    // Copy the set of group members under lock.
-    std::unordered_set<int> groupClients;
+    // Bind the socket to the address
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0)
     {
-        std::lock_guard<std::mutex> lock(group_mutex);
-        // If the group does not exist, simply return.
-        if (groups.find(group_name) == groups.end())
-            return;
-        groupClients = groups[group_name];
+        perror("Bind failed");
+        exit(EXIT_FAILURE);
     }
-    // Send the group message to all members (except the sender)
-    for (auto client : groupClients)
+
+    // Listen for incoming connections
+    if (listen(server_fd, SOMAXCONN) < 0)
     {
-        if (client != sender)
-        {
-            send(client, group_msg.c_str(), group_msg.length(), 0);
-        }
+        perror("Listen");
+        exit(EXIT_FAILURE);
     }
+    return server_fd;
 }
 
-// Sends a message to all connected clients except the sender.
-void broadcast(int sender, std::string message)
+// Runs the login exchange on a blocking socket, then serves the client.
+// Thread-per-client mode only. The receive timeout bounds how long a client
+// may take to log in.
+void client_session(int socket)
 {
-    // Copy the map of clients under lock.
-    std::unordered_map<int, std::string> clients;
+    char buffer[BUFFER_SIZE] = {0};
+    int bytesReceived;
+    struct timeval timeout = {loginTimeoutMs / 1000, (loginTimeoutMs % 1000) * 1000};
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    send(socket, userStr, strlen(userStr), 0);
+    bytesReceived = read(socket, buffer, BUFFER_SIZE);
+    if (bytesReceived <= 0)
     {
-        std::lock_guard<std::mutex> lock(client_mutex);
-        clients = socketsUser;
+        if (bytesReceived < 0)
+        {
+            send(socket, loginTimeoutStr, strlen(loginTimeoutStr), MSG_NOSIGNAL);
+            count_metric(LOGINS_TIMED_OUT);
+        }
+        close(socket);
+        return;
     }
-    for (auto &[client, user] : clients)
+    // A leading FRAME_MAGIC opts into the framed protocol.
+    bool framed = (uint8_t)buffer[0] == FRAME_MAGIC;
+    std::string user(buffer + framed, bytesReceived - framed);
+
+    send(socket, passStr, strlen(passStr), 0);
+    socketFramed[socket] = framed;
+    bytesReceived = read(socket, buffer, BUFFER_SIZE);
+    if (bytesReceived <= 0)
     {
-        if (client != sender)
+        if (bytesReceived < 0)
         {
-            send(client, message.c_str(), message.length(), 0);
+            send_message(socket, loginTimeoutStr, strlen(loginTimeoutStr));
+            count_metric(LOGINS_TIMED_OUT);
         }
+        close(socket);
+        return;
+    }
+    std::string pass(buffer, bytesReceived);
+
+    if (!check_credentials(user, pass))
+    {
+        send_message(socket, authFailedStr, strlen(authFailedStr));
+        close(socket);
+        return;
     }
+
+    struct timeval noTimeout = {0, 0};
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &noTimeout, sizeof(noTimeout));
+    client_joined(socket, user);
+    send_message(socket, welcomeStr, strlen(welcomeStr));
+    deliver_missed(socket, user);
+    session_timer_started(socket, framed);
+    handle_client_requests(socket);
 }
 
-// Called when a client disconnects. It removes the client from all the data structures.
-void client_disconnected(int socket)
+// Thread-per-client mode: gives a connected client its own thread. The login
+// exchange runs on that thread so a slow client never holds up the accept loop.
+void session_started(int socket)
+{
+    output_opened(socket);
+    count_metric(CONNECTIONS_ACCEPTED);
+    // Start a thread to handle this client's requests.
+    std::thread new_client_thread([socket]
+    {
+        client_session(socket);
+        count_metric(CONNECTIONS_CLOSED);
+    });
+    new_client_thread.detach();
+}
+
+// Accepts clients on server_fd and starts their sessions, after the TLS
+// handshake if TLS is on.
+void accept_loop(int server_fd)
 {
-    std::string user;
+    int new_socket;
+    struct sockaddr_in address;
+    int addrlen = sizeof(address);
+
+    while (true)
     {
-        // Lock both mutexes (order is handled safely with scoped_lock)
-        std::scoped_lock lock(client_mutex, group_mutex);
-        user = socketsUser[socket];
-        // Remove the socket from every group it may be a member of.
-        for (auto &[group_name, clients] : groups)
+        if ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen)) < 0)
         {
-            if (clients.find(socket) != clients.end())
-            {
-                clients.erase(socket);
-            }
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE)
+                continue;
+            perror("Accept");
+            exit(EXIT_FAILURE);
         }
-        // Remove the client from the client maps.
-        socketsUser.erase(socket);
-        userSockets.erase(user);
+        enable_keepalive(new_socket);
+        disable_nagle(new_socket);
+        if (tls)
+            tls->accept(new_socket);
+        else
+            session_started(new_socket);
     }
-    broadcast(-1, user + " left the chat.");
 }
 
-// Simple helper to check if string a starts with string b.
-bool starts_with(std::string a, std::string b)
+// Epoll mode: a newly accepted connection starts the login exchange.
+void login_started(Connection &conn)
 {
-    if (a.length() < b.length())
-        return false;
-    else if (a.substr(0, b.length()) == b)
-        return true;
-    return false;
+    socketConn[conn.fd].store(conn.id, std::memory_order_relaxed);
+    socketShard[conn.fd].store(currentShard->index, std::memory_order_release);
+    count_metric(CONNECTIONS_ACCEPTED);
+    if (!tls)
+    {
+        enable_keepalive(conn.fd);
+        disable_nagle(conn.fd);
+    }
+    currentShard->reactor.send_to(conn.fd, userStr, strlen(userStr));
+    currentShard->reactor.set_timeout(conn, loginTimeoutMs);
 }
 
-// This function handles the messages/commands coming from a particular client.
-void handle_client_requests(int socket)
+// Epoll mode with TLS: hands a client whose handshake is done to a shard, in
+// turn, as if that shard had accepted it.
+void tls_client_ready(int socket)
 {
-    const char *noGroupStr = "No such group exists.";
-    const char *noUserStr  = "No such user exists.";
-    char buffer[BUFFER_SIZE] = {0};
-    int bytesReceived;
+    static std::atomic<size_t> next{0};
+    Shard *shard = shards[next.fetch_add(1, std::memory_order_relaxed) % shards.size()];
+    shard->reactor.post([shard, socket] { login_started(shard->reactor.adopt(socket)); });
+}
 
-    while (true)
+// Epoll mode: a logged-in client's timer fired, or it just logged in.
+void session_timed_out(Connection &conn)
+{
+    Reactor &reactor = currentShard->reactor;
+    int64_t now = monotonic_ms(), next;
+    switch (check_session(conn.last_input, conn.ping_sent, conn.framed, now, next))
     {
-        bytesReceived = read(socket, buffer, BUFFER_SIZE);
-        if (bytesReceived <= 0)
+    case SESSION_PING:
+        reactor.send_to(conn.fd, ping_message());
+        count_metric(HEARTBEATS_SENT);
+        break;
+    case SESSION_IDLE:
+        // A client that has not taken the notice by the next firing is cut off.
+        if (conn.draining)
         {
-            client_disconnected(socket);
+            reactor.schedule_close(conn);
             return;
         }
-        else
-        {
-            std::string message(buffer, bytesReceived);
+        count_metric(SESSIONS_IDLE);
+        reactor.send_to(conn.fd, idleTimeoutStr, strlen(idleTimeoutStr));
+        reactor.close_after_flush(conn);
+        reactor.set_timeout(conn, DRAIN_TIMEOUT_MS);
+        return;
+    case SESSION_DEAD:
+        count_metric(SESSIONS_UNRESPONSIVE);
+        reactor.schedule_close(conn);
+        return;
+    case SESSION_OK:
+        break;
+    }
+    if (next)
+        reactor.set_timeout(conn, next - now);
+}
 
-            if (starts_with(message, "/group_msg"))
-            {
-                size_t space1 = message.find(' ');
-                size_t space2 = message.find(' ', space1 + 1);
-                if (space1 != std::string::npos && space2 != std::string::npos)
-                {
-                    std::string group_name = message.substr(space1 + 1, space2 - space1 - 1);
-                    std::string group_msg  = message.substr(space2 + 1);
-
-                    // Check if the group exists under lock.
-                    {
-                        std::lock_guard<std::mutex> lock(group_mutex);
-                        if (groups.find(group_name) == groups.end())
-                        {
-                            send(socket, noGroupStr, strlen(noGroupStr), 0);
-                            continue;
-                        }
-                    }
-                    group_message(socket, group_name, group_msg);
-                }
-            }
-            else if (starts_with(message, "/broadcast"))
-            {
-                size_t space = message.find(' ');
-                if (space != std::string::npos)
-                {
-                    std::string broadcast_msg = message.substr(space + 1);
-                    // Get the sender's name safely.
-                    {
-                        std::lock_guard<std::mutex> lock(client_mutex);
-                        broadcast_msg = add_prefix(socketsUser[socket], broadcast_msg);
-                    }
-                    broadcast(socket, broadcast_msg);
-                }
-            }
-            else if (starts_with(message, "/msg"))
-            {
-                size_t space1 = message.find(' ');
-                size_t space2 = message.find(' ', space1 + 1);
-                if (space1 != std::string::npos && space2 != std::string::npos)
-                {
-                    std::string receiver = message.substr(space1 + 1, space2 - space1 - 1);
-                    std::string msg      = message.substr(space2 + 1);
-                    std::string senderName;
-                    int receiver_socket;
-                    {
-                        std::lock_guard<std::mutex> lock(client_mutex);
-                        senderName = socketsUser[socket];
-                        if (userSockets.find(receiver) == userSockets.end())
-                        {
-                            send(socket, noUserStr, strlen(noUserStr), 0);
-                            continue;
-                        }
-                        receiver_socket = userSockets[receiver];
-                    }
-                    msg = add_prefix(senderName, msg);
-                    send(receiver_socket, msg.c_str(), msg.length(), 0);
-                }
-            }
-            else if (starts_with(message, "/create_group"))
-            {
-                size_t space = message.find(' ');
-                if (space != std::string::npos)
-                {
-                    std::string group_name = message.substr(space + 1);
-                    std::string groupCreatedStr = "Group " + group_name + " created.";
-                    send(socket, groupCreatedStr.c_str(), groupCreatedStr.length(), 0);
-                    {
-                        std::lock_guard<std::mutex> lock(group_mutex);
-                        groups[group_name].insert(socket);
-                    }
-                }
-            }
-            else if (starts_with(message, "/join_group"))
-            {
-                size_t space = message.find(' ');
-                if (space != std::string::npos)
-                {
-                    std::string group_name = message.substr(space + 1);
-                    {
-                        std::lock_guard<std::mutex> lock(group_mutex);
-                        if (groups.find(group_name) == groups.end())
-                        {
-                            send(socket, noGroupStr, strlen(noGroupStr), 0);
-                            continue;
-                        }
-                        groups[group_name].insert(socket);
-                    }
-                    std::string joinGroupStr = "You joined the group " + group_name + '.';
-                    send(socket, joinGroupStr.c_str(), joinGroupStr.length(), 0);
-                }
-            }
-            else if (starts_with(message, "/leave_group"))
-            {
-                size_t space = message.find(' ');
-                if (space != std::string::npos)
-                {
-                    std::string group_name = message.substr(space + 1);
-                    {
-                        std::lock_guard<std::mutex> lock(group_mutex);
-                        if (groups.find(group_name) == groups.end())
-                        {
-                            send(socket, noGroupStr, strlen(noGroupStr), 0);
-                            continue;
-                        }
-                        if (groups[group_name].find(socket) != groups[group_name].end())
-                        {
-                            groups[group_name].erase(socket);
-                        }
-                    }
-                    std::string groupLeftStr = "You left the group " + group_name + '.';
-                    send(socket, groupLeftStr.c_str(), groupLeftStr.length(), 0);
-                }
-            }
-        }
+// Epoll mode: handles one read() worth of input from a logged-in client.
+void chat_input(Connection &conn, const char *data, size_t len)
+{
+    if (!conn.framed)
+        handle_command(conn.fd, std::string_view(data, len));
+    else if (!conn.frames.feed(data, len, [&conn](uint8_t op, std::string_view payload)
+                               { handle_frame(conn.fd, op, payload); }))
+        currentShard->reactor.schedule_close(conn);
+}
+
+// Epoll mode: finishes a login once the password has been checked.
+void login_checked(Connection &conn, bool ok)
+{
+    Reactor &reactor = currentShard->reactor;
+    conn.checking = false;
+    if (!ok)
+    {
+        reactor.send_to(conn.fd, authFailedStr, strlen(authFailedStr));
+        reactor.close_after_flush(conn);
+        return;
+    }
+    reactor.clear_timeout(conn);
+    // Announce before switching state so the newcomer skips its own join message.
+    client_joined(conn.fd, conn.user);
+    conn.state = ConnState::Chatting;
+    reactor.send_to(conn.fd, welcomeStr, strlen(welcomeStr));
+    deliver_missed(conn.fd, conn.user);
+    session_timed_out(conn);
+    // Commands that arrived while the password was being checked.
+    std::vector<std::string> held = std::move(conn.held);
+    conn.held.clear();
+    for (const std::string &input : held)
+    {
+        if (conn.closing)
+            break;
+        chat_input(conn, input.data(), input.size());
     }
 }
 
-// Reads the users.txt file and fills in the validUsers map.
-void parseUserstxt()
+// Epoll mode: advances the login state machine with one read() worth of input,
+// mirroring the two reads of the blocking exchange.
+void login_input(Connection &conn, const char *data, size_t len)
 {
-    std::ifstream file("users.txt");
-    if (!file)
+    Reactor &reactor = currentShard->reactor;
+    if (conn.checking)
     {
-        std::cerr << "users.txt not found!";
-        exit(EXIT_FAILURE);
+        conn.held.emplace_back(data, len);
+        return;
+    }
+    if (conn.state == ConnState::AwaitUser)
+    {
+        // A leading FRAME_MAGIC opts into the framed protocol from the login
+        // result on. The queue picks a message's encoding when it is written,
+        // so the password prompt, which goes out as plain text in every mode,
+        // is queued already in its wire form.
+        static const MessageRef prompt = MessageRef::raw(passStr);
+        conn.framed = (uint8_t)data[0] == FRAME_MAGIC;
+        conn.user.assign(data + conn.framed, len - conn.framed);
+        conn.state = ConnState::AwaitPass;
+        reactor.send_to(conn.fd, prompt);
+        return;
     }
-    std::string userpass;
-    while (std::getline(file, userpass))
+
+    // The check may derive a key, so it runs on a credential thread and the
+    // answer comes back through the shard's mailbox. The connection stays in
+    // AwaitPass, its login deadline still running, until then.
+    conn.checking = true;
+    Shard *shard = currentShard;
+    credentialCheckers->submit([shard, fd = conn.fd, id = conn.id, user = conn.user, pass = std::string(data, len)]
     {
-        int idx = 0, strLen = userpass.length();
-        for (; idx < strLen; idx++)
+        bool ok = check_credentials(user, pass);
+        shard->reactor.post([shard, fd, id, ok]
         {
-            if (userpass[idx] == ':')
-                break;
-        }
-        validUsers[userpass.substr(0, idx)] = userpass.substr(idx + 1);
+            // Dropped if the client timed out or left meanwhile.
+            Connection *conn = shard->reactor.find(fd);
+            if (conn && conn->id == id && !conn->closing)
+                login_checked(*conn, ok);
+        });
+    });
+}
+
+// Epoll mode: the client did not finish logging in before its deadline.
+void login_timed_out(Connection &conn)
+{
+    count_metric(LOGINS_TIMED_OUT);
+    currentShard->reactor.send_to(conn.fd, loginTimeoutStr, strlen(loginTimeoutStr));
+    currentShard->reactor.close_after_flush(conn);
+}
+
+struct OutboundTotals
+{
+    uint64_t depth = 0, dropped = 0, coalesced = 0, disconnected = 0;
+};
+
+// Sums the outbound queue counters over every writer.
+OutboundTotals outbound_totals()
+{
+    std::vector<const OutboundStats *> all;
+    if (shards.empty())
+        all.push_back(&threadOutbound);
+    for (Shard *shard : shards)
+        all.push_back(&shard->reactor.outbound_stats());
+    OutboundTotals totals;
+    for (const OutboundStats *stats : all)
+    {
+        totals.depth += stats->depth.load(std::memory_order_relaxed);
+        totals.dropped += stats->dropped.load(std::memory_order_relaxed);
+        totals.coalesced += stats->coalesced.load(std::memory_order_relaxed);
+        totals.disconnected += stats->disconnected.load(std::memory_order_relaxed);
     }
+    return totals;
 }
 
-int main()
+// Prints the outbound queue counters and the commands refused by each rate
+// limit once per interval.
+void report_outbound(int intervalSec)
 {
-    int new_socket;
-    const char *userStr = "Enter username: ";
-    const char *passStr = "Enter password: ";
-    const char *welcomeStr = "Welcome to the server";
-    const char *authFailedStr = "Authentication Failed";
-    char buffer[BUFFER_SIZE] = {0};
-    int bytesReceived;
-    int server_fd;
-    struct sockaddr_in address;
-    int opt = 1;
-    int addrlen = sizeof(address);
+    while (true)
+    {
+        std::this_thread::sleep_for(std::chrono::seconds(intervalSec));
+        OutboundTotals totals = outbound_totals();
+        std::cout << "Outbound queues: depth " << totals.depth << ", dropped " << totals.dropped << ", coalesced "
+                  << totals.coalesced << ", disconnected " << totals.disconnected << std::endl;
+        ThreadMetrics metrics;
+        metrics_total(metrics);
+        std::cout << "Throttled:";
+        for (int cls = 0; cls < NUM_RATE_CLASSES; cls++)
+            std::cout << (cls ? ", " : " ") << rate_class_name(cls) << ' '
+                      << metrics.counters[THROTTLED_USER + cls].load(std::memory_order_relaxed);
+        std::cout << std::endl;
+    }
+}
 
-    parseUserstxt();
+// The metrics endpoint's response: metrics.h's series plus the outbound
+// queue counters.
+std::string scrape_metrics()
+{
+    return render_metrics([](std::string &out)
+    {
+        OutboundTotals totals = outbound_totals();
+        size_t historyArenas = historyStore ? historyStore->arenas() : 0;
+        // Counted where clients join and leave: a login checked on a
+        // credential thread can still be dropped before the client joins.
+        out += "# HELP chat_users_online Logged-in users.\n"
+               "# TYPE chat_users_online gauge\n"
+               "chat_users_online " + std::to_string(onlineUsers.load(std::memory_order_relaxed)) + "\n";
+        out += "# HELP chat_history_bytes Memory held by group history arenas.\n"
+               "# TYPE chat_history_bytes gauge\n"
+               "chat_history_bytes " + std::to_string(historyArenas * HISTORY_GROUP_BYTES) + "\n";
+        if (tls)
+        {
+            uint64_t handshakes, resumed, failed, offloaded, relayed;
+            tls->totals(handshakes, resumed, failed, offloaded, relayed);
+            out += "# HELP chat_tls_handshakes_total TLS handshakes by result.\n"
+                   "# TYPE chat_tls_handshakes_total counter\n"
+                   "chat_tls_handshakes_total{result=\"full\"} " + std::to_string(handshakes - resumed) + "\n"
+                   "chat_tls_handshakes_total{result=\"resumed\"} " + std::to_string(resumed) + "\n"
+                   "chat_tls_handshakes_total{result=\"failed\"} " + std::to_string(failed) + "\n";
+            out += "# HELP chat_tls_connections_total TLS connections by how their records are handled.\n"
+                   "# TYPE chat_tls_connections_total counter\n"
+                   "chat_tls_connections_total{mode=\"ktls\"} " + std::to_string(offloaded) + "\n"
+                   "chat_tls_connections_total{mode=\"relay\"} " + std::to_string(relayed) + "\n";
+        }
+        out += "# HELP chat_outbound_queued_messages Messages waiting in per-connection output queues.\n"
+               "# TYPE chat_outbound_queued_messages gauge\n"
+               "chat_outbound_queued_messages " + std::to_string(totals.depth) + "\n";
+        out += "# HELP chat_outbound_overflows_total Output queue overflows by the action taken.\n"
+               "# TYPE chat_outbound_overflows_total counter\n"
+               "chat_outbound_overflows_total{action=\"dropped\"} " + std::to_string(totals.dropped) + "\n"
+               "chat_outbound_overflows_total{action=\"coalesced\"} " + std::to_string(totals.coalesced) + "\n"
+               "chat_outbound_overflows_total{action=\"disconnected\"} " + std::to_string(totals.disconnected) + "\n";
+    });
+}
 
-    // Create socket file descriptor
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0)
+// Prints command line usage.
+void usage(const char *prog)
+{
+    std::cerr << "Usage: " << prog << " [--mode threads|epoll|uring] [--reactors N] [--login-timeout SECONDS]\n"
+              << "       [--queue-limit MESSAGES] [--queue-bytes BYTES]\n"
+              << "       [--overflow drop-oldest|disconnect|coalesce] [--stats-interval SECONDS]\n"
+              << "       [--credentials INDEX] [--auth-threads N] [--metrics-port PORT] [--message-log DIR]\n"
+              << "       [--group-registry DIR] [--history MESSAGES] [--history-bytes BYTES]\n"
+              << "       [--port PORT] [--cluster HOST:PORT --peers HOST:PORT,...]\n"
+              << "       [--rate-limits FILE] [--tls-cert FILE --tls-key FILE] [--tls-threads N]\n"
+              << "       [--heartbeat SECONDS] [--idle-timeout SECONDS]\n"
+              << "       [--compress] [--compress-dict FILE] [--compress-min BYTES]\n"
+              << "  threads  one thread per client (default)\n"
+              << "  epoll    clients sharded across N epoll event loops (default: one per CPU)\n"
+              << "  uring    like epoll, but the event loops use io_uring; falls back to epoll\n"
+              << "           on kernels without multishot receive\n"
+              << "  --auth-threads  threads checking passwords in epoll and uring modes\n"
+              << "                  (default: one per CPU)\n"
+              << "  --cluster  this node's address for its peers, exactly as they list it in --peers\n"
+              << "  --tls-cert clients must connect with TLS, handshaking on --tls-threads threads\n"
+              << "             (default: one per CPU)\n"
+              << "  --heartbeat     ping framed clients quiet this long, dropping those that do not\n"
+              << "                  answer within as long again (default 30, 0 disables)\n"
+              << "  --idle-timeout  drop clients that send nothing for this long (default 0: never)\n"
+              << "  --compress      deflate messages of at least --compress-min bytes (default "
+              << COMPRESS_MIN_BYTES << ")\n"
+              << "                  for framed clients that ask; --compress-dict primes it with a\n"
+              << "                  dictionary the clients must share\n";
+}
+
+// Sets up TLS from a certificate chain and key, or exits if they are unusable.
+// ready receives each client whose handshake is done.
+void start_tls(const std::string &certFile, const std::string &keyFile, int threads, std::function<void(int)> ready)
+{
+    std::string error;
+    SSL_CTX *ctx = tls_server_context(certFile, keyFile, error);
+    if (!ctx)
     {
-        perror("Socket failed");
+        std::cerr << "TLS: " << error << std::endl;
         exit(EXIT_FAILURE);
     }
+    // A client that vanishes mid-write must not kill the server.
+    signal(SIGPIPE, SIG_IGN);
+    tls = std::make_unique<TlsTerminator>(ctx, threads, std::move(ready));
+}
 
-    // Set socket options (macOS compatible)
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)))
+// Links this node to its peers, or exits if an address is unusable. Call once
+// the per-socket tables and shards exist, since peers' frames use them.
+void start_cluster(const std::string &self, const std::vector<std::string> &peers)
+{
+    ClusterHandlers handlers;
+    handlers.snapshot = cluster_snapshot;
+    handlers.peer_reset = cluster_peer_reset;
+    handlers.on_frame = cluster_frame;
+    std::string error;
+    cluster = Cluster::start(self, peers, std::move(handlers), error);
+    if (!cluster)
     {
-        perror("setsockopt");
+        std::cerr << "Cluster: " << error << std::endl;
         exit(EXIT_FAILURE);
     }
+    std::cout << "Cluster node " << self << " with " << peers.size() << " peers." << std::endl;
+}
 
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT);
+#ifndef CHAT_SERVER_NO_MAIN // dispatch_bench.cpp brings its own
+int main(int argc, char *argv[])
+{
+    bool epollMode = false;
+    ReactorBackend backend = ReactorBackend::Epoll;
+    int numReactors = std::max(1u, std::thread::hardware_concurrency());
+    int statsInterval = 0;
+    int metricsPort = 0;
+    std::string messageLogDir;
+    std::string registryDir;
+    long historyMessages = HISTORY_MESSAGES;
+    long historyBytes = HISTORY_TOTAL_BYTES;
+    std::string clusterAddress;
+    std::vector<std::string> clusterPeers;
+    std::string tlsCert, tlsKey;
+    int tlsThreads = std::max(1u, std::thread::hardware_concurrency());
+    int authThreads = std::max(1u, std::thread::hardware_concurrency());
 
-    // Bind the socket to the address
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    for (int i = 1; i < argc; i++)
     {
-        perror("Bind failed");
-        exit(EXIT_FAILURE);
+        std::string arg = argv[i];
+        if (arg == "--mode" && i + 1 < argc)
+        {
+            std::string mode = argv[++i];
+            if (mode == "epoll")
+                epollMode = true;
+            else if (mode == "uring")
+            {
+                epollMode = true;
+                backend = ReactorBackend::Uring;
+            }
+            else if (mode != "threads")
+            {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (arg == "--login-timeout" && i + 1 < argc)
+        {
+            loginTimeoutMs = atoi(argv[++i]) * 1000;
+            if (loginTimeoutMs <= 0)
+            {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if ((arg == "--heartbeat" || arg == "--idle-timeout") && i + 1 < argc)
+        {
+            int ms = atoi(argv[++i]) * 1000;
+            if (ms < 0)
+            {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            (arg == "--heartbeat" ? heartbeatMs : idleTimeoutMs) = ms;
+        }
+        else if (arg == "--reactors" && i + 1 < argc)
+        {
+            numReactors = atoi(argv[++i]);
+            if (numReactors < 1)
+            {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (arg == "--queue-limit" && i + 1 < argc)
+        {
+            long limit = atol(argv[++i]);
+            if (limit < 1)
+            {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            outboundLimits.maxMessages = limit;
+        }
+        else if (arg == "--queue-bytes" && i + 1 < argc)
+        {
+            long limit = atol(argv[++i]);
+            if (limit < 1)
+            {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            outboundLimits.maxBytes = limit;
+        }
+        else if (arg == "--overflow" && i + 1 < argc)
+        {
+            if (!parse_overflow_policy(argv[++i], outboundLimits.policy))
+            {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (arg == "--credentials" && i + 1 < argc)
+            credentialsPath = argv[++i];
+        else if (arg == "--tls-cert" && i + 1 < argc)
+            tlsCert = argv[++i];
+        else if (arg == "--tls-key" && i + 1 < argc)
+            tlsKey = argv[++i];
+        else if (arg == "--tls-threads" && i + 1 < argc)
+        {
+            tlsThreads = atoi(argv[++i]);
+            if (tlsThreads < 1)
+            {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (arg == "--auth-threads" && i + 1 < argc)
+        {
+            authThreads = atoi(argv[++i]);
+            if (authThreads < 1)
+            {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (arg == "--rate-limits" && i + 1 < argc)
+            rateLimitsPath = argv[++i];
+        else if (arg == "--compress")
+            compressEnabled = true;
+        else if (arg == "--compress-dict" && i + 1 < argc)
+        {
+            compressEnabled = true;
+            std::string error;
+            if (!load_dictionary(argv[++i], compressDict, error))
+            {
+                std::cerr << "Compression: " << error << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            compressDictId = dictionary_id(compressDict);
+        }
+        else if (arg == "--compress-min" && i + 1 < argc)
+        {
+            long minBytes = atol(argv[++i]);
+            if (minBytes < 1)
+            {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            compressMinBytes = minBytes;
+        }
+        else if (arg == "--message-log" && i + 1 < argc)
+            messageLogDir = argv[++i];
+        else if (arg == "--group-registry" && i + 1 < argc)
+            registryDir = argv[++i];
+        else if (arg == "--history" && i + 1 < argc)
+        {
+            historyMessages = atol(argv[++i]);
+            if (historyMessages < 0 || historyMessages > HISTORY_MAX_MESSAGES)
+            {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (arg == "--history-bytes" && i + 1 < argc)
+        {
+            historyBytes = atol(argv[++i]);
+            if (historyBytes < 0)
+            {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (arg == "--port" && i + 1 < argc)
+        {
+            clientPort = atoi(argv[++i]);
+            if (clientPort < 1 || clientPort > 65535)
+            {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (arg == "--cluster" && i + 1 < argc)
+            clusterAddress = argv[++i];
+        else if (arg == "--peers" && i + 1 < argc)
+        {
+            std::stringstream list(argv[++i]);
+            std::string peer;
+            while (std::getline(list, peer, ','))
+            {
+                if (!peer.empty())
+                    clusterPeers.push_back(peer);
+            }
+        }
+        else if (arg == "--metrics-port" && i + 1 < argc)
+        {
+            metricsPort = atoi(argv[++i]);
+            if (metricsPort < 1 || metricsPort > 65535)
+            {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (arg == "--stats-interval" && i + 1 < argc)
+        {
+            statsInterval = atoi(argv[++i]);
+            if (statsInterval < 1)
+            {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else
+        {
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
     }
-
-    // Listen for incoming connections
-    if (listen(server_fd, 3) < 0)
+    if (clusterAddress.empty() != clusterPeers.empty() || tlsCert.empty() != tlsKey.empty())
     {
-        perror("Listen");
+        usage(argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    while (true)
+    // SIGHUP reloads the credentials and rate limits. Block it before any thread starts so
+    // only the reload thread ever receives it.
+    sigset_t reloadSignals;
+    sigemptyset(&reloadSignals);
+    sigaddset(&reloadSignals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &reloadSignals, nullptr);
+    std::shared_ptr<const CredentialStore> store = load_credentials();
+    if (!store)
+        exit(EXIT_FAILURE);
+    credentials.store(store);
+    if (!load_rate_limits())
+        exit(EXIT_FAILURE);
+    std::thread(reload_loop).detach();
+    if (!messageLogDir.empty())
     {
-        if ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen)) < 0)
+        std::string error;
+        messageLog = MessageLog::open(messageLogDir, error);
+        if (!messageLog)
         {
-            perror("Accept");
+            std::cerr << "Message log: " << error << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (!registryDir.empty())
+    {
+        std::string error;
+        auto start = std::chrono::steady_clock::now();
+        registry = GroupRegistry::open(registryDir, error);
+        if (!registry)
+        {
+            std::cerr << "Group registry: " << error << std::endl;
             exit(EXIT_FAILURE);
         }
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Loaded " << registry->size() << " groups in " << secs << " s." << std::endl;
+    }
+    if (historyMessages > 0 && historyBytes >= HISTORY_GROUP_BYTES)
+        historyStore = std::make_unique<HistoryStore>(historyMessages, historyBytes);
 
-        send(new_socket, userStr, strlen(userStr), 0);
-        bytesReceived = read(new_socket, buffer, BUFFER_SIZE);
-        std::string user(buffer, bytesReceived);
+    // Allow as many descriptors as the hard limit permits; the per-socket
+    // tables are sized to match.
+    struct rlimit lim;
+    getrlimit(RLIMIT_NOFILE, &lim);
+    lim.rlim_cur = std::min<rlim_t>(lim.rlim_max, MAX_SOCKETS);
+    setrlimit(RLIMIT_NOFILE, &lim);
+    getrlimit(RLIMIT_NOFILE, &lim);
 
-        send(new_socket, passStr, strlen(passStr), 0);
-        bytesReceived = read(new_socket, buffer, BUFFER_SIZE);
-        std::string pass(buffer, bytesReceived);
+    socketUser = std::vector<std::atomic<uint32_t>>(lim.rlim_cur);
+    for (auto &user : socketUser)
+        user.store(NO_SYMBOL, std::memory_order_relaxed);
+    if (compressEnabled)
+        socketCompressed = std::vector<std::atomic<bool>>(lim.rlim_cur);
 
-        if (validUsers.find(user) != validUsers.end() && validUsers[user] == pass)
+    if (!epollMode)
+    {
+        socketFramed = std::vector<std::atomic<bool>>(lim.rlim_cur);
+        socketOutput.resize(lim.rlim_cur);
+        outputEpoll = epoll_create1(EPOLL_CLOEXEC);
+        if (outputEpoll < 0)
+        {
+            perror("epoll");
+            exit(EXIT_FAILURE);
+        }
+        std::thread(output_loop).detach();
+        if (heartbeatMs > 0 || idleTimeoutMs > 0)
         {
-            std::string newUserStr = user + " has joined the chat.";
-            broadcast(-1, newUserStr);
+            sessionTimers = std::make_unique<TimerWheel<SessionTimer>>(1, monotonic_ms());
+            socketTimer.resize(lim.rlim_cur);
+            std::thread(session_timer_loop).detach();
+        }
+        if (statsInterval > 0)
+            std::thread(report_outbound, statsInterval).detach();
+        if (metricsPort > 0)
+            std::thread(serve_metrics, metricsPort, scrape_metrics).detach();
+        if (!clusterAddress.empty())
+            start_cluster(clusterAddress, clusterPeers);
+        if (!tlsCert.empty())
+            start_tls(tlsCert, tlsKey, tlsThreads, session_started);
+        int server_fd = create_listener(false);
+        accept_loop(server_fd);
+        close(server_fd);
+        return 0;
+    }
 
-            // Protect client maps while adding a new client.
-            {
-                std::lock_guard<std::mutex> lock(client_mutex);
-                socketsUser[new_socket] = user;
-                userSockets[user] = new_socket;
-            }
+    std::string why;
+    if (backend == ReactorBackend::Uring && !uring_supported(why))
+    {
+        std::cerr << "io_uring unavailable (" << why << "), falling back to epoll." << std::endl;
+        backend = ReactorBackend::Epoll;
+    }
 
-            send(new_socket, welcomeStr, strlen(welcomeStr), 0);
-            // Start a thread to handle this client's requests.
-            std::thread new_client_thread(handle_client_requests, new_socket);
-            new_client_thread.detach();
-        }
+    socketShard = std::vector<std::atomic<int>>(lim.rlim_cur);
+    for (auto &owner : socketShard)
+        owner.store(-1, std::memory_order_relaxed);
+    socketConn = std::vector<std::atomic<uint64_t>>(lim.rlim_cur);
+    credentialCheckers = std::make_unique<CredentialCheckers>(authThreads);
+
+    // One shard per reactor thread, each accepting on its own SO_REUSEPORT
+    // listener so login storms are spread across all of them. Logins are
+    // driven by the event loop, so a slow client only costs its own buffers.
+    ReactorHandlers handlers;
+    handlers.on_accept = login_started;
+    handlers.on_message = [](Connection &conn, const char *data, size_t len)
+    {
+        if (conn.state != ConnState::Chatting)
+            login_input(conn, data, len);
+        else
+            chat_input(conn, data, len);
+    };
+    handlers.on_timeout = [](Connection &conn)
+    {
+        if (conn.state == ConnState::Chatting)
+            session_timed_out(conn);
         else
+            login_timed_out(conn);
+    };
+    handlers.on_close = [](Connection &conn)
+    {
+        if (conn.state == ConnState::Chatting)
+            client_disconnected(conn.fd);
+        socketShard[conn.fd].store(-1, std::memory_order_release);
+        count_metric(CONNECTIONS_CLOSED);
+    };
+    for (int i = 0; i < numReactors; i++)
+    {
+        Shard *shard = new Shard{i, Reactor(BUFFER_SIZE, outboundLimits, handlers, backend), {}};
+        if (tlsCert.empty())
+            shard->reactor.add_listener(create_listener(true));
+        shards.push_back(shard);
+    }
+    // With TLS the shards only see clients once their handshakes are done,
+    // so one thread accepts for the TLS workers instead.
+    if (!tlsCert.empty())
+    {
+        start_tls(tlsCert, tlsKey, tlsThreads, tls_client_ready);
+        std::thread(accept_loop, create_listener(false)).detach();
+    }
+    if (statsInterval > 0)
+        std::thread(report_outbound, statsInterval).detach();
+    if (metricsPort > 0)
+        std::thread(serve_metrics, metricsPort, scrape_metrics).detach();
+    if (!clusterAddress.empty())
+        start_cluster(clusterAddress, clusterPeers);
+    std::vector<std::thread> threads;
+    for (Shard *shard : shards)
+    {
+        threads.emplace_back([shard]
         {
-            send(new_socket, authFailedStr, strlen(authFailedStr), 0);
-            close(new_socket);
-        }
+            currentShard = shard;
+            shard->reactor.run();
+        });
     }
-    close(server_fd);
+    for (auto &thread : threads)
+        thread.join();
 
     return 0;
 }
+#endif
@@ -0,0 +1,126 @@
+// Read-copy-update containers for state that is read on every message but
+// changes only on login, logout and group membership changes.
+//
+// Readers take the current version with one atomic shared_ptr load and then
+// use it without any lock; the version stays alive for as long as a reader
+// holds it. Writers copy the current version, modify the copy and publish it
+// with an atomic store. Writers must be serialized by the caller, which is
+// what client_mutex and group_mutex are now for.
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+template <typename T>
+class Snapshot
+{
+public:
+    Snapshot() : current(std::make_shared<const T>()) {}
+
+    Snapshot(const Snapshot &) = delete;
+    Snapshot &operator=(const Snapshot &) = delete;
+
+    std::shared_ptr<const T> load() const { return current.load(std::memory_order_acquire); }
+
+    // Publishes a modified copy of the current version. Writers only.
+    template <typename Fn>
+    void update(Fn &&modify)
+    {
+        auto next = std::make_shared<T>(*current.load(std::memory_order_relaxed));
+        modify(*next);
+        current.store(std::move(next), std::memory_order_release);
+    }
+
+private:
+    std::atomic<std::shared_ptr<const T>> current;
+};
+
+// Hashes keys for SnapshotMap. String keys can be looked up by string_view,
+// so a name parsed out of a receive buffer needs no std::string to find.
+template <typename K>
+struct SnapshotHash : std::hash<K>
+{
+};
+
+template <>
+struct SnapshotHash<std::string>
+{
+    using is_transparent = void;
+    size_t operator()(std::string_view key) const { return std::hash<std::string_view>()(key); }
+};
+
+// A hash map split into independently published buckets, so an update copies
+// one bucket instead of the whole map. Readers see each bucket atomically but
+// not the map as a whole, which is all the chat directories need.
+template <typename K, typename V, size_t Buckets = 64>
+class SnapshotMap
+{
+public:
+    using Bucket = std::unordered_map<K, V, SnapshotHash<K>, std::equal_to<>>;
+
+    // Copies the value for key into out. Returns false if there is none.
+    template <typename Key>
+    bool find(const Key &key, V &out) const
+    {
+        return visit(key, [&](const V &value) { out = value; });
+    }
+
+    // Calls fn(value) on the value for key without copying it. Returns false
+    // if there is none.
+    template <typename Key, typename Fn>
+    bool visit(const Key &key, Fn &&fn) const
+    {
+        auto bucket = bucket_for(key).load();
+        auto it = bucket->find(key);
+        if (it == bucket->end())
+            return false;
+        fn(it->second);
+        return true;
+    }
+
+    template <typename Key>
+    bool contains(const Key &key) const
+    {
+        auto bucket = bucket_for(key).load();
+        return bucket->find(key) != bucket->end();
+    }
+
+    // Calls fn(key, value) on every entry, one bucket version at a time.
+    template <typename Fn>
+    void for_each(Fn &&fn) const
+    {
+        for (const Snapshot<Bucket> &bucket : buckets)
+        {
+            auto entries = bucket.load();
+            for (const auto &[key, value] : *entries)
+                fn(key, value);
+        }
+    }
+
+    // Writers only.
+    void assign(const K &key, V value)
+    {
+        bucket_for(key).update([&](Bucket &entries) { entries[key] = std::move(value); });
+    }
+
+    // Writers only.
+    void erase(const K &key)
+    {
+        Snapshot<Bucket> &bucket = bucket_for(key);
+        if (bucket.load()->count(key))
+            bucket.update([&](Bucket &entries) { entries.erase(key); });
+    }
+
+private:
+    template <typename Key>
+    Snapshot<Bucket> &bucket_for(const Key &key) { return buckets[SnapshotHash<K>()(key) % Buckets]; }
+    template <typename Key>
+    const Snapshot<Bucket> &bucket_for(const Key &key) const { return buckets[SnapshotHash<K>()(key) % Buckets]; }
+
+    Snapshot<Bucket> buckets[Buckets];
+};
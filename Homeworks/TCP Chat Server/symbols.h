@@ -0,0 +1,168 @@
+// Dense 32-bit IDs for user and group names, and tables indexed by them.
+//
+// The protocol names users and groups, so each command looks a name up once;
+// everything after that uses its ID, and per-user and per-group state lives in
+// DenseTables instead of hash maps keyed by strings. Names are interned at
+// login and group creation and never forgotten, so an ID, and the string_view
+// name() returns for it, stay valid for the life of the server.
+//
+// Lookups never lock and may run alongside interning. Tables only grow: a
+// SymbolTable's index is rebuilt into a larger one and published atomically,
+// and a DenseTable adds chunks without moving existing elements.
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stdexcept>
+#include <cstdint>
+
+#define NO_SYMBOL UINT32_MAX
+#define DENSE_CHUNK_BITS 12   // elements per DenseTable chunk: 4096
+#define DENSE_MAX_CHUNKS 4096 // so at most 16M IDs
+
+// An array indexed by ID, allocated a chunk at a time. Elements are
+// default-constructed with their chunk and never move; at() is for writers,
+// get() may be called by any thread.
+template <typename T>
+class DenseTable
+{
+public:
+    DenseTable() = default;
+    DenseTable(const DenseTable &) = delete;
+    DenseTable &operator=(const DenseTable &) = delete;
+
+    ~DenseTable()
+    {
+        for (std::atomic<T *> &chunk : chunks)
+            delete[] chunk.load(std::memory_order_relaxed);
+    }
+
+    // The element for id, allocating its chunk first if needed. Callers that
+    // may allocate must be serialized.
+    T &at(uint32_t id)
+    {
+        std::atomic<T *> &slot = chunks[id >> DENSE_CHUNK_BITS];
+        T *chunk = slot.load(std::memory_order_acquire);
+        if (!chunk)
+        {
+            chunk = new T[1 << DENSE_CHUNK_BITS]();
+            slot.store(chunk, std::memory_order_release);
+        }
+        return chunk[id & ((1 << DENSE_CHUNK_BITS) - 1)];
+    }
+
+    // The element for id, or nullptr if it was never allocated.
+    T *get(uint32_t id) const
+    {
+        if (id >= (uint32_t)DENSE_MAX_CHUNKS << DENSE_CHUNK_BITS)
+            return nullptr;
+        T *chunk = chunks[id >> DENSE_CHUNK_BITS].load(std::memory_order_acquire);
+        return chunk ? &chunk[id & ((1 << DENSE_CHUNK_BITS) - 1)] : nullptr;
+    }
+
+private:
+    std::atomic<T *> chunks[DENSE_MAX_CHUNKS] = {};
+};
+
+// Interns names into IDs numbered from 0 in order of first appearance.
+class SymbolTable
+{
+public:
+    SymbolTable() : index(new Index(1024)) {}
+    SymbolTable(const SymbolTable &) = delete;
+    SymbolTable &operator=(const SymbolTable &) = delete;
+
+    ~SymbolTable() { delete index.load(std::memory_order_relaxed); }
+
+    // The ID of name, or NO_SYMBOL if it was never interned.
+    uint32_t find(std::string_view name) const
+    {
+        uint32_t hash = hash_of(name);
+        const Index *current = index.load(std::memory_order_acquire);
+        for (uint32_t i = hash & current->mask;; i = (i + 1) & current->mask)
+        {
+            uint64_t slot = current->slots[i].load(std::memory_order_acquire);
+            if (slot == 0)
+                return NO_SYMBOL;
+            uint32_t id = (uint32_t)slot - 1;
+            if ((uint32_t)(slot >> 32) == hash && *names.get(id) == name)
+                return id;
+        }
+    }
+
+    // The ID of name, interning it if it is new.
+    uint32_t intern(std::string_view name)
+    {
+        uint32_t id = find(name);
+        if (id != NO_SYMBOL)
+            return id;
+        std::lock_guard<std::mutex> lock(mutex);
+        id = find(name); // interned by another thread meanwhile?
+        if (id != NO_SYMBOL)
+            return id;
+        if (count == (uint32_t)DENSE_MAX_CHUNKS << DENSE_CHUNK_BITS)
+            throw std::length_error("too many names");
+        id = count;
+        names.at(id) = name;
+        Index *current = index.load(std::memory_order_relaxed);
+        if ((count + 1) * 10 > (current->mask + 1) * 7)
+            current = grow(current);
+        insert(current, hash_of(name), id);
+        count++;
+        published.store(count, std::memory_order_release);
+        return id;
+    }
+
+    // The name with this ID, which must have been returned by intern().
+    std::string_view name(uint32_t id) const { return *names.get(id); }
+
+    // Number of names interned; IDs run from 0 to size() - 1.
+    uint32_t size() const { return published.load(std::memory_order_acquire); }
+
+private:
+    // Open-addressing table of (hash << 32 | id + 1) slots, 0 when empty.
+    struct Index
+    {
+        explicit Index(size_t capacity) : mask(capacity - 1), slots(new std::atomic<uint64_t>[capacity]()) {}
+        uint32_t mask;
+        std::unique_ptr<std::atomic<uint64_t>[]> slots;
+    };
+
+    static uint32_t hash_of(std::string_view name) { return (uint32_t)std::hash<std::string_view>()(name); }
+
+    static void insert(Index *target, uint32_t hash, uint32_t id)
+    {
+        uint32_t i = hash & target->mask;
+        while (target->slots[i].load(std::memory_order_relaxed) != 0)
+            i = (i + 1) & target->mask;
+        target->slots[i].store((uint64_t)hash << 32 | (id + 1), std::memory_order_release);
+    }
+
+    // Publishes a copy of current at twice the size. Readers may still be
+    // probing the old index, so it is retired rather than freed.
+    Index *grow(Index *current)
+    {
+        Index *bigger = new Index(((size_t)current->mask + 1) * 2);
+        for (size_t i = 0; i <= current->mask; i++)
+        {
+            uint64_t slot = current->slots[i].load(std::memory_order_relaxed);
+            if (slot != 0)
+                insert(bigger, (uint32_t)(slot >> 32), (uint32_t)slot - 1);
+        }
+        index.store(bigger, std::memory_order_release);
+        retired.emplace_back(current);
+        return bigger;
+    }
+
+    std::mutex mutex; // serializes intern()
+    std::atomic<Index *> index;
+    std::vector<std::unique_ptr<Index>> retired; // old indexes, which together take less than the current one
+    DenseTable<std::string> names;
+    uint32_t count = 0;                 // IDs handed out, under mutex
+    std::atomic<uint32_t> published{0}; // count, for readers
+};
@@ -0,0 +1,200 @@
+// Hierarchical timing wheel for per-connection deadlines.
+//
+// TIMER_WHEEL_LEVELS wheels of TIMER_WHEEL_SLOTS slots each: a slot of level k
+// covers TIMER_WHEEL_SLOTS^k ticks, so level 0 holds the timers due within one
+// revolution tick by tick and each level above holds coarser and coarser ones.
+// A timer sits in a doubly linked list threaded through the node its owner
+// embeds, so scheduling and cancelling are O(1) and never allocate, however
+// many timers there are. When time reaches the start of a higher slot, that
+// slot's timers are re-filed into the finer levels below ("cascading"), each
+// timer moving down at most once per level.
+//
+// Every level keeps a bitmap of its occupied slots, so advancing the wheel
+// jumps straight to the next tick with work instead of visiting every tick,
+// and next_due() tells an event loop exactly how long it may sleep.
+//
+// Timers due further out than the wheel spans are parked in its last slot and
+// re-filed when it comes around. Single-threaded: callers serialise access.
+
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <algorithm>
+
+#define TIMER_WHEEL_BITS 6                          // log2 of the slots per level
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 5                        // 2^30 ticks, 12 days of milliseconds
+
+// A timer, embedded in whatever it belongs to.
+template <typename T>
+struct TimerNode
+{
+    T *owner = nullptr;
+    TimerNode *prev = nullptr; // in a slot's list, null while not scheduled
+    TimerNode *next = nullptr;
+    int64_t expires = 0;       // tick at which the timer fires
+    uint16_t slot = 0;         // level * TIMER_WHEEL_SLOTS + index of the slot it is in
+
+    bool scheduled() const { return prev != nullptr; }
+};
+
+template <typename T>
+class TimerWheel
+{
+public:
+    typedef TimerNode<T> Node;
+
+    // Ticks are tickMs long; now is the current time in the same milliseconds
+    // that schedule() and advance() are given.
+    TimerWheel(int64_t tickMs, int64_t now) : tickMs(tickMs), current(now / tickMs)
+    {
+        for (Node &head : slots)
+            head.prev = head.next = &head;
+    }
+
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    // Fires node at time at (ms), replacing any earlier schedule. A time in
+    // the past fires at the next advance().
+    void schedule(Node &node, int64_t at)
+    {
+        cancel(node);
+        node.expires = std::max((at + tickMs - 1) / tickMs, current);
+        file(node);
+        count++;
+    }
+
+    void cancel(Node &node)
+    {
+        if (!node.scheduled())
+            return;
+        unlink(node);
+        count--;
+    }
+
+    size_t size() const { return count; }
+
+    // Calls fire(owner) for every timer due at or before now, in order of
+    // their ticks. fire may schedule and cancel timers, including its own.
+    template <typename Fn>
+    void advance(int64_t now, Fn &&fire)
+    {
+        int64_t target = now / tickMs;
+        while (count > 0)
+        {
+            int64_t tick = next_tick();
+            if (tick > target)
+                break;
+            current = tick;
+            // Higher levels first, so a timer can fall through several levels
+            // to the slot it is due in.
+            for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--)
+            {
+                if ((current & block_mask(level)) == 0)
+                    cascade(level, index(current, level));
+            }
+            Node &head = slots[index(current, 0)];
+            while (head.next != &head)
+            {
+                Node &node = *head.next;
+                unlink(node);
+                count--;
+                fire(*node.owner);
+            }
+            current++;
+        }
+        current = std::max(current, target);
+    }
+
+    // Milliseconds from now until the next timer may be due, 0 if one is
+    // overdue, -1 if none is scheduled.
+    int64_t next_due(int64_t now) const
+    {
+        if (count == 0)
+            return -1;
+        return std::max<int64_t>(0, next_tick() * tickMs - now);
+    }
+
+private:
+    static int index(int64_t tick, int level) { return (tick >> (level * TIMER_WHEEL_BITS)) & (TIMER_WHEEL_SLOTS - 1); }
+
+    // The tick bits below a slot of level.
+    static int64_t block_mask(int level) { return ((int64_t)1 << (level * TIMER_WHEEL_BITS)) - 1; }
+
+    // Puts a node into the slot for its expiry, relative to the current tick.
+    void file(Node &node)
+    {
+        int64_t delta = node.expires - current;
+        int level = 0;
+        while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (int64_t)1 << ((level + 1) * TIMER_WHEEL_BITS))
+            level++;
+        // Beyond the wheel's span: wait in the furthest slot, then be re-filed.
+        int64_t at = std::min(node.expires, current + ((int64_t)1 << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS)) - 1);
+        int slot = level * TIMER_WHEEL_SLOTS + index(at, level);
+        Node &head = slots[slot];
+        node.slot = slot;
+        node.prev = head.prev;
+        node.next = &head;
+        head.prev->next = &node;
+        head.prev = &node;
+        occupied[level] |= (uint64_t)1 << (slot % TIMER_WHEEL_SLOTS);
+    }
+
+    void unlink(Node &node)
+    {
+        node.prev->next = node.next;
+        node.next->prev = node.prev;
+        Node &head = slots[node.slot];
+        if (head.next == &head)
+            occupied[node.slot / TIMER_WHEEL_SLOTS] &= ~((uint64_t)1 << (node.slot % TIMER_WHEEL_SLOTS));
+        node.prev = node.next = nullptr;
+    }
+
+    // Re-files the timers of one slot of a higher level into the levels below.
+    void cascade(int level, int idx)
+    {
+        Node &head = slots[level * TIMER_WHEEL_SLOTS + idx];
+        if (head.next == &head)
+            return;
+        // Detach the whole list first: re-filing may put nodes back in this slot.
+        Node *first = head.next, *last = head.prev;
+        head.prev = head.next = &head;
+        occupied[level] &= ~((uint64_t)1 << idx);
+        last->next = nullptr;
+        for (Node *node = first; node;)
+        {
+            Node *next = node->next;
+            file(*node);
+            node = next;
+        }
+    }
+
+    // The earliest tick, from the current one on, at which a slot fires or
+    // cascades. Only valid while timers are scheduled.
+    int64_t next_tick() const
+    {
+        int64_t best = INT64_MAX;
+        for (int level = 0; level < TIMER_WHEEL_LEVELS; level++)
+        {
+            if (!occupied[level])
+                continue;
+            int shift = level * TIMER_WHEEL_BITS;
+            // A slot whose span has begun was cascaded when it began, unless
+            // that is the current tick, still to be processed; level 0 slots
+            // span one tick, so its current one is always still due.
+            int started = (current & block_mask(level)) != 0;
+            int from = (index(current, level) + started) % TIMER_WHEEL_SLOTS;
+            int ahead = std::countr_zero(std::rotr(occupied[level], from));
+            best = std::min(best, ((current >> shift) + started + ahead) << shift);
+        }
+        return best;
+    }
+
+    int64_t tickMs;
+    int64_t current; // the next tick to process; every earlier one is done
+    size_t count = 0;
+    uint64_t occupied[TIMER_WHEEL_LEVELS] = {};
+    Node slots[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS];
+};
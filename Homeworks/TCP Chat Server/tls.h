@@ -0,0 +1,555 @@
+// TLS for chat connections, with OpenSSL 3.
+//
+// The chat code never sees TLS. Accepted sockets go to a pool of TLS worker
+// threads, each running its own epoll loop, which drive the handshakes without
+// blocking, so a flood of new connections costs the event loops nothing. Once
+// a handshake completes, the worker hands the chat code a descriptor to use
+// like any accepted socket:
+//
+//   - With kernel TLS (kTLS) enabled in both directions, the socket itself.
+//     The kernel encrypts what the server writes and decrypts what it reads,
+//     so gathering writes of shared messages stay zero-copy after the
+//     handshake and the worker is done with the connection.
+//   - Otherwise, one end of a Unix socketpair. The worker keeps the other end
+//     and relays between it and the TLS session: records it reads from the
+//     client are decrypted onto the pair, and what the server writes to the
+//     pair is encrypted to the client.
+//
+// kTLS needs the kernel's "tls" module and a cipher and protocol version that
+// both the kernel and OpenSSL can offload; OpenSSL 3.0 offloads receiving only
+// for TLS 1.2. The relay works everywhere.
+//
+// Sessions resume through stateless tickets, so a reconnecting client skips
+// the key exchange and certificate check and the server keeps no per-session
+// state. Ticket keys are made when the context is, so tickets last as long as
+// the server process.
+//
+// Connections are identified to a worker by descriptor, both the client's
+// socket and its end of the pair, and the worker closes both when either side
+// finishes. A handshake must complete within TLS_HANDSHAKE_MS.
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <deque>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <functional>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include "mailbox.h"
+
+#define TLS_RECORD_SIZE 16384    // largest TLS record payload
+#define TLS_HANDSHAKE_MS 10000   // time allowed to complete a handshake
+#define TLS_MAX_EVENTS 256
+#define TLS_IO_BUDGET 16         // records moved per direction before yielding to other connections
+
+// The reason for the last OpenSSL failure on this thread.
+inline std::string tls_error()
+{
+    unsigned long code = ERR_get_error();
+    char text[256];
+    ERR_error_string_n(code, text, sizeof(text));
+    ERR_clear_error();
+    return code ? text : "unknown TLS error";
+}
+
+// A server context presenting the certificate chain in certFile with the
+// private key in keyFile. Returns nullptr with the reason in error on failure.
+inline SSL_CTX *tls_server_context(const std::string &certFile, const std::string &keyFile, std::string &error)
+{
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx)
+    {
+        error = tls_error();
+        return nullptr;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    // kTLS where the kernel supports it; partial writes let the relay hand
+    // OpenSSL whatever the server wrote without waiting for whole records.
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    // Resumption by ticket only: nothing is cached, so handshakes on
+    // different workers never share a lock.
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_num_tickets(ctx, 1);
+    if (SSL_CTX_use_certificate_chain_file(ctx, certFile.c_str()) != 1)
+        error = certFile + ": " + tls_error();
+    else if (SSL_CTX_use_PrivateKey_file(ctx, keyFile.c_str(), SSL_FILETYPE_PEM) != 1)
+        error = keyFile + ": " + tls_error();
+    else if (SSL_CTX_check_private_key(ctx) != 1)
+        error = keyFile + ": " + tls_error();
+    else
+        return ctx;
+    SSL_CTX_free(ctx);
+    return nullptr;
+}
+
+// Counters of one worker. Written by the worker only.
+struct TlsStats
+{
+    std::atomic<uint64_t> handshakes{0}; // completed
+    std::atomic<uint64_t> resumed{0};    // of those, resumed from a ticket
+    std::atomic<uint64_t> failed{0};     // failed or timed out
+    std::atomic<uint64_t> offloaded{0};  // handed over with kTLS both ways
+    std::atomic<uint64_t> relayed{0};    // handed over through a socketpair
+};
+
+// One TLS thread and the connections it serves.
+class TlsWorker
+{
+public:
+    // ready(fd) is called on the worker's thread with the descriptor the chat
+    // code should use for each connection whose handshake completes.
+    explicit TlsWorker(std::function<void(int)> ready) : ready(std::move(ready))
+    {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epfd < 0 || wakefd < 0)
+        {
+            perror("TLS worker");
+            exit(EXIT_FAILURE);
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = wakefd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+    }
+
+    TlsWorker(const TlsWorker &) = delete;
+    TlsWorker &operator=(const TlsWorker &) = delete;
+
+    // Starts the server side of a handshake on an accepted socket. Any thread.
+    void accept(SSL_CTX *ctx, int net)
+    {
+        SSL *ssl = SSL_new(ctx);
+        if (!ssl || !SSL_set_fd(ssl, net))
+        {
+            SSL_free(ssl);
+            close(net);
+            stats.failed.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        SSL_set_accept_state(ssl);
+        post({ssl, net, -1});
+    }
+
+    // Relays for a session whose handshake is already done, such as a
+    // client's, and returns the descriptor to use in its place. Any thread.
+    int relay(SSL *ssl, int net)
+    {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+            return -1;
+        post({ssl, net, fds[0]});
+        return fds[1];
+    }
+
+    [[noreturn]] void run()
+    {
+        epoll_event events[TLS_MAX_EVENTS];
+        while (true)
+        {
+            int n = epoll_wait(epfd, events, TLS_MAX_EVENTS, again.empty() ? 1000 : 0);
+            if (n < 0 && errno != EINTR)
+            {
+                perror("TLS epoll_wait");
+                exit(EXIT_FAILURE);
+            }
+            for (int i = 0; i < n; i++)
+            {
+                int fd = events[i].data.fd;
+                if (fd == wakefd)
+                    take_jobs();
+                else if (Conn *conn = find(fd))
+                    pump(*conn);
+            }
+            std::vector<uint64_t> retry;
+            retry.swap(again);
+            for (uint64_t id : retry)
+            {
+                if (Conn *conn = find((int)(id >> 32)); conn && conn->id == (uint32_t)id)
+                    pump(*conn);
+            }
+            expire_handshakes();
+        }
+    }
+
+    const TlsStats &tls_stats() const { return stats; }
+
+private:
+    struct Job
+    {
+        SSL *ssl = nullptr;
+        int net = -1;
+        int plain = -1; // the worker's end of the pair, -1 while handshaking
+    };
+
+    struct Conn
+    {
+        uint32_t id;
+        SSL *ssl;
+        int net;
+        int plain;
+        bool handshaking;
+        uint32_t handshakeWants = EPOLLIN;
+        uint32_t readWants = EPOLLIN;  // what SSL_read last waited for
+        uint32_t writeWants = 0;       // what SSL_write last waited for
+        uint32_t netEvents = 0, plainEvents = 0; // registered with epoll
+        std::string toPlain; // decrypted, not yet taken by the server
+        std::string toNet;   // from the server, not yet taken by SSL_write
+        bool netDone = false;   // the client closed or failed
+        bool plainDone = false; // the server closed its end
+        bool plainShut = false;
+    };
+
+    void post(Job job)
+    {
+        jobs.push(job);
+        if (!wakePending.exchange(true))
+        {
+            uint64_t one = 1;
+            if (write(wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+                perror("eventfd write");
+        }
+    }
+
+    void take_jobs()
+    {
+        uint64_t count;
+        while (read(wakefd, &count, sizeof(count)) > 0)
+            ;
+        wakePending.store(false);
+        Job job;
+        while (jobs.pop(job))
+        {
+            fcntl(job.net, F_SETFL, fcntl(job.net, F_GETFL, 0) | O_NONBLOCK);
+            Conn *conn = new Conn;
+            conn->id = nextId++;
+            conn->ssl = job.ssl;
+            conn->net = job.net;
+            conn->plain = job.plain;
+            conn->handshaking = job.plain < 0;
+            set_slot(job.net, conn);
+            if (conn->handshaking)
+                deadlines.push_back({now_ms() + TLS_HANDSHAKE_MS, ((uint64_t)job.net << 32) | conn->id});
+            else
+                start_relay(*conn);
+            pump(*conn);
+        }
+    }
+
+    Conn *find(int fd) { return fd >= 0 && (size_t)fd < slots.size() ? slots[fd] : nullptr; }
+
+    void set_slot(int fd, Conn *conn)
+    {
+        if ((size_t)fd >= slots.size())
+            slots.resize(fd + 1);
+        slots[fd] = conn;
+    }
+
+    static int64_t now_ms()
+    {
+        using namespace std::chrono;
+        return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    void start_relay(Conn &conn)
+    {
+        fcntl(conn.plain, F_SETFL, fcntl(conn.plain, F_GETFL, 0) | O_NONBLOCK);
+        set_slot(conn.plain, &conn);
+    }
+
+    // Advances a connection as far as its sockets allow.
+    void pump(Conn &conn)
+    {
+        if (conn.handshaking)
+        {
+            if (!handshake(conn))
+                return;
+        }
+        if (!conn.handshaking && (!pump_in(conn) || !pump_out(conn)))
+        {
+            finish(conn);
+            return;
+        }
+        watch(conn);
+    }
+
+    // Returns false if the connection is gone: failed, or handed over whole.
+    bool handshake(Conn &conn)
+    {
+        ERR_clear_error();
+        int rc = SSL_do_handshake(conn.ssl);
+        if (rc != 1)
+        {
+            int err = SSL_get_error(conn.ssl, rc);
+            if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+            {
+                conn.handshakeWants = err == SSL_ERROR_WANT_READ ? EPOLLIN : EPOLLOUT;
+                return true;
+            }
+            stats.failed.fetch_add(1, std::memory_order_relaxed);
+            finish(conn);
+            return false;
+        }
+        conn.handshaking = false;
+        stats.handshakes.fetch_add(1, std::memory_order_relaxed);
+        if (SSL_session_reused(conn.ssl))
+            stats.resumed.fetch_add(1, std::memory_order_relaxed);
+
+        // The kernel does the rest: give the server the socket itself.
+        if (BIO_get_ktls_send(SSL_get_wbio(conn.ssl)) && BIO_get_ktls_recv(SSL_get_rbio(conn.ssl)) &&
+            !SSL_has_pending(conn.ssl))
+        {
+            int net = conn.net;
+            epoll_ctl(epfd, EPOLL_CTL_DEL, net, nullptr);
+            slots[net] = nullptr;
+            SSL_free(conn.ssl); // leaves the socket open
+            delete &conn;
+            fcntl(net, F_SETFL, fcntl(net, F_GETFL, 0) & ~O_NONBLOCK);
+            stats.offloaded.fetch_add(1, std::memory_order_relaxed);
+            ready(net);
+            return false;
+        }
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+        {
+            perror("TLS socketpair");
+            finish(conn);
+            return false;
+        }
+        conn.plain = fds[0];
+        start_relay(conn);
+        stats.relayed.fetch_add(1, std::memory_order_relaxed);
+        ready(fds[1]);
+        return true;
+    }
+
+    // Client to server: decrypts records onto the pair. Returns false when
+    // the connection should be closed.
+    bool pump_in(Conn &conn)
+    {
+        for (int budget = TLS_IO_BUDGET; budget > 0; budget--)
+        {
+            if (!conn.toPlain.empty())
+            {
+                ssize_t n = send(conn.plain, conn.toPlain.data(), conn.toPlain.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+                if (n < 0)
+                    return errno == EAGAIN || errno == EINTR;
+                conn.toPlain.erase(0, n);
+                if (!conn.toPlain.empty())
+                    return true;
+            }
+            if (conn.netDone)
+            {
+                // Let the server see the client leave.
+                if (!conn.plainShut)
+                    shutdown(conn.plain, SHUT_WR);
+                conn.plainShut = true;
+                return true;
+            }
+            ERR_clear_error();
+            int n = SSL_read(conn.ssl, scratch, sizeof(scratch));
+            if (n <= 0)
+            {
+                int err = SSL_get_error(conn.ssl, n);
+                if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+                {
+                    conn.readWants = err == SSL_ERROR_WANT_READ ? EPOLLIN : EPOLLOUT;
+                    return true;
+                }
+                conn.netDone = true; // close_notify, a reset or a bad record
+                continue;
+            }
+            ssize_t sent = send(conn.plain, scratch, n, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (sent < 0 && errno != EAGAIN && errno != EINTR)
+                return false;
+            sent = std::max<ssize_t>(sent, 0);
+            if (sent < n)
+                conn.toPlain.assign(scratch + sent, n - sent);
+        }
+        again.push_back(((uint64_t)conn.net << 32) | conn.id);
+        return true;
+    }
+
+    // Server to client: encrypts what the server wrote to the pair. Returns
+    // false when the connection should be closed.
+    bool pump_out(Conn &conn)
+    {
+        for (int budget = TLS_IO_BUDGET; budget > 0; budget--)
+        {
+            if (!conn.toNet.empty())
+            {
+                // A retried SSL_write must be given the same bytes again.
+                ERR_clear_error();
+                int n = SSL_write(conn.ssl, conn.toNet.data(), conn.toNet.size());
+                if (n <= 0)
+                    return write_blocked(conn, n);
+                conn.toNet.erase(0, n);
+                continue;
+            }
+            conn.writeWants = 0;
+            if (conn.plainDone)
+            {
+                ERR_clear_error();
+                SSL_shutdown(conn.ssl); // best effort close_notify
+                return false;
+            }
+            ssize_t n = read(conn.plain, scratch, sizeof(scratch));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && errno == EAGAIN)
+                return true;
+            if (n <= 0)
+            {
+                conn.plainDone = true;
+                continue;
+            }
+            ERR_clear_error();
+            int written = SSL_write(conn.ssl, scratch, n);
+            if (written < n)
+                conn.toNet.assign(scratch + std::max(written, 0), n - std::max(written, 0));
+            if (written <= 0)
+                return write_blocked(conn, written);
+        }
+        again.push_back(((uint64_t)conn.net << 32) | conn.id);
+        return true;
+    }
+
+    bool write_blocked(Conn &conn, int rc)
+    {
+        int err = SSL_get_error(conn.ssl, rc);
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+        {
+            conn.writeWants = err == SSL_ERROR_WANT_READ ? EPOLLIN : EPOLLOUT;
+            return true;
+        }
+        return false;
+    }
+
+    // Registers interest in exactly what the connection is waiting for.
+    void watch(Conn &conn)
+    {
+        uint32_t net, plain = 0;
+        if (conn.handshaking)
+            net = conn.handshakeWants;
+        else
+        {
+            net = conn.writeWants;
+            if (conn.toPlain.empty() && !conn.netDone)
+                net |= conn.readWants;
+            if (!conn.toPlain.empty())
+                plain |= EPOLLOUT;
+            if (conn.toNet.empty() && !conn.plainDone)
+                plain |= EPOLLIN;
+        }
+        update(conn.net, conn.netEvents, net);
+        if (conn.plain >= 0)
+            update(conn.plain, conn.plainEvents, plain);
+    }
+
+    void update(int fd, uint32_t &registered, uint32_t wanted)
+    {
+        if (registered == wanted)
+            return;
+        epoll_event ev{};
+        ev.events = wanted;
+        ev.data.fd = fd;
+        if (registered == 0 && wanted != 0)
+            epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+        else if (wanted == 0)
+            epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+        else
+            epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+        registered = wanted;
+    }
+
+    void finish(Conn &conn)
+    {
+        slots[conn.net] = nullptr;
+        if (conn.plain >= 0)
+        {
+            slots[conn.plain] = nullptr;
+            close(conn.plain);
+        }
+        SSL_free(conn.ssl);
+        close(conn.net);
+        delete &conn;
+    }
+
+    void expire_handshakes()
+    {
+        int64_t now = now_ms();
+        while (!deadlines.empty() && deadlines.front().first <= now)
+        {
+            uint64_t key = deadlines.front().second;
+            deadlines.pop_front();
+            Conn *conn = find((int)(key >> 32));
+            if (conn && conn->id == (uint32_t)key && conn->handshaking)
+            {
+                stats.failed.fetch_add(1, std::memory_order_relaxed);
+                finish(*conn);
+            }
+        }
+    }
+
+    std::function<void(int)> ready;
+    int epfd;
+    int wakefd;
+    Mailbox<Job> jobs;
+    std::atomic<bool> wakePending{false};
+    std::vector<Conn *> slots;  // by descriptor, client socket and pair end alike
+    std::vector<uint64_t> again; // (socket << 32 | id) of connections that used up their budget
+    std::deque<std::pair<int64_t, uint64_t>> deadlines; // handshakes in the order they started
+    uint32_t nextId = 0;
+    TlsStats stats;
+    char scratch[TLS_RECORD_SIZE];
+};
+
+// The server's TLS workers, sharing one context.
+class TlsTerminator
+{
+public:
+    TlsTerminator(SSL_CTX *ctx, int threads, std::function<void(int)> ready) : ctx(ctx)
+    {
+        for (int i = 0; i < threads; i++)
+            workers.push_back(std::make_unique<TlsWorker>(ready));
+        for (auto &worker : workers)
+            std::thread([w = worker.get()] { w->run(); }).detach();
+    }
+
+    // Takes an accepted socket and calls ready once its handshake completes.
+    void accept(int fd) { workers[next.fetch_add(1, std::memory_order_relaxed) % workers.size()]->accept(ctx, fd); }
+
+    // Sums the counters of every worker.
+    void totals(uint64_t &handshakes, uint64_t &resumed, uint64_t &failed, uint64_t &offloaded, uint64_t &relayed) const
+    {
+        handshakes = resumed = failed = offloaded = relayed = 0;
+        for (const auto &worker : workers)
+        {
+            const TlsStats &stats = worker->tls_stats();
+            handshakes += stats.handshakes.load(std::memory_order_relaxed);
+            resumed += stats.resumed.load(std::memory_order_relaxed);
+            failed += stats.failed.load(std::memory_order_relaxed);
+            offloaded += stats.offloaded.load(std::memory_order_relaxed);
+            relayed += stats.relayed.load(std::memory_order_relaxed);
+        }
+    }
+
+private:
+    SSL_CTX *ctx;
+    std::vector<std::unique_ptr<TlsWorker>> workers;
+    std::atomic<size_t> next{0};
+};
@@ -0,0 +1,272 @@
+// Minimal io_uring plumbing for the reactor's io_uring backend, written
+// against the raw system calls so the server does not depend on liburing.
+//
+// A Uring owns one submission/completion ring pair and, optionally, a ring of
+// provided receive buffers: equally sized buffers handed to the kernel up
+// front, from which multishot receives pick one per completion. Buffers go
+// back to the kernel once their completion has been handled.
+//
+// All methods must be called from the thread that runs the ring.
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <ctime>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+inline int io_uring_setup(unsigned entries, io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+inline int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+inline int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+class Uring
+{
+public:
+    Uring() = default;
+    Uring(const Uring &) = delete;
+    Uring &operator=(const Uring &) = delete;
+
+    ~Uring()
+    {
+        if (bufRing != MAP_FAILED)
+            munmap(bufRing, bufRingSize);
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqesSize);
+        if (cqRing != MAP_FAILED && cqRing != sqRing)
+            munmap(cqRing, cqRingSize);
+        if (sqRing != MAP_FAILED)
+            munmap(sqRing, sqRingSize);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    // Sets up a ring with entries submission slots and four times as many
+    // completion slots. Returns false, with the reason in error, if the
+    // kernel cannot provide one.
+    bool init(unsigned entries, std::string &error)
+    {
+        io_uring_params params{};
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+        params.cq_entries = entries * 4;
+        fd = io_uring_setup(entries, &params);
+        if (fd < 0 && errno == EINVAL)
+        {
+            // Kernels before 5.19 do not know COOP_TASKRUN.
+            params = io_uring_params{};
+            params.flags = IORING_SETUP_CQSIZE;
+            params.cq_entries = entries * 4;
+            fd = io_uring_setup(entries, &params);
+        }
+        if (fd < 0)
+        {
+            error = std::string("io_uring_setup: ") + strerror(errno);
+            return false;
+        }
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP) ||
+            !(params.features & IORING_FEAT_EXT_ARG))
+        {
+            error = "io_uring is too old";
+            return false;
+        }
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        cqRing = sqRing;
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqRing == MAP_FAILED || sqes == MAP_FAILED)
+        {
+            error = std::string("io_uring mmap: ") + strerror(errno);
+            return false;
+        }
+
+        char *sq = (char *)sqRing;
+        sqHead = (unsigned *)(sq + params.sq_off.head);
+        sqTail = (unsigned *)(sq + params.sq_off.tail);
+        sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+        sqEntries = params.sq_entries;
+        sqArray = (unsigned *)(sq + params.sq_off.array);
+        char *cq = (char *)cqRing;
+        cqHead = (unsigned *)(cq + params.cq_off.head);
+        cqTail = (unsigned *)(cq + params.cq_off.tail);
+        cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+        localTail = *sqTail;
+        return true;
+    }
+
+    // Registers count provided buffers of size bytes each as buffer group
+    // group. count must be a power of two.
+    bool setup_buffers(uint16_t group, unsigned count, size_t size, std::string &error)
+    {
+        bufRingSize = count * sizeof(io_uring_buf);
+        bufRing = mmap(nullptr, bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (bufRing == MAP_FAILED)
+        {
+            error = std::string("buffer ring mmap: ") + strerror(errno);
+            return false;
+        }
+        io_uring_buf_reg reg{};
+        reg.ring_addr = (uint64_t)bufRing;
+        reg.ring_entries = count;
+        reg.bgid = group;
+        if (io_uring_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        {
+            error = std::string("provided buffer ring: ") + strerror(errno);
+            return false;
+        }
+        bufferSize = size;
+        bufMask = count - 1;
+        arena.resize(count * size);
+        for (unsigned bid = 0; bid < count; bid++)
+            recycle(bid);
+        return true;
+    }
+
+    char *buffer(uint16_t bid) { return arena.data() + bid * bufferSize; }
+
+    // Hands a provided buffer back to the kernel.
+    void recycle(uint16_t bid)
+    {
+        // Not ring->bufs: the kernel header's flexible array sits at a
+        // different offset when compiled as C++.
+        io_uring_buf &buf = ((io_uring_buf *)bufRing)[bufTail & bufMask];
+        buf.addr = (uint64_t)buffer(bid);
+        buf.len = bufferSize;
+        buf.bid = bid;
+        bufTail++;
+        __atomic_store_n(&((io_uring_buf_ring *)bufRing)->tail, bufTail, __ATOMIC_RELEASE);
+    }
+
+    // A zeroed submission slot. When the ring is full, the queued entries are
+    // submitted first to make room.
+    io_uring_sqe *get_sqe()
+    {
+        while (localTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+            submit(0, 0);
+        unsigned index = localTail & sqMask;
+        io_uring_sqe *sqe = (io_uring_sqe *)sqes + index;
+        memset(sqe, 0, sizeof(*sqe));
+        sqArray[index] = index;
+        localTail++;
+        return sqe;
+    }
+
+    // Submits everything queued since the last call in one system call, then
+    // waits up to timeout_ms (forever if negative) for a completion when
+    // wait is set. Returns false on an unexpected error.
+    bool submit(int timeout_ms, bool wait)
+    {
+        __atomic_store_n(sqTail, localTail, __ATOMIC_RELEASE);
+        unsigned pending = localTail - submitted;
+        __kernel_timespec ts{timeout_ms / 1000, (long long)(timeout_ms % 1000) * 1000000};
+        io_uring_getevents_arg arg{};
+        arg.ts = timeout_ms >= 0 ? (uint64_t)&ts : 0;
+        unsigned flags = IORING_ENTER_EXT_ARG | (wait ? IORING_ENTER_GETEVENTS : 0);
+        int n = io_uring_enter(fd, pending, wait && timeout_ms != 0 ? 1 : 0, flags, &arg, sizeof(arg));
+        if (n >= 0)
+        {
+            submitted += n;
+            return true;
+        }
+        // Timeouts, signals and a full completion ring all just mean "go and
+        // reap what is there".
+        return errno == ETIME || errno == EINTR || errno == EBUSY || errno == EAGAIN;
+    }
+
+    // Calls fn on every completion available right now.
+    template <typename Fn>
+    void for_each_completion(Fn &&fn)
+    {
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        while (head != tail)
+        {
+            io_uring_cqe cqe = cqes[head & cqMask];
+            head++;
+            // Release the slot before handling it, since fn may submit more.
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+            fn(cqe);
+        }
+    }
+
+private:
+    int fd = -1;
+    void *sqRing = MAP_FAILED;
+    void *cqRing = MAP_FAILED;
+    void *sqes = MAP_FAILED;
+    size_t sqRingSize = 0, cqRingSize = 0, sqesSize = 0;
+    unsigned *sqHead = nullptr, *sqTail = nullptr, *sqArray = nullptr;
+    unsigned sqMask = 0, sqEntries = 0;
+    unsigned localTail = 0; // sqTail as it will be after the next submit
+    unsigned submitted = 0; // sqTail as the kernel last saw it
+    unsigned *cqHead = nullptr, *cqTail = nullptr;
+    unsigned cqMask = 0;
+    io_uring_cqe *cqes = nullptr;
+
+    void *bufRing = MAP_FAILED;
+    size_t bufRingSize = 0;
+    unsigned bufMask = 0;
+    uint16_t bufTail = 0;
+    size_t bufferSize = 0;
+    std::vector<char> arena; // every provided buffer, back to back
+};
+
+// Checks that this kernel supports everything the io_uring backend uses:
+// provided buffer rings and multishot receive, which arrived in Linux 6.0.
+// Sets why and returns false if not.
+inline bool uring_supported(std::string &why)
+{
+    Uring ring;
+    if (!ring.init(8, why) || !ring.setup_buffers(0, 4, 64, why))
+        return false;
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0)
+    {
+        why = std::string("socketpair: ") + strerror(errno);
+        return false;
+    }
+    io_uring_sqe *sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = pair[0];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    ring.submit(0, false);
+    bool ok = write(pair[1], "x", 1) == 1 && ring.submit(1000, true);
+    bool multishot = false;
+    ring.for_each_completion([&](const io_uring_cqe &cqe)
+    {
+        multishot = cqe.res == 1 && (cqe.flags & IORING_CQE_F_MORE) && (cqe.flags & IORING_CQE_F_BUFFER);
+    });
+    close(pair[0]);
+    close(pair[1]);
+    if (!ok || !multishot)
+    {
+        why = "multishot receive is not supported";
+        return false;
+    }
+    return true;
+}